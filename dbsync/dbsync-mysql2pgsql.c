@@ -3,6 +3,7 @@
 #include "libpq-fe.h"
 
 #include "pgsync.h"
+#include "flowctl.h"
 #include "ini.h"
 #include "mysql.h"
 #include <unistd.h>
@@ -11,8 +12,21 @@ extern bool get_ddl_only;
 extern bool simple_wo_part;
 extern bool first_col_as_dist_key;
 extern int buffer_size;
-
-static int load_table_list_file(const char *filename, char*** p_tables, char*** p_queries);
+extern int copy_memory_limit;
+extern long chunk_rows;
+extern bool binary_copy;
+extern bool prepared_fetch;
+extern bool resume_copy;
+extern bool consistent_snapshot;
+extern char *gpfdist_address;
+extern bool fast_load;
+extern bool fast_load_unlogged;
+extern int rebuild_workers;
+extern char *rebuild_work_mem;
+extern int flow_min_workers;
+extern int flow_max_workers;
+
+static int load_table_list_file(const char *filename, char*** p_tables, char*** p_queries, int** p_priorities);
 
 
 int
@@ -28,6 +42,7 @@ main(int argc, char **argv)
 	char *target_schema = NULL;
 	char *table_list_file = NULL;
 	char **tables = NULL, **queries = NULL;
+	int *priorities = NULL;
 	char	*ignore_copy_error_count_each_table_str = NULL;
 	uint32	ignore_copy_error_count_each_table = 0;
 
@@ -67,7 +82,7 @@ main(int argc, char **argv)
 
 	fprintf(stderr, "ignore copy error count %u each table\n", ignore_copy_error_count_each_table);
 
-	while ((res_getopt = getopt(argc, argv, ":l:j:dnfhs:b:")) != -1)
+	while ((res_getopt = getopt(argc, argv, ":l:j:a:dnfhs:b:c:BPm:rxg:FUi:w:")) != -1)
 	{
 		switch (res_getopt)
 		{
@@ -77,9 +92,22 @@ main(int argc, char **argv)
 			case 'j':
 				num_thread = atoi(optarg);
 				break;
+			case 'a':
+				if (!flowctl_parse(optarg, &flow_min_workers, &flow_max_workers))
+				{
+					fprintf(stderr, "invalid worker range for -a: %s, expect <min>:<max>\n", optarg);
+					return -1;
+				}
+				break;
 			case 'b':
 				buffer_size = 1024 * atoi(optarg);
 				break;
+			case 'm':
+				copy_memory_limit = atoi(optarg);
+				break;
+			case 'c':
+				chunk_rows = atol(optarg);
+				break;
 			case 's':
 				target_schema = optarg;
 				break;
@@ -95,9 +123,37 @@ main(int argc, char **argv)
 			case 'f':
 				first_col_as_dist_key = true;
 				break;
+			case 'B':
+				binary_copy = true;
+				break;
+			case 'P':
+				prepared_fetch = true;
+				break;
+			case 'r':
+				resume_copy = true;
+				break;
+			case 'x':
+				consistent_snapshot = true;
+				break;
+			case 'g':
+				gpfdist_address = optarg;
+				break;
+			case 'F':
+				fast_load = true;
+				break;
+			case 'U':
+				fast_load = true;
+				fast_load_unlogged = true;
+				break;
+			case 'i':
+				rebuild_workers = atoi(optarg);
+				break;
+			case 'w':
+				rebuild_work_mem = optarg;
+				break;
 			case 'h':
-				fprintf(stderr, "Usage: -l <table list file> -j <thread number> -d -n -f -s -b -h\n");
-				fprintf(stderr, " -l specifies a file with table listed;\n -j specifies number of threads to do the job;\n -d means get DDL only without fetching data;\n -n means no partion info in DDLs;\n -f means taking first column as distribution key;\n -s specifies the target schema;\n -b specifies the buffer size in KB used to sending copy data to target db, the default is 0");
+				fprintf(stderr, "Usage: -l <table list file> -j <thread number> -a <min>:<max> -d -n -f -s -b -m <MB> -c <rows per chunk> -B -P -r -x -g <host:port> -F -U -i <workers> -w <memory> -h\n");
+				fprintf(stderr, " -l specifies a file with table listed;\n -j specifies number of threads to do the job;\n -a lets between min and max threads copy at once, adjusted to the throughput and to how long they wait on source and target, starting from -j;\n -d means get DDL only without fetching data;\n -n means no partion info in DDLs;\n -f means taking first column as distribution key;\n -s specifies the target schema;\n -b specifies the buffer size in KB used to sending copy data to target db, the default is 0 (size it adaptively for each thread);\n -m limits the memory used for copy buffers by all threads together in MB, the default is 0 (no limit);\n -c splits tables with more rows than this into key range chunks copied in parallel, the default is 0 (no split);\n -B sends data to target in binary copy format for tables whose column types allow it, other tables are sent as csv;\n -P reads source data through server side prepared statements and a cursor, so numbers and dates arrive in binary form;\n -r records finished tables and chunks in table mysql2pgsql_progress on the target, and skips them when run again with -r;\n -x reads all tables in one consistent snapshot, started on every thread under a short FLUSH TABLES WITH READ LOCK, and prints its binlog position;\n -g serves the data of a greenplum target to its segments on host:port, which load it in parallel through an external table;\n -F truncates each target table and copies with FREEZE in the same transaction, needs PostgreSQL 9.3 or later on target;\n -U also loads into an unlogged table without FREEZE and sets it logged before commit, which rewrites the table and writes all of it to WAL, tables that are not logged already keep their persistence, needs PostgreSQL 9.5 or later on target;\n -i drops the indexes and constraints of the target tables before the copy and rebuilds them after it with this number of workers, the default is 0 (keep them during the copy);\n -w sets maintenance_work_mem of the rebuild workers, such as 1GB\n");
 				return 0;
 			case '?':
 				fprintf(stderr, "Unsupported option: %c", optopt);	
@@ -111,7 +167,7 @@ main(int argc, char **argv)
 	
 	if(table_list_file!= NULL)
 	{
-		if (load_table_list_file(table_list_file, &tables, &queries))
+		if (load_table_list_file(table_list_file, &tables, &queries, &priorities))
 		{
 			fprintf(stderr, "Error occurs while loading table list file %s \n", table_list_file);
 			return -1;
@@ -119,6 +175,7 @@ main(int argc, char **argv)
 
 		src.tabnames = (char **) tables;
 		src.queries = (char**) queries;
+		src.priorities = priorities;
 	}
 
 	/* Only one thread is needed when just generating DDL */
@@ -129,12 +186,13 @@ main(int argc, char **argv)
 }
 
 
-int load_table_list_file(const char *filename, char*** p_tables, char*** p_queries) {
+int load_table_list_file(const char *filename, char*** p_tables, char*** p_queries, int** p_priorities) {
 	FILE *fp = NULL;
 	int n, sz, num_lines = 0;
 	char *table_list = NULL;
 	char **table_array = NULL;
 	char **query_array = NULL;
+	int *priority_array = NULL;
 	char *p = NULL;
 	char *tail = NULL;
 	char *table_begin = NULL;
@@ -199,6 +257,7 @@ int load_table_list_file(const char *filename, char*** p_tables, char*** p_queri
 	/* Get memory for table array, with the last element being NULL */
 	table_array = (char **) palloc0((num_lines + 1) * sizeof(char*));
 	query_array = (char **) palloc0((num_lines + 1) * sizeof(char*));
+	priority_array = (int *) palloc0((num_lines + 1) * sizeof(int));
 
 	/* Parse data */
 	p = table_list;
@@ -209,9 +268,9 @@ int load_table_list_file(const char *filename, char*** p_tables, char*** p_queri
 		if (*p == '\n' || p == tail)
 		{
 			/* Get the table name without leanding and trailing blanks
-			  * E.g. following line will generate a table name "tab 1"
-			  *     |    tab 1   :   select * from tab | 
-			  */
+			 * E.g. following line will generate a table name "tab 1"
+			 *     |    tab 1   :   select * from tab | 
+			 */
 			while (*table_begin == ' ' || *table_begin == '\t')
 				table_begin++;
 			
@@ -240,10 +299,29 @@ int load_table_list_file(const char *filename, char*** p_tables, char*** p_queri
 
 			if (table_begin)
 			{
+				/* An optional "@N" after the table name sets its priority
+				 * E.g. following line will generate table "tab1" with priority 10
+				 *     | tab1 @10 : select * from tab |
+				 * Only a last "@" that follows a blank and is followed by digits
+				 * alone counts, "tab@1" is a table name.
+				 */
+				char *at = strrchr(table_begin, '@');
+
+				if (at != NULL && at > table_begin && (at[-1] == ' ' || at[-1] == '\t') &&
+					at[1] != '\0' && strspn(at + 1, "0123456789") == strlen(at + 1))
+				{
+					priority_array[cur_table] = atoi(at + 1);
+					for (*at-- = '\0'; at >= table_begin && (*at == ' ' || *at == '\t'); at--)
+						*at = '\0';
+				}
+
 				table_array[cur_table] = table_begin;
 				query_array[cur_table] = query_begin;
 				cur_table++;
-				fprintf(stderr, "-- Adding table: %s\n", table_begin);
+				if (priority_array[cur_table - 1] != 0)
+					fprintf(stderr, "-- Adding table: %s (priority %d)\n", table_begin, priority_array[cur_table - 1]);
+				else
+					fprintf(stderr, "-- Adding table: %s\n", table_begin);
 			}
 			
 			table_begin = p + 1;
@@ -256,6 +334,7 @@ int load_table_list_file(const char *filename, char*** p_tables, char*** p_queri
 	fclose(fp);
 	*p_tables = table_array;
 	*p_queries = query_array;
+	*p_priorities = priority_array;
 	return 0;
 
 fail:
@@ -267,6 +346,8 @@ fail:
 		free(table_array);
 	if (query_array)
 		free(query_array);
+	if (priority_array)
+		free(priority_array);
 	
 	return -1;
 }
@@ -12,7 +12,26 @@
 
 #include "pg_logicaldecode.h"
 #include "pgsync.h"
+#include "flowctl.h"
 #include "ini.h"
+#include <unistd.h>
+
+extern int chunk_pages;
+extern int segment_group;
+extern int fan_out;
+extern bool binary_copy;
+extern int copies_per_thread;
+extern bool relation_cache;
+extern bool binary_values;
+extern char *publication_names;
+extern int decode_workers;
+extern char *gpfdist_address;
+extern bool fast_load;
+extern bool fast_load_unlogged;
+extern int rebuild_workers;
+extern char *rebuild_work_mem;
+extern int flow_min_workers;
+extern int flow_max_workers;
 
 int
 main(int argc, char **argv)
@@ -21,6 +40,8 @@ main(int argc, char **argv)
 	char	*desc = NULL;
 	char	*local = NULL;
 	void	*cfg = NULL;
+	int		res_getopt = 0;
+	int		num_thread = 5;
 
 	cfg = init_config("my.cfg");
 	if (cfg == NULL)
@@ -39,6 +60,79 @@ main(int argc, char **argv)
 		return 1;
 	}
 
-	return db_sync_main(src, desc, local ,5);
+	while ((res_getopt = getopt(argc, argv, ":j:a:c:S:k:Be:g:FUi:w:RVP:D:h")) != -1)
+	{
+		switch (res_getopt)
+		{
+			case 'j':
+				num_thread = atoi(optarg);
+				break;
+			case 'a':
+				if (!flowctl_parse(optarg, &flow_min_workers, &flow_max_workers))
+				{
+					fprintf(stderr, "invalid worker range for -a: %s, expect <min>:<max>\n", optarg);
+					return -1;
+				}
+				break;
+			case 'c':
+				chunk_pages = atoi(optarg);
+				break;
+			case 'S':
+				segment_group = atoi(optarg);
+				break;
+			case 'k':
+				fan_out = atoi(optarg);
+				break;
+			case 'B':
+				binary_copy = true;
+				break;
+			case 'e':
+				copies_per_thread = atoi(optarg);
+				break;
+			case 'g':
+				gpfdist_address = optarg;
+				break;
+			case 'F':
+				fast_load = true;
+				break;
+			case 'U':
+				fast_load = true;
+				fast_load_unlogged = true;
+				break;
+			case 'i':
+				rebuild_workers = atoi(optarg);
+				break;
+			case 'w':
+				rebuild_work_mem = optarg;
+				break;
+			case 'R':
+				relation_cache = true;
+				break;
+			case 'V':
+				binary_values = true;
+				break;
+			case 'P':
+				publication_names = optarg;
+				break;
+			case 'D':
+				decode_workers = atoi(optarg);
+				break;
+			case ':':
+				fprintf(stderr, "No value specified for -%c\n", optopt);
+				break;
+			case 'h':
+				fprintf(stderr, "Usage: -j <thread number> -a <min>:<max> -c <pages per chunk> -S <segments per task> -k <writers per table> -B -e <copies per thread> -g <host:port> -F -U -i <workers> -w <memory> -R -V -P <publications> -D <decode workers> -h\n");
+				fprintf(stderr, " -j specifies number of threads to do the job, the default is 5;\n -a lets between min and max threads copy at once, adjusted to the throughput and to how long they wait on source and target, starting from -j;\n -c splits tables with more pages than this into ctid block range chunks copied in parallel, needs PostgreSQL 14 or later on source, the default is 0 (no split);\n -S copies the tables of a greenplum source by groups of this many segments, each in a task of its own, only tables with more than -c pages when -c is given, the default is 0 (no split);\n -k deals the rows read by each source COPY round robin to this many target connections, each with its own COPY, committed together once all of them succeed, with -F the tables are truncated before the copy instead, without FREEZE, and -U does not apply, the default is 1;\n -B copies tables in binary format when source and target have the same major version and the same built in column types, other tables are copied as text;\n -e copies this many tables at once in each thread through nonblocking connections and epoll, for many small tables, the default is 1;\n -g serves the data of a greenplum target to its segments on host:port, which load it in parallel through an external table;\n -F truncates each target table and copies with FREEZE in the same transaction, needs PostgreSQL 9.3 or later on target;\n -U also loads into an unlogged table without FREEZE and sets it logged before commit, which rewrites the table and writes all of it to WAL, tables that are not logged already keep their persistence, needs PostgreSQL 9.5 or later on target;\n -i drops the indexes and constraints of the target tables before the copy and rebuilds them after it with this number of workers, the default is 0 (keep them during the copy);\n -w sets maintenance_work_mem of the rebuild workers, such as 1GB;\n -R has the ali_decoding plugin describe each relation once by id during incremental sync, instead of sending the column info with every change, needs a plugin that supports relation_cache;\n -V has the ali_decoding plugin send column values of the built in types in binary send/recv form during incremental sync, which the client renders without a text output function on the source, needs a plugin that supports binary_values;\n -P decodes incremental sync with the built-in pgoutput plugin from these comma separated publications instead of ali_decoding, streaming large transactions before they commit on PostgreSQL 14 or later, -R does not apply and -V needs 14 or later;\n -D decodes the incremental changes and generates their SQL with this many threads while one thread receives the stream and one stages the SQL in commit order, the default is 2\n");
+				return 0;
+			case '?':
+				fprintf(stderr, "Unsupported option: %c", optopt);
+				break;
+			default:
+				fprintf(stderr, "Parameter parsing error: %c", res_getopt);
+				return -1;
+		}
+	}
+
+	return db_sync_main(src, desc, local, num_thread);
 }
 
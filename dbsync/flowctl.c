@@ -0,0 +1,228 @@
+/*
+ * flowctl.c
+ *
+ * Adaptive number of copy workers, see flowctl.h.
+ */
+#include "postgres_fe.h"
+#include "common/fe_memutils.h"
+
+#include "misc.h"
+#include "flowctl.h"
+
+#include <sys/time.h>
+
+/* length of a measuring window */
+#define FLOWCTL_WINDOW_MSEC		3000
+/* an added worker must raise the throughput by this much to stay */
+#define FLOWCTL_GAIN			0.05
+/* the same workers moving this much less is congestion */
+#define FLOWCTL_DROP			0.15
+/* or waiting this many times longer per MB moved */
+#define FLOWCTL_LATENCY_RISE	1.5
+/* windows to wait after a step back before adding a worker again */
+#define FLOWCTL_HOLD			3
+
+struct FlowControl
+{
+	int			min_workers;
+	int			max_workers;
+	int			limit;			/* workers allowed to run a task */
+	int			active;			/* workers running a task */
+
+	/* totals of the current window */
+	FlowMeter	window;
+
+	double		prev_rate;		/* bytes per second of the previous window, -1 if none */
+	double		prev_latency;	/* msec blocked per MB in the previous window */
+	int			last_change;	/* change of limit after the previous window */
+	int			hold;
+	bool		stop;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	changed;	/* limit raised, a worker released, or stop */
+	pthread_cond_t	tick;		/* stop, to end the current window early */
+	Thread		thread;
+};
+
+static void *flowctl_run(void *arg);
+
+/* Parse "min:max", return false if it is not valid */
+bool
+flowctl_parse(const char *arg, int *min_workers, int *max_workers)
+{
+	if (sscanf(arg, "%d:%d", min_workers, max_workers) != 2)
+		return false;
+
+	return *min_workers >= 1 && *max_workers >= *min_workers;
+}
+
+FlowControl *
+flowctl_start(int min_workers, int max_workers, int start_workers)
+{
+	FlowControl *fc = (FlowControl *) palloc0(sizeof(FlowControl));
+
+	fc->min_workers = min_workers;
+	fc->max_workers = max_workers;
+	fc->limit = Max(min_workers, Min(max_workers, start_workers));
+	fc->prev_rate = -1;
+	pthread_mutex_init(&fc->lock, NULL);
+	pthread_cond_init(&fc->changed, NULL);
+	pthread_cond_init(&fc->tick, NULL);
+
+	fprintf(stderr, "flow control: start with %d workers, between %d and %d\n",
+			fc->limit, min_workers, max_workers);
+	ThreadCreate(&fc->thread, flowctl_run, fc);
+
+	return fc;
+}
+
+void
+flowctl_stop(FlowControl *fc)
+{
+	pthread_mutex_lock(&fc->lock);
+	fc->stop = true;
+	pthread_cond_broadcast(&fc->changed);
+	pthread_cond_broadcast(&fc->tick);
+	pthread_mutex_unlock(&fc->lock);
+
+	WaitThreadEnd(1, &fc->thread);
+}
+
+/* Wait until the worker may run a task */
+void
+flowctl_acquire(FlowControl *fc)
+{
+	pthread_mutex_lock(&fc->lock);
+	while (fc->active >= fc->limit && !fc->stop)
+		pthread_cond_wait(&fc->changed, &fc->lock);
+	fc->active++;
+	pthread_mutex_unlock(&fc->lock);
+}
+
+void
+flowctl_release(FlowControl *fc)
+{
+	pthread_mutex_lock(&fc->lock);
+	fc->active--;
+	pthread_cond_broadcast(&fc->changed);
+	pthread_mutex_unlock(&fc->lock);
+}
+
+/* Add a meter to the current window and reset it */
+void
+flowctl_report(FlowControl *fc, FlowMeter *meter)
+{
+	pthread_mutex_lock(&fc->lock);
+	fc->window.rows += meter->rows;
+	fc->window.bytes += meter->bytes;
+	fc->window.fetch_msec += meter->fetch_msec;
+	fc->window.send_msec += meter->send_msec;
+	pthread_mutex_unlock(&fc->lock);
+
+	memset(meter, 0, sizeof(FlowMeter));
+}
+
+/* Milliseconds since *mark, which is moved to now */
+double
+flowctl_lap(TimevalStruct *mark)
+{
+	TimevalStruct now;
+	double		elapsed_msec = 0;
+
+	GETTIMEOFDAY(&now);
+	DIFF_MSEC(&now, mark, elapsed_msec);
+	*mark = now;
+
+	return elapsed_msec;
+}
+
+/*
+ * Decide the change of the number of workers after a window, called with
+ * the lock held.
+ */
+static int
+flowctl_decide(FlowControl *fc, double rate, double latency)
+{
+	int			change = 0;
+
+	if (fc->prev_rate < 0)
+		return 0;
+
+	if (fc->last_change > 0 && rate < fc->prev_rate * (1 + FLOWCTL_GAIN))
+	{
+		/* The added worker did not pay off, give it back */
+		change = -1;
+		fc->hold = FLOWCTL_HOLD;
+	}
+	else if (fc->last_change == 0 &&
+			 (rate < fc->prev_rate * (1 - FLOWCTL_DROP) ||
+			  (fc->prev_latency > 0 && latency > fc->prev_latency * FLOWCTL_LATENCY_RISE)))
+	{
+		/* Source or target struggles, back off */
+		change = -Max(1, fc->limit / 4);
+		fc->hold = FLOWCTL_HOLD;
+	}
+	else if (fc->hold > 0)
+		fc->hold--;
+	else
+		change = 1;
+
+	return change;
+}
+
+static void *
+flowctl_run(void *arg)
+{
+	FlowControl *fc = (FlowControl *) arg;
+	struct timeval before,
+				after;
+
+	gettimeofday(&before, NULL);
+	pthread_mutex_lock(&fc->lock);
+	while (!fc->stop)
+	{
+		struct timespec deadline;
+		double		elapsed_msec;
+		double		rate;
+		double		latency;
+		int			limit;
+
+		gettimeofday(&after, NULL);
+		deadline.tv_sec = after.tv_sec + FLOWCTL_WINDOW_MSEC / 1000;
+		deadline.tv_nsec = after.tv_usec * 1000;
+		pthread_cond_timedwait(&fc->tick, &fc->lock, &deadline);
+		if (fc->stop)
+			break;
+
+		gettimeofday(&after, NULL);
+		elapsed_msec = (after.tv_sec - before.tv_sec) * 1000.0 + (after.tv_usec - before.tv_usec) / 1000.0;
+		before = after;
+		if (elapsed_msec <= 0 || fc->active == 0)
+			continue;
+
+		rate = fc->window.bytes * 1000.0 / elapsed_msec;
+		latency = fc->window.bytes > 0 ?
+			(fc->window.fetch_msec + fc->window.send_msec) / (fc->window.bytes / (1024.0 * 1024.0)) : 0;
+
+		limit = fc->limit + flowctl_decide(fc, rate, latency);
+		limit = Max(fc->min_workers, Min(fc->max_workers, limit));
+		fc->last_change = limit - fc->limit;
+		if (fc->last_change != 0)
+		{
+			fprintf(stderr, "flow control: %d -> %d workers, %.1f MB/s %.0f rows/s, blocked on source %.1f ms and target %.1f ms per MB\n",
+					fc->limit, limit, rate / (1024 * 1024), fc->window.rows * 1000.0 / elapsed_msec,
+					fc->window.bytes > 0 ? fc->window.fetch_msec / (fc->window.bytes / (1024.0 * 1024.0)) : 0,
+					fc->window.bytes > 0 ? fc->window.send_msec / (fc->window.bytes / (1024.0 * 1024.0)) : 0);
+			fc->limit = limit;
+			pthread_cond_broadcast(&fc->changed);
+		}
+
+		fc->prev_rate = rate;
+		fc->prev_latency = latency;
+		memset(&fc->window, 0, sizeof(FlowMeter));
+	}
+	pthread_mutex_unlock(&fc->lock);
+
+	ThreadExit(0);
+	return NULL;
+}
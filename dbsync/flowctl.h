@@ -0,0 +1,36 @@
+#ifndef PG_FLOWCTL_H
+#define PG_FLOWCTL_H
+
+#include "postgres_fe.h"
+
+#include "misc.h"
+#include "pgsync.h"
+
+/*
+ * Adaptive number of copy workers.  All worker threads are started, but
+ * only as many as the controller allows run a task at a time, the others
+ * are parked between tasks.  Every window the controller compares the
+ * throughput and the time the workers spent blocked on source and target
+ * with the previous window: it adds a worker while that pays off and cuts
+ * the workers by a quarter when the same workers get slower, AIMD style.
+ */
+typedef struct FlowControl FlowControl;
+
+/* What a worker moved and how long it waited, reported in batches */
+typedef struct FlowMeter
+{
+	int64		rows;
+	int64		bytes;
+	double		fetch_msec;		/* blocked reading the source */
+	double		send_msec;		/* blocked writing the target */
+} FlowMeter;
+
+extern bool flowctl_parse(const char *arg, int *min_workers, int *max_workers);
+extern FlowControl *flowctl_start(int min_workers, int max_workers, int start_workers);
+extern void flowctl_stop(FlowControl *fc);
+extern void flowctl_acquire(FlowControl *fc);
+extern void flowctl_release(FlowControl *fc);
+extern void flowctl_report(FlowControl *fc, FlowMeter *meter);
+extern double flowctl_lap(TimevalStruct *mark);
+
+#endif
@@ -0,0 +1,782 @@
+/*
+ * gpfdist.c
+ *
+ * Minimal gpfdist protocol server, see gpfdist.h.  Each request of a
+ * segment is served by its own thread, which sends the blocks of the feed
+ * the url names until the feed is finished.  With X-GP-PROTO 1 every block
+ * goes out as an 'O' (offset) and a 'D' (data) message, and an empty 'D'
+ * message tells the segment the data is complete.  With protocol 0 the
+ * data is sent as is and the connection is closed at the end.
+ */
+#include "postgres_fe.h"
+#include "common/fe_memutils.h"
+
+#include "libpq-fe.h"
+#include "pqexpbuffer.h"
+
+#include "misc.h"
+#include "gpfdist.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/* blocks queued per feed, each is one copy chunk of the sender */
+#define GPFDIST_FEED_DEPTH		8
+/* how long a full feed is waited on before checking the INSERT is still running */
+#define GPFDIST_POLL_MSEC		1000
+#define GPFDIST_MAX_REQUEST		16384
+#define GPFDIST_EXT_PREFIX		"dbsync_ext"
+
+typedef struct GpfdistBlock
+{
+	char	   *data;
+	int			len;
+	int64		offset;			/* of the block in the data of the feed */
+} GpfdistBlock;
+
+struct GpfdistFeed
+{
+	GpfdistServer  *server;
+	int				id;
+	char		   *path;
+	char		   *url;
+	char		   *ext_name;		/* qualified name of the external table */
+	char		   *target;			/* qualified name of the target table */
+
+	GpfdistBlock	blocks[GPFDIST_FEED_DEPTH];
+	int				head;
+	int				count;
+	int64			offset;			/* bytes queued so far */
+	bool			finished;		/* no more blocks will be queued */
+	bool			failed;
+	int				nreader;		/* requests being served */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	changed;
+
+	struct GpfdistFeed *next;
+};
+
+struct GpfdistServer
+{
+	int				listen_fd;
+	char		   *host;			/* as given in the urls */
+	int				port;
+	int				next_feed_id;
+	GpfdistFeed	   *feeds;
+	int				nrequest;		/* request threads running */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	idle;			/* a request thread ended */
+	pthread_t		listener;
+};
+
+typedef struct GpfdistRequest
+{
+	GpfdistServer  *server;
+	int				fd;
+} GpfdistRequest;
+
+static void *gpfdist_listen(void *arg);
+static void *gpfdist_serve(void *arg);
+static bool gpfdist_write(int fd, const char *data, size_t len);
+static bool gpfdist_write_message(int fd, char type, const char *data, int len);
+static const char *gpfdist_header(const char *request, const char *name);
+static GpfdistFeed *gpfdist_feed_open(GpfdistServer *server);
+static GpfdistFeed *gpfdist_feed_attach(GpfdistServer *server, const char *path);
+static int gpfdist_feed_put(GpfdistFeed *feed, const char *data, int len, int timeout_msec);
+static int gpfdist_feed_take(GpfdistFeed *feed, GpfdistBlock *block);
+static bool gpfdist_feed_close(GpfdistFeed *feed, bool ok);
+static char *gpfdist_strndup(const char *src, size_t len);
+
+/*
+ * Start serving on address, given as host:port.  Port 0 picks a free port.
+ */
+GpfdistServer *
+gpfdist_start(const char *address)
+{
+	GpfdistServer *server = NULL;
+	struct addrinfo hints;
+	struct addrinfo *addrs = NULL;
+	struct sockaddr_storage bound;
+	socklen_t	bound_len = sizeof(bound);
+	const char *colon;
+	char	   *host = NULL;
+	char		port[32];
+	int			fd = -1;
+	int			on = 1;
+	int			rc;
+
+	colon = strrchr(address, ':');
+	if (colon == NULL || strlen(colon + 1) >= sizeof(port))
+	{
+		fprintf(stderr, "gpfdist address %s is not host:port\n", address);
+		return NULL;
+	}
+	host = gpfdist_strndup(address, colon - address);
+	strcpy(port, colon + 1);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &addrs);
+	if (rc != 0)
+	{
+		fprintf(stderr, "resolve gpfdist address %s failed: %s\n", address, gai_strerror(rc));
+		goto fail;
+	}
+
+	fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+	if (fd < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+		bind(fd, addrs->ai_addr, addrs->ai_addrlen) != 0 ||
+		listen(fd, 128) != 0 ||
+		getsockname(fd, (struct sockaddr *) &bound, &bound_len) != 0)
+	{
+		fprintf(stderr, "listen on gpfdist address %s failed: %s\n", address, strerror(errno));
+		goto fail;
+	}
+
+	server = (GpfdistServer *) palloc0(sizeof(GpfdistServer));
+	server->listen_fd = fd;
+	server->port = ntohs(bound.ss_family == AF_INET6 ?
+						 ((struct sockaddr_in6 *) &bound)->sin6_port :
+						 ((struct sockaddr_in *) &bound)->sin_port);
+
+	/* Segments need a name to reach us by, not the wildcard address */
+	if (host[0] == '\0' || strcmp(host, "0.0.0.0") == 0 || strcmp(host, "::") == 0)
+	{
+		char	hostname[256];
+
+		if (gethostname(hostname, sizeof(hostname)) != 0)
+		{
+			fprintf(stderr, "get host name failed: %s\n", strerror(errno));
+			goto fail;
+		}
+		hostname[sizeof(hostname) - 1] = '\0';
+		pfree(host);
+		host = pstrdup(hostname);
+	}
+	server->host = host;
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+
+	if (pthread_create(&server->listener, NULL, gpfdist_listen, server) != 0)
+	{
+		fprintf(stderr, "start gpfdist listener failed\n");
+		goto fail;
+	}
+
+	freeaddrinfo(addrs);
+	fprintf(stderr, "gpfdist server listening on %s:%d\n", server->host, server->port);
+
+	return server;
+
+fail:
+	if (addrs)
+		freeaddrinfo(addrs);
+	if (fd >= 0)
+		close(fd);
+	if (server)
+		pfree(server);
+	if (host)
+		pfree(host);
+
+	return NULL;
+}
+
+/*
+ * Stop listening and free the server.  Feeds whose load was not ended are
+ * closed as failed, which lets their readers go, and freed.
+ */
+void
+gpfdist_stop(GpfdistServer *server)
+{
+	shutdown(server->listen_fd, SHUT_RDWR);
+	close(server->listen_fd);
+	pthread_join(server->listener, NULL);
+
+	for (;;)
+	{
+		GpfdistFeed *feed;
+
+		pthread_mutex_lock(&server->lock);
+		feed = server->feeds;
+		pthread_mutex_unlock(&server->lock);
+		if (feed == NULL)
+			break;
+		gpfdist_feed_close(feed, false);
+	}
+
+	pthread_mutex_lock(&server->lock);
+	while (server->nrequest > 0)
+		pthread_cond_wait(&server->idle, &server->lock);
+	pthread_mutex_unlock(&server->lock);
+
+	pthread_mutex_destroy(&server->lock);
+	pthread_cond_destroy(&server->idle);
+	pfree(server->host);
+	pfree(server);
+}
+
+static void *
+gpfdist_listen(void *arg)
+{
+	GpfdistServer *server = (GpfdistServer *) arg;
+
+	for (;;)
+	{
+		GpfdistRequest *req;
+		pthread_t	th;
+		int			fd;
+
+		fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		req = (GpfdistRequest *) palloc0(sizeof(GpfdistRequest));
+		req->server = server;
+		req->fd = fd;
+		pthread_mutex_lock(&server->lock);
+		server->nrequest++;
+		pthread_mutex_unlock(&server->lock);
+		if (pthread_create(&th, NULL, gpfdist_serve, req) != 0)
+		{
+			fprintf(stderr, "start gpfdist request thread failed\n");
+			pthread_mutex_lock(&server->lock);
+			server->nrequest--;
+			pthread_mutex_unlock(&server->lock);
+			close(fd);
+			pfree(req);
+			continue;
+		}
+		pthread_detach(th);
+	}
+
+	return NULL;
+}
+
+static void *
+gpfdist_serve(void *arg)
+{
+	GpfdistRequest *req = (GpfdistRequest *) arg;
+	int			fd = req->fd;
+	GpfdistFeed *feed = NULL;
+	char		request[GPFDIST_MAX_REQUEST];
+	int			len = 0;
+	const char *value;
+	char	   *path;
+	char	   *end;
+	int			proto = 0;
+	bool		done = false;
+	PQExpBuffer	reply = createPQExpBuffer();
+
+	/* Read the request head, the segments send no body */
+	while (len < (int) sizeof(request) - 1)
+	{
+		ssize_t		n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+
+		if (n <= 0)
+			goto exit;
+		len += n;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	if (strncmp(request, "GET ", 4) != 0 || (end = strchr(request + 4, ' ')) == NULL)
+	{
+		appendPQExpBufferStr(reply, "HTTP/1.0 400 bad request\r\nConnection: close\r\n\r\n");
+		gpfdist_write(fd, reply->data, reply->len);
+		goto exit;
+	}
+	path = gpfdist_strndup(request + 4, end - (request + 4));
+
+	if ((value = gpfdist_header(request, "X-GP-PROTO")) != NULL)
+		proto = atoi(value);
+	done = gpfdist_header(request, "X-GP-DONE") != NULL;
+
+	/* The last request of a segment only says it is done */
+	if (!done)
+		feed = gpfdist_feed_attach(req->server, path);
+	pfree(path);
+
+	if (!done && feed == NULL)
+	{
+		appendPQExpBufferStr(reply, "HTTP/1.0 404 file not found\r\nConnection: close\r\n\r\n");
+		gpfdist_write(fd, reply->data, reply->len);
+		goto exit;
+	}
+
+	appendPQExpBufferStr(reply, "HTTP/1.0 200 ok\r\n"
+						 "Content-type: text/plain\r\n"
+						 "Expires: 0\r\n"
+						 "X-GPFDIST-VERSION: dbsync\r\n");
+	if (proto == 1)
+		appendPQExpBufferStr(reply, "X-GP-PROTO: 1\r\n");
+	appendPQExpBufferStr(reply, "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+	if (!gpfdist_write(fd, reply->data, reply->len) || done)
+		goto exit;
+
+	if (proto == 1 &&
+		!gpfdist_write_message(fd, 'F', feed->path, strlen(feed->path)))
+		goto exit;
+
+	for (;;)
+	{
+		GpfdistBlock block;
+		int			rc = gpfdist_feed_take(feed, &block);
+		bool		ok = true;
+
+		if (rc < 0)
+			goto exit;
+		if (rc == 0)
+			break;
+
+		if (proto == 1)
+		{
+			uint32		offset[2];
+
+			offset[0] = htonl((uint32) (block.offset >> 32));
+			offset[1] = htonl((uint32) block.offset);
+			ok = gpfdist_write_message(fd, 'O', (char *) offset, sizeof(offset)) &&
+				gpfdist_write_message(fd, 'D', block.data, block.len);
+		}
+		else
+			ok = gpfdist_write(fd, block.data, block.len);
+		pfree(block.data);
+
+		/* The rows of the block are lost, the load has to fail */
+		if (!ok)
+		{
+			pthread_mutex_lock(&feed->lock);
+			feed->failed = true;
+			pthread_cond_broadcast(&feed->changed);
+			pthread_mutex_unlock(&feed->lock);
+			goto exit;
+		}
+	}
+
+	if (proto == 1)
+		gpfdist_write_message(fd, 'D', NULL, 0);
+
+exit:
+	if (feed)
+	{
+		pthread_mutex_lock(&feed->lock);
+		feed->nreader--;
+		pthread_cond_broadcast(&feed->changed);
+		pthread_mutex_unlock(&feed->lock);
+	}
+	destroyPQExpBuffer(reply);
+	close(fd);
+
+	pthread_mutex_lock(&req->server->lock);
+	req->server->nrequest--;
+	pthread_cond_broadcast(&req->server->idle);
+	pthread_mutex_unlock(&req->server->lock);
+	pfree(req);
+
+	return NULL;
+}
+
+static bool
+gpfdist_write(int fd, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		n = send(fd, data, len, MSG_NOSIGNAL);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* One protocol 1 message: type, 4 byte length and the data */
+static bool
+gpfdist_write_message(int fd, char type, const char *data, int len)
+{
+	char		head[5];
+	uint32		nlen = htonl((uint32) len);
+
+	head[0] = type;
+	memcpy(head + 1, &nlen, 4);
+
+	return gpfdist_write(fd, head, sizeof(head)) &&
+		gpfdist_write(fd, data, len);
+}
+
+/*
+ * Return the value of a request header, or NULL.  The value runs up to the
+ * end of the line, which is good enough for the numbers we look at.
+ */
+static const char *
+gpfdist_header(const char *request, const char *name)
+{
+	const char *line = strstr(request, "\r\n");
+	size_t		namelen = strlen(name);
+
+	while (line != NULL && line[2] != '\r')
+	{
+		line += 2;
+		if (pg_strncasecmp(line, name, namelen) == 0 && line[namelen] == ':')
+		{
+			const char *value = line + namelen + 1;
+
+			while (*value == ' ' || *value == '\t')
+				value++;
+			return value;
+		}
+		line = strstr(line, "\r\n");
+	}
+
+	return NULL;
+}
+
+static char *
+gpfdist_strndup(const char *src, size_t len)
+{
+	char	   *dst = palloc(len + 1);
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	return dst;
+}
+
+static GpfdistFeed *
+gpfdist_feed_open(GpfdistServer *server)
+{
+	GpfdistFeed *feed = (GpfdistFeed *) palloc0(sizeof(GpfdistFeed));
+	PQExpBuffer	buf = createPQExpBuffer();
+
+	pthread_mutex_init(&feed->lock, NULL);
+	pthread_cond_init(&feed->changed, NULL);
+	feed->server = server;
+
+	pthread_mutex_lock(&server->lock);
+	feed->id = server->next_feed_id++;
+	appendPQExpBuffer(buf, "/dbsync/%d/%d", (int) getpid(), feed->id);
+	feed->path = pstrdup(buf->data);
+	feed->next = server->feeds;
+	server->feeds = feed;
+	pthread_mutex_unlock(&server->lock);
+
+	resetPQExpBuffer(buf);
+	appendPQExpBuffer(buf, "gpfdist://%s:%d%s", server->host, server->port, feed->path);
+	feed->url = pstrdup(buf->data);
+	destroyPQExpBuffer(buf);
+
+	return feed;
+}
+
+/* Find the feed of path and count a reader in */
+static GpfdistFeed *
+gpfdist_feed_attach(GpfdistServer *server, const char *path)
+{
+	GpfdistFeed *feed;
+
+	pthread_mutex_lock(&server->lock);
+	for (feed = server->feeds; feed != NULL; feed = feed->next)
+	{
+		if (strcmp(feed->path, path) == 0)
+		{
+			pthread_mutex_lock(&feed->lock);
+			feed->nreader++;
+			pthread_mutex_unlock(&feed->lock);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	return feed;
+}
+
+/*
+ * Queue a copy of data.  Return 1 when queued, 0 if the feed stayed full
+ * for timeout_msec, -1 if the feed failed.
+ */
+static int
+gpfdist_feed_put(GpfdistFeed *feed, const char *data, int len, int timeout_msec)
+{
+	struct timeval now;
+	struct timespec deadline;
+	GpfdistBlock *block;
+	int			rc = 1;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_msec / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000L + (timeout_msec % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&feed->lock);
+	while (feed->count == GPFDIST_FEED_DEPTH && !feed->failed)
+	{
+		if (pthread_cond_timedwait(&feed->changed, &feed->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if (feed->failed)
+		rc = -1;
+	else if (feed->count == GPFDIST_FEED_DEPTH)
+		rc = 0;
+	else
+	{
+		block = &feed->blocks[(feed->head + feed->count) % GPFDIST_FEED_DEPTH];
+		block->data = palloc(len);
+		memcpy(block->data, data, len);
+		block->len = len;
+		block->offset = feed->offset;
+		feed->offset += len;
+		feed->count++;
+		pthread_cond_broadcast(&feed->changed);
+	}
+	pthread_mutex_unlock(&feed->lock);
+
+	return rc;
+}
+
+/*
+ * Take the next block off the feed, waiting for one.  Return 1 with a
+ * block, 0 once the feed is finished and drained, -1 if it failed.
+ */
+static int
+gpfdist_feed_take(GpfdistFeed *feed, GpfdistBlock *block)
+{
+	int			rc = 1;
+
+	pthread_mutex_lock(&feed->lock);
+	while (feed->count == 0 && !feed->finished && !feed->failed)
+		pthread_cond_wait(&feed->changed, &feed->lock);
+
+	if (feed->failed)
+		rc = -1;
+	else if (feed->count == 0)
+		rc = 0;
+	else
+	{
+		*block = feed->blocks[feed->head];
+		feed->head = (feed->head + 1) % GPFDIST_FEED_DEPTH;
+		feed->count--;
+		pthread_cond_broadcast(&feed->changed);
+	}
+	pthread_mutex_unlock(&feed->lock);
+
+	return rc;
+}
+
+/*
+ * Unregister the feed, wait for the requests serving it and free it.
+ * Return false if it failed, or if data was left that nobody read.
+ */
+static bool
+gpfdist_feed_close(GpfdistFeed *feed, bool ok)
+{
+	GpfdistServer *server = feed->server;
+	GpfdistFeed **link;
+
+	pthread_mutex_lock(&server->lock);
+	for (link = &server->feeds; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == feed)
+		{
+			*link = feed->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	pthread_mutex_lock(&feed->lock);
+	if (!ok)
+		feed->failed = true;
+	feed->finished = true;
+	pthread_cond_broadcast(&feed->changed);
+	while (feed->nreader > 0)
+		pthread_cond_wait(&feed->changed, &feed->lock);
+	pthread_mutex_unlock(&feed->lock);
+
+	if (ok && feed->count > 0)
+	{
+		fprintf(stderr, "gpfdist: %d blocks of %s were never read\n", feed->count, feed->url);
+		ok = false;
+	}
+	ok = ok && !feed->failed;
+
+	while (feed->count > 0)
+	{
+		pfree(feed->blocks[feed->head].data);
+		feed->head = (feed->head + 1) % GPFDIST_FEED_DEPTH;
+		feed->count--;
+	}
+
+	pthread_mutex_destroy(&feed->lock);
+	pthread_cond_destroy(&feed->changed);
+	pfree(feed->path);
+	pfree(feed->url);
+	if (feed->ext_name)
+		pfree(feed->ext_name);
+	if (feed->target)
+		pfree(feed->target);
+	pfree(feed);
+
+	return ok;
+}
+
+/*
+ * Start loading relname through the server: create an external table
+ * reading a new feed, with the given FORMAT clause and options, and send
+ * the INSERT that pulls from it without waiting for it.  Runs in the
+ * transaction the caller opened on conn.  Return NULL on error.
+ */
+GpfdistFeed *
+gpfdist_load_begin(GpfdistServer *server, PGconn *conn, const char *schemaname,
+				   const char *relname, const char *format)
+{
+	GpfdistFeed *feed = gpfdist_feed_open(server);
+	PQExpBuffer	query = createPQExpBuffer();
+	char	   *nsp = NULL;
+	char	   *rel = PQescapeIdentifier(conn, relname, strlen(relname));
+
+	if (schemaname)
+	{
+		nsp = PQescapeIdentifier(conn, schemaname, strlen(schemaname));
+		appendPQExpBuffer(query, "%s.%s", nsp, rel);
+	}
+	else
+		appendPQExpBufferStr(query, rel);
+	feed->target = pstrdup(query->data);
+
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, "%s%s" GPFDIST_EXT_PREFIX "_%d_%d", nsp ? nsp : "", nsp ? "." : "",
+					  (int) getpid(), feed->id);
+	feed->ext_name = pstrdup(query->data);
+
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, "CREATE EXTERNAL TABLE %s (LIKE %s) LOCATION ('%s') %s",
+					  feed->ext_name, feed->target, feed->url, format);
+	if (ExecuteSqlStatement(conn, query->data) != 0)
+		goto fail;
+
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, "INSERT INTO %s SELECT * FROM %s", feed->target, feed->ext_name);
+	if (!PQsendQuery(conn, query->data))
+	{
+		fprintf(stderr, "send query %s failed: %s", query->data, PQerrorMessage(conn));
+		goto fail;
+	}
+
+	PQfreemem(rel);
+	if (nsp)
+		PQfreemem(nsp);
+	destroyPQExpBuffer(query);
+
+	return feed;
+
+fail:
+	PQfreemem(rel);
+	if (nsp)
+		PQfreemem(nsp);
+	destroyPQExpBuffer(query);
+	gpfdist_feed_close(feed, false);
+
+	return NULL;
+}
+
+/*
+ * Hand one block of rows to the segments.  While the feed is full, check
+ * from time to time that the INSERT is still running, it stops reading as
+ * soon as it fails.
+ */
+bool
+gpfdist_load_send(GpfdistFeed *feed, PGconn *conn, const char *data, int len)
+{
+	int			rc;
+
+	while ((rc = gpfdist_feed_put(feed, data, len, GPFDIST_POLL_MSEC)) == 0)
+	{
+		if (!PQconsumeInput(conn) || !PQisBusy(conn))
+		{
+			fprintf(stderr, "load through %s ended early: %s", feed->url, PQerrorMessage(conn));
+			return false;
+		}
+	}
+
+	if (rc < 0)
+	{
+		fprintf(stderr, "gpfdist: a segment stopped reading %s\n", feed->url);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Tell the segments the data is complete, wait for the INSERT and drop the
+ * external table.  The rows inserted go to *rows.  The feed is freed.
+ */
+bool
+gpfdist_load_end(GpfdistFeed *feed, PGconn *conn, long *rows)
+{
+	PGresult   *res;
+	PQExpBuffer	query;
+	bool		ok = true;
+
+	pthread_mutex_lock(&feed->lock);
+	feed->finished = true;
+	pthread_cond_broadcast(&feed->changed);
+	pthread_mutex_unlock(&feed->lock);
+
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			fprintf(stderr, "load through %s failed: %s", feed->url, PQerrorMessage(conn));
+			ok = false;
+		}
+		else if (rows)
+			*rows = atol(PQcmdTuples(res));
+		PQclear(res);
+	}
+
+	query = createPQExpBuffer();
+	appendPQExpBuffer(query, "DROP EXTERNAL TABLE %s", feed->ext_name);
+	if (ok && ExecuteSqlStatement(conn, query->data) != 0)
+		ok = false;
+	destroyPQExpBuffer(query);
+
+	return gpfdist_feed_close(feed, ok) && ok;
+}
+
+/*
+ * Give up a load, for when the data cannot be completed.  The caller is
+ * expected to drop its connection, which aborts the INSERT and rolls the
+ * external table back.
+ */
+void
+gpfdist_load_abort(GpfdistFeed *feed)
+{
+	gpfdist_feed_close(feed, false);
+}
@@ -0,0 +1,32 @@
+#ifndef PG_GPFDIST_H
+#define PG_GPFDIST_H
+
+#include "postgres_fe.h"
+
+#include "libpq-fe.h"
+#include "pqexpbuffer.h"
+
+/*
+ * Embedded server speaking the gpfdist protocol, so that the segments of a
+ * Greenplum target pull the copy data straight from dbsync through a
+ * readable external table, instead of all of it going through one COPY on
+ * the master.
+ *
+ * Every load has its own feed, a short queue of data blocks at its own
+ * url.  Each segment connecting to the url takes whole blocks off the
+ * queue until the feed is finished and drained.  Blocks must end on a row
+ * boundary.
+ */
+typedef struct GpfdistServer GpfdistServer;
+typedef struct GpfdistFeed GpfdistFeed;
+
+extern GpfdistServer *gpfdist_start(const char *address);
+extern void gpfdist_stop(GpfdistServer *server);
+
+extern GpfdistFeed *gpfdist_load_begin(GpfdistServer *server, PGconn *conn, const char *schemaname,
+									   const char *relname, const char *format);
+extern bool gpfdist_load_send(GpfdistFeed *feed, PGconn *conn, const char *data, int len);
+extern bool gpfdist_load_end(GpfdistFeed *feed, PGconn *conn, long *rows);
+extern void gpfdist_load_abort(GpfdistFeed *feed);
+
+#endif
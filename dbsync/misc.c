@@ -10,6 +10,7 @@
 #include "pqexpbuffer.h"
 
 #include "misc.h"
+#include "pgsync.h"
 
 #include <time.h>
 
@@ -19,6 +20,11 @@
 #include <sys/time.h>
 #endif
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define USE_SIMD_ESCAPE
+#include <immintrin.h>
+#endif
+
 bool
 WaitThreadEnd(int n, Thread *th)
 {
@@ -82,6 +88,184 @@ ThreadExit(int code)
 #endif
 }
 
+void
+queue_init(BoundedQueue *q, int capacity)
+{
+	q->items = (void **) palloc0(sizeof(void *) * capacity);
+	q->capacity = capacity;
+	q->head = 0;
+	q->count = 0;
+	q->closed = false;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+void
+queue_destroy(BoundedQueue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	pfree(q->items);
+	q->items = NULL;
+}
+
+bool
+queue_push(BoundedQueue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->capacity && !q->closed)
+		pthread_cond_wait(&q->not_full, &q->lock);
+
+	if (q->closed)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return false;
+	}
+
+	q->items[(q->head + q->count) % q->capacity] = item;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return true;
+}
+
+void *
+queue_pop(BoundedQueue *q)
+{
+	void	*item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+
+	if (q->count > 0)
+	{
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
+
+void
+queue_close(BoundedQueue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+/* flushes per measuring window of a BatchSizer */
+#define BATCH_SIZER_WINDOW		8
+/* throughput changes smaller than this fraction are treated as noise */
+#define BATCH_SIZER_NOISE		0.05
+/* shrink batches when a single flush takes longer than this, in ms */
+#define BATCH_SIZER_MAX_LATENCY	1000.0
+
+/*
+ * Start at the large end, small batches are what we want to get away from.
+ */
+void
+batch_sizer_init(BatchSizer *bs, int min_size, int max_size)
+{
+	memset(bs, 0, sizeof(BatchSizer));
+	bs->min_size = min_size;
+	bs->max_size = Max(min_size, max_size);
+	bs->size = Min(bs->max_size, 1024 * 1024);
+	bs->prev_size = bs->size;
+	bs->direction = 1;
+}
+
+/*
+ * Record one flush of bytes that took msec to send.  At the end of each
+ * window the size is doubled or halved while throughput keeps improving.
+ * When a step makes it worse the sizer goes back to the previous size and
+ * tries the other direction, the second time it settles there until
+ * throughput drifts away from what it settled at.
+ */
+void
+batch_sizer_observe(BatchSizer *bs, size_t bytes, double msec)
+{
+	double		rate;
+	bool		move = false;
+
+	bs->nflush++;
+	bs->bytes += bytes;
+	bs->msec += msec;
+
+	if (bs->nflush < BATCH_SIZER_WINDOW)
+		return;
+
+	rate = bs->bytes / Max(bs->msec, 0.001);
+
+	if (bs->msec / bs->nflush > BATCH_SIZER_MAX_LATENCY)
+	{
+		bs->direction = -1;
+		bs->settled = false;
+		bs->reversed = false;
+		move = true;
+	}
+	else if (bs->last_rate < 0)
+	{
+		/* first window after going back, take the baseline and go on */
+		move = !bs->settled;
+	}
+	else if (bs->settled)
+	{
+		if (rate > bs->last_rate * (1 + BATCH_SIZER_NOISE) ||
+			rate < bs->last_rate * (1 - BATCH_SIZER_NOISE))
+		{
+			bs->settled = false;
+			bs->reversed = false;
+			move = true;
+		}
+		else
+			rate = bs->last_rate;
+	}
+	else if (bs->last_rate == 0 || rate > bs->last_rate * (1 + BATCH_SIZER_NOISE))
+		move = true;
+	else if (rate < bs->last_rate * (1 - BATCH_SIZER_NOISE))
+	{
+		bs->size = bs->prev_size;
+		bs->direction = -bs->direction;
+		if (bs->reversed)
+			bs->settled = true;
+		bs->reversed = true;
+		rate = -1;
+	}
+	else
+		bs->settled = true;
+
+	if (move)
+	{
+		bs->prev_size = bs->size;
+		if (bs->direction > 0)
+			bs->size = Min(bs->max_size, bs->size * 2);
+		else
+			bs->size = Max(bs->min_size, bs->size / 2);
+
+		/* at a bound the only way to explore is back */
+		if (bs->size == bs->max_size)
+			bs->direction = -1;
+		else if (bs->size == bs->min_size)
+			bs->direction = 1;
+	}
+
+	bs->last_rate = rate;
+	bs->nflush = 0;
+	bs->bytes = 0;
+	bs->msec = 0;
+}
 
 PGconn *
 pglogical_connect(const char *connstring, const char *connname)
@@ -130,33 +314,187 @@ is_greenplum(PGconn *conn)
 	return is_greenplum;
 }
 
-size_t
-quote_literal_internal(char *dst, const char *src, size_t len)
+/*
+ * Escaping kernels: copy len bytes from src to dst, doubling every single
+ * quote and, if escape_backslash, every backslash.  dst must have room for
+ * 2 * len bytes.  Returns the number of bytes written.
+ *
+ * The vector versions look for special bytes 16 or 32 at a time and copy
+ * the clean runs in between as whole vectors.  SSE2 is always there on
+ * x86-64, AVX2 is used when the cpu has it.
+ */
+typedef size_t (*EscapeKernel) (char *dst, const char *src, size_t len, bool escape_backslash);
+
+static size_t
+escape_quotes_scalar(char *dst, const char *src, size_t len, bool escape_backslash)
 {
-	const char *s;
 	char	   *savedst = dst;
 
-	for (s = src; s < src + len; s++)
+	while (len-- > 0)
 	{
-		if (*s == '\\')
+		if (SQL_STR_DOUBLE(*src, escape_backslash))
+			*dst++ = *src;
+		*dst++ = *src++;
+	}
+
+	return dst - savedst;
+}
+
+#ifdef USE_SIMD_ESCAPE
+static size_t
+escape_quotes_sse2(char *dst, const char *src, size_t len, bool escape_backslash)
+{
+	char	   *savedst = dst;
+	const char *end = src + len;
+	__m128i		quote = _mm_set1_epi8('\'');
+	__m128i		other = _mm_set1_epi8(escape_backslash ? '\\' : '\'');
+
+	while (end - src >= 16)
+	{
+		__m128i		chunk = _mm_loadu_si128((const __m128i *) src);
+		uint32		mask;
+		int			n;
+
+		mask = (uint32) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+													   _mm_cmpeq_epi8(chunk, other)));
+
+		/*
+		 * Store the whole chunk even when only a prefix of it is clean, the
+		 * rest is overwritten next round.  Output never runs past the
+		 * 2 * len bytes the caller reserved.
+		 */
+		_mm_storeu_si128((__m128i *) dst, chunk);
+		if (mask == 0)
 		{
-			*dst++ = ESCAPE_STRING_SYNTAX;
-			break;
+			src += 16;
+			dst += 16;
+			continue;
 		}
+
+		n = __builtin_ctz(mask);
+		src += n;
+		dst += n;
+		*dst++ = *src;
+		*dst++ = *src++;
 	}
 
-	*dst++ = '\'';
-	while (len-- > 0)
+	return (dst - savedst) + escape_quotes_scalar(dst, src, end - src, escape_backslash);
+}
+
+__attribute__((target("avx2")))
+static size_t
+escape_quotes_avx2(char *dst, const char *src, size_t len, bool escape_backslash)
+{
+	char	   *savedst = dst;
+	const char *end = src + len;
+	__m256i		quote = _mm256_set1_epi8('\'');
+	__m256i		other = _mm256_set1_epi8(escape_backslash ? '\\' : '\'');
+
+	while (end - src >= 32)
 	{
-		if (SQL_STR_DOUBLE(*src, true))
-			*dst++ = *src;
+		__m256i		chunk = _mm256_loadu_si256((const __m256i *) src);
+		uint32		mask;
+		int			n;
+
+		mask = (uint32) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+															 _mm256_cmpeq_epi8(chunk, other)));
+
+		_mm256_storeu_si256((__m256i *) dst, chunk);
+		if (mask == 0)
+		{
+			src += 32;
+			dst += 32;
+			continue;
+		}
+
+		n = __builtin_ctz(mask);
+		src += n;
+		dst += n;
+		*dst++ = *src;
 		*dst++ = *src++;
 	}
+
+	return (dst - savedst) + escape_quotes_sse2(dst, src, end - src, escape_backslash);
+}
+#endif
+
+static EscapeKernel escape_quotes = escape_quotes_scalar;
+static pthread_once_t escape_quotes_once = PTHREAD_ONCE_INIT;
+
+static void
+choose_escape_kernel(void)
+{
+#ifdef USE_SIMD_ESCAPE
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		escape_quotes = escape_quotes_avx2;
+	else
+		escape_quotes = escape_quotes_sse2;
+#endif
+}
+
+/*
+ * Quote src as a SQL literal, E'' syntax if it has backslashes.  dst must
+ * have room for 2 * len + 3 bytes.
+ */
+size_t
+quote_literal_internal(char *dst, const char *src, size_t len)
+{
+	char	   *savedst = dst;
+
+	pthread_once(&escape_quotes_once, choose_escape_kernel);
+
+	if (memchr(src, '\\', len) != NULL)
+		*dst++ = ESCAPE_STRING_SYNTAX;
+
+	*dst++ = '\'';
+	dst += escape_quotes(dst, src, len, true);
 	*dst++ = '\'';
 
 	return dst - savedst;
 }
 
+/*
+ * Quote src as a csv field whose quote character is the single quote, as
+ * in the csv COPY of mysql2pgsql.  Backslashes are not special in csv.
+ * dst must have room for 2 * len + 2 bytes.
+ */
+size_t
+quote_csv_internal(char *dst, const char *src, size_t len)
+{
+	char	   *savedst = dst;
+
+	pthread_once(&escape_quotes_once, choose_escape_kernel);
+
+	*dst++ = '\'';
+	dst += escape_quotes(dst, src, len, false);
+	*dst++ = '\'';
+
+	return dst - savedst;
+}
+
+/* Append src to buffer as a SQL literal, without a temporary copy */
+void
+append_quoted_literal(PQExpBuffer buffer, const char *src, size_t len)
+{
+	if (!enlargePQExpBuffer(buffer, len * 2 + 3))
+		return;
+
+	buffer->len += quote_literal_internal(buffer->data + buffer->len, src, len);
+	buffer->data[buffer->len] = '\0';
+}
+
+/* Append src to buffer as a quoted csv field, without a temporary copy */
+void
+append_quoted_csv(PQExpBuffer buffer, const char *src, size_t len)
+{
+	if (!enlargePQExpBuffer(buffer, len * 2 + 2))
+		return;
+
+	buffer->len += quote_csv_internal(buffer->data + buffer->len, src, len);
+	buffer->data[buffer->len] = '\0';
+}
+
 int
 start_copy_origin_tx(PGconn *conn, const char *snapshot, int pg_version, bool is_greenplum)
 {
@@ -216,6 +554,207 @@ start_copy_target_tx(PGconn *conn, int pg_version, bool is_greenplum)
 	return 0;
 }
 
+/* Quoted, schema qualified name of the target table of a task */
+static char *
+task_target_name(PGconn *conn, Task_hd *task)
+{
+	PQExpBuffer	buf = createPQExpBuffer();
+	char	   *rel = PQescapeIdentifier(conn, task->relname, strlen(task->relname));
+	char	   *result;
+
+	if (task->schemaname)
+	{
+		char	   *nsp = PQescapeIdentifier(conn, task->schemaname, strlen(task->schemaname));
+
+		appendPQExpBuffer(buf, "%s.", nsp);
+		PQfreemem(nsp);
+	}
+	appendPQExpBufferStr(buf, rel);
+	PQfreemem(rel);
+
+	result = pstrdup(buf->data);
+	destroyPQExpBuffer(buf);
+
+	return result;
+}
+
+static int
+task_cmp_target_name(const Task_hd *ta, const Task_hd *tb)
+{
+	int			rc;
+
+	rc = strcmp(ta->schemaname ? ta->schemaname : "", tb->schemaname ? tb->schemaname : "");
+	if (rc == 0)
+		rc = strcmp(ta->relname, tb->relname);
+
+	return rc;
+}
+
+static int
+task_cmp_target(const void *a, const void *b)
+{
+	const Task_hd *ta = *(Task_hd * const *) a;
+	const Task_hd *tb = *(Task_hd * const *) b;
+	int			rc = task_cmp_target_name(ta, tb);
+
+	return rc != 0 ? rc : ta->id - tb->id;
+}
+
+/* Whether the target table of a task is a permanent, logged table */
+static bool
+task_target_logged(PGconn *conn, Task_hd *task)
+{
+	char	   *target = task_target_name(conn, task);
+	char	   *literal = PQescapeLiteral(conn, target, strlen(target));
+	char	   *sql = psprintf("SELECT relpersistence FROM pg_catalog.pg_class WHERE oid = %s::pg_catalog.regclass", literal);
+	PGresult   *res;
+	bool		logged = false;
+
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+		logged = strcmp(PQgetvalue(res, 0, 0), "p") == 0;
+	else
+		fprintf(stderr, "get persistence of table %s failed: %s", target, PQerrorMessage(conn));
+	PQclear(res);
+	pfree(sql);
+	PQfreemem(literal);
+	pfree(target);
+
+	return logged;
+}
+
+/*
+ * Decide how the target tables of a fast load are emptied.  A table loaded
+ * by a single task is truncated in that task's transaction, so its COPY can
+ * FREEZE, or with unlogged is loaded as an unlogged table instead; tables
+ * that are not permanent to begin with keep their persistence.  A table
+ * split into chunks is truncated here, once, if all its chunks are still to
+ * be copied; when resuming, some of them are already in.  Tables loaded by
+ * several -l entries are left alone.
+ */
+void
+plan_fast_load(PGconn *conn, Task_hd *task, int ntask, bool unlogged)
+{
+	Task_hd   **bytarget;
+	int			i;
+	int			j;
+
+	bytarget = (Task_hd **) palloc(sizeof(Task_hd *) * ntask);
+	for (i = 0; i < ntask; i++)
+		bytarget[i] = &task[i];
+	qsort(bytarget, ntask, sizeof(Task_hd *), task_cmp_target);
+
+	for (i = 0; i < ntask; i = j)
+	{
+		Task_hd    *first = bytarget[i];
+		int			nchunk = 0;
+
+		for (j = i; j < ntask && task_cmp_target_name(bytarget[j], first) == 0; j++)
+		{
+			if (bytarget[j]->nchunk > 1)
+				nchunk++;
+		}
+
+		if (j - i == 1 && nchunk == 0)
+		{
+			first->truncate = true;
+			first->unlogged = unlogged && task_target_logged(conn, first);
+		}
+		else if (nchunk > 0 && nchunk < first->nchunk)
+			;	/* resumed, some chunks are already loaded */
+		else if (nchunk == j - i && nchunk == first->nchunk)
+		{
+			char	   *target = task_target_name(conn, first);
+			char	   *sql = psprintf("TRUNCATE %s", target);
+
+			if (ExecuteSqlStatement(conn, sql) != 0)
+				fprintf(stderr, "table %s is not emptied before its chunks are loaded\n", target);
+			pfree(sql);
+			pfree(target);
+		}
+		else
+			fprintf(stderr, "table %s is loaded by %d tasks, it is not truncated\n", first->relname, j - i);
+	}
+
+	pfree(bytarget);
+}
+
+/*
+ * SQL that starts the fast load of a task marked truncate, in the
+ * transaction of its COPY: empty the table and, if the task is unlogged,
+ * stop WAL logging it.
+ */
+char *
+fast_load_start_sql(PGconn *conn, Task_hd *task)
+{
+	char	   *target = task_target_name(conn, task);
+	char	   *sql;
+
+	if (task->unlogged)
+		sql = psprintf("TRUNCATE %s;\nALTER TABLE %s SET UNLOGGED", target, target);
+	else
+		sql = psprintf("TRUNCATE %s", target);
+	pfree(target);
+
+	return sql;
+}
+
+/*
+ * SQL that ends the fast load of a task before its transaction commits, or
+ * NULL if there is nothing to do.  SET LOGGED rewrites the whole table and
+ * writes all of it to WAL, which is why an unlogged load does not FREEZE:
+ * the rewritten rows would not stay frozen.
+ */
+char *
+fast_load_end_sql(PGconn *conn, Task_hd *task)
+{
+	char	   *target;
+	char	   *sql;
+
+	if (!task->unlogged)
+		return NULL;
+
+	target = task_target_name(conn, task);
+	sql = psprintf("ALTER TABLE %s SET LOGGED", target);
+	pfree(target);
+
+	return sql;
+}
+
+/* Whether the COPY of a task may FREEZE the rows it loads */
+bool
+fast_load_freeze(Task_hd *task)
+{
+	return task->truncate && !task->unlogged;
+}
+
+int
+fast_load_prepare(PGconn *conn, Task_hd *task)
+{
+	char	   *sql = fast_load_start_sql(conn, task);
+	int			rc;
+
+	rc = ExecuteSqlStatement(conn, sql);
+	pfree(sql);
+
+	return rc;
+}
+
+int
+fast_load_finish(PGconn *conn, Task_hd *task)
+{
+	char	   *sql = fast_load_end_sql(conn, task);
+	int			rc;
+
+	if (sql == NULL)
+		return 0;
+
+	rc = ExecuteSqlStatement(conn, sql);
+	pfree(sql);
+
+	return rc;
+}
+
 int
 finish_copy_origin_tx(PGconn *conn)
 {
@@ -40,6 +40,8 @@ typedef DWORD		 pthread_t;
 
 
 #else
+#include <pthread.h>
+
 typedef pthread_t	ThreadHandle;
 typedef pthread_t	ThreadId;
 typedef pthread_t	thid_t;
@@ -54,13 +56,63 @@ typedef struct Thread
 
 #define MaxAllocSize	((Size) 0x3fffffff)		/* 1 gigabyte - 1 */
 
+/*
+ * Fixed size FIFO of pointers shared by a producer and a consumer thread.
+ * Push blocks while the queue is full and pop blocks while it is empty.
+ * Once closed, push fails and pop returns NULL after the queue is drained.
+ */
+typedef struct BoundedQueue
+{
+	void		  **items;
+	int			capacity;
+	int			head;
+	int			count;
+	bool		closed;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	not_empty;
+	pthread_cond_t	not_full;
+} BoundedQueue;
+
+/*
+ * Picks the size of the chunks a COPY sender writes at a time, by hill
+ * climbing on the throughput measured over windows of flushes.
+ */
+typedef struct BatchSizer
+{
+	int			size;			/* current batch size in bytes */
+	int			prev_size;		/* size before the last step */
+	int			min_size;
+	int			max_size;
+	int			direction;		/* 1 while growing, -1 while shrinking */
+	bool		reversed;		/* turned around once since the last settle */
+	bool		settled;		/* turned around twice, staying at this size */
+	int			nflush;			/* flushes in the current window */
+	double		bytes;			/* bytes sent in the current window */
+	double		msec;			/* time spent sending in the current window */
+	double		last_rate;		/* bytes per msec of the previous window, -1
+								 * right after going back a step */
+} BatchSizer;
+
 extern bool WaitThreadEnd(int n, Thread *th);
 extern void ThreadExit(int code);
 extern int ThreadCreate(Thread *th, void *(*start)(void *arg), void *arg);
 
+extern void queue_init(BoundedQueue *q, int capacity);
+extern void queue_destroy(BoundedQueue *q);
+extern bool queue_push(BoundedQueue *q, void *item);
+extern void *queue_pop(BoundedQueue *q);
+extern void queue_close(BoundedQueue *q);
+
+extern void batch_sizer_init(BatchSizer *bs, int min_size, int max_size);
+extern void batch_sizer_observe(BatchSizer *bs, size_t bytes, double msec);
+
 extern PGconn *pglogical_connect(const char *connstring, const char *connname);
 extern bool is_greenplum(PGconn *conn);
 extern size_t quote_literal_internal(char *dst, const char *src, size_t len);
+extern size_t quote_csv_internal(char *dst, const char *src, size_t len);
+extern void append_quoted_literal(PQExpBuffer buffer, const char *src, size_t len);
+extern void append_quoted_csv(PQExpBuffer buffer, const char *src, size_t len);
 extern int start_copy_origin_tx(PGconn *conn, const char *snapshot, int pg_version, bool is_greenplum);
 extern int finish_copy_origin_tx(PGconn *conn);
 extern int start_copy_target_tx(PGconn *conn, int pg_version, bool is_greenplum);
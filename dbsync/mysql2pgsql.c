@@ -17,6 +17,7 @@
 #include "catalog/pg_type.h"
 
 #include <time.h>
+#include <arpa/inet.h>
 
 #ifndef WIN32
 #include <pthread.h>
@@ -24,22 +25,244 @@
 
 #include "mysql.h"
 #include "utils.h"
+#include "gpfdist.h"
+#include "rebuild.h"
+#include "flowctl.h"
+#include "ratelimit.h"
 #include <unistd.h> 
 
 static volatile bool time_to_abort = false;
 bool get_ddl_only = false;
 bool simple_wo_part = false;
 bool first_col_as_dist_key = false;
-/* buffer for sending copy data to target, unit is Byte */
+/* buffer for sending copy data to target, unit is Byte, 0 sizes it adaptively */
 int buffer_size = 0;
+/* ceiling of the copy buffers of all threads together, unit is MB, 0 means no limit */
+int copy_memory_limit = 0;
+/* tables with more rows than this are copied as key range chunks, 0 disables */
+long chunk_rows = 0;
+/* send copy data to target in binary format where the target table allows it */
+bool binary_copy = false;
+/* read source rows through server side prepared statements and a cursor */
+bool prepared_fetch = false;
+/* record finished tasks on the target and skip them when run again */
+bool resume_copy = false;
+/* qualified name of the progress table, NULL unless resume_copy */
+static char *progress_table = NULL;
+/* read all tables in one snapshot, started under a short global read lock */
+bool consistent_snapshot = false;
+/* source connections of the workers in that snapshot, by thread id */
+static MYSQL **snapshot_conns = NULL;
+/* host:port to serve copy data to greenplum segments on, NULL to copy through the master */
+char *gpfdist_address = NULL;
+static GpfdistServer *gpfdist_server = NULL;
+/* bounds of the adaptive number of copy workers, 0 for a fixed number */
+int flow_min_workers = 0;
+int flow_max_workers = 0;
+static FlowControl *flow = NULL;
+/* limits of the source reads, read from my.cfg and again on SIGHUP */
+static RateLimit *rate = NULL;
+/* truncate and COPY FREEZE in one transaction, and load into unlogged tables */
+bool fast_load = false;
+bool fast_load_unlogged = false;
+/* workers rebuilding the indexes dropped before the copy, 0 keeps them during the copy */
+int rebuild_workers = 0;
+/* maintenance_work_mem of the rebuild workers, NULL for the server default */
+char *rebuild_work_mem = NULL;
 
 #define STMT_SHOW_TABLES "show full tables in `%s` where table_type='BASE TABLE'"
 
 #define STMT_SELECT      "select * from `%s`.`%s`"
 
+#define STMT_WHERE       " where %s"
+
+/* Leading integer column of the table's indexes, primary key first */
+#define STMT_CHUNK_KEY "select s.column_name from information_schema.statistics s, information_schema.columns c " \
+						"where s.table_schema = '%s' and s.table_name = '%s' and s.seq_in_index = 1 " \
+						"and c.table_schema = s.table_schema and c.table_name = s.table_name and c.column_name = s.column_name " \
+						"and c.data_type in ('tinyint', 'smallint', 'mediumint', 'int', 'bigint') " \
+						"order by s.index_name = 'PRIMARY' desc, s.non_unique limit 1"
+
+#define STMT_TABLE_ROWS "select table_rows from information_schema.tables where table_schema = '%s' and table_name = '%s'"
+
+#define STMT_TABLE_SIZES "select table_name, data_length, table_rows from information_schema.tables where table_schema = '%s'"
+
+#define STMT_KEY_RANGE "select min(`%s`), max(`%s`) from `%s`.`%s`"
+
+/* Column types of a target table, on the target */
+#define STMT_TARGET_COLUMN_TYPES "SELECT a.atttypid FROM pg_catalog.pg_attribute a, pg_catalog.pg_class c, pg_catalog.pg_namespace n " \
+						"WHERE a.attrelid = c.oid AND c.relnamespace = n.oid AND c.relname = %s AND %s " \
+						"AND a.attnum > 0 AND NOT a.attisdropped ORDER BY a.attnum"
+
+/*
+ * Progress of a checkpointed load, one row per task.  cond is the key range
+ * of a chunk, the query of a task given one, or empty.
+ */
+#define PROGRESS_TABLE "mysql2pgsql_progress"
+#define STMT_PROGRESS_EXISTS "SELECT count(*) FROM pg_catalog.pg_class c, pg_catalog.pg_namespace n " \
+						"WHERE c.relnamespace = n.oid AND c.relname = '" PROGRESS_TABLE "' AND n.nspname = %s"
+#define STMT_PROGRESS_CREATE "CREATE TABLE %s (source_db text, relname text, cond text, chunk_id int, " \
+						"nchunk int, rows bigint, done boolean, updated timestamp)"
+#define STMT_PROGRESS_LOAD "SELECT relname, cond, chunk_id, nchunk, done, rows FROM %s WHERE source_db = %s"
+#define STMT_PROGRESS_INSERT "INSERT INTO %s VALUES (%s, %s, %s, %d, %d, 0, false, now())"
+#define STMT_PROGRESS_DONE "UPDATE %s SET rows = %ld, done = true, updated = now() " \
+						"WHERE source_db = %s AND relname = %s AND cond = %s"
+
+/* Signature, flags field and header extension length of binary copy data */
+#define BINARY_COPY_HEADER		"PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0"
+#define BINARY_COPY_HEADER_LEN	19
+#define BINARY_COPY_TRAILER		"\377\377"
+
+/* Julian day of 2000-01-01, which is day zero of timestamps on the wire */
+#define PG_EPOCH_JDATE			2451545
+
+/* rows the server sends per round trip when fetching from a statement cursor */
+#define STMT_PREFETCH_ROWS		1000
+/* longer text and blob values are fetched into the row batch in pieces */
+#define STMT_PIECE_SIZE			(64 * 1024)
+
+/*
+ * Form of a cell in a RowBatch.  With the text protocol every cell is text,
+ * prepared statements deliver integers, floats and datetimes in native form.
+ */
+#define CELL_TEXT				't'
+#define CELL_INT64				'i'
+#define CELL_DOUBLE				'd'
+#define CELL_TIME				'T'
+
+/* number of buffers in flight between each pair of copy pipeline stages */
+#define PIPELINE_DEPTH	4
+/* fetched rows are handed to the encoder in batches of about this many bytes */
+#define ROW_BATCH_SIZE	(64 * 1024)
+/* bounds of the adaptive size of the chunks written to the target */
+#define COPY_BATCH_MIN	(8 * 1024)
+#define COPY_BATCH_MAX	(4 * 1024 * 1024)
+
+/* upper bound of adaptive copy chunks, lowered by the memory limit */
+static int copy_batch_max = COPY_BATCH_MAX;
+
+/*
+ * Writes one non NULL, non empty value of a column as a csv field.
+ * fetch_colmum_info picks one per column from the column type, so the
+ * encoder does no per cell type dispatch.
+ */
+typedef void (*ColumnEncoder) (PQExpBuffer buffer, const char *value, int len);
+
+/*
+ * Rows fetched from mysql, waiting to be encoded.  Each cell is stored as an
+ * int32 length (-1 for NULL) followed by the bytes and a terminating '\0'.
+ * The bytes are text or a native int64, double or MYSQL_TIME depending on
+ * the form of the column.
+ */
+typedef struct RowBatch
+{
+	StringInfoData	data;
+	int				nrows;
+} RowBatch;
+
+/*
+ * Per table copy pipeline.  The worker thread fetches rows into RowBatches,
+ * the encoder thread turns them into COPY text and the sender thread writes
+ * that to the target, so that the three of them overlap.  Buffers travel
+ * through the *_full queues and come back through the *_free queues.
+ */
+typedef struct CopyPipeline
+{
+	PGconn		   *conn;
+	int				n_col;
+	Oid			   *column_oids;
+	ColumnEncoder  *encoders;
+	char		   *forms;			/* CELL_* form of each column, NULL if all text */
+
+	BoundedQueue	raw_full;
+	BoundedQueue	raw_free;
+	BoundedQueue	out_full;
+	BoundedQueue	out_free;
+
+	RowBatch		raw[PIPELINE_DEPTH];
+	PQExpBuffer		out[PIPELINE_DEPTH];
+
+	Thread			encoder;
+	Thread			sender;
+
+	BatchSizer	   *sizer;			/* adaptive chunk size, NULL with a fixed -b */
+	RateBucket	   *rate_table;		/* rate limit of the table read */
+	volatile int	batch_size;		/* encoder flushes chunks of this size */
+
+	bool			binary;			/* encode as binary copy data, not csv */
+	GpfdistFeed	   *feed;			/* send to greenplum segments, not to COPY */
+	volatile bool	failed;
+} CopyPipeline;
+
+/* Result buffer of one column in prepared statement mode */
+typedef struct StmtColumn
+{
+	char			form;
+	unsigned long	length;
+	my_bool			is_null;
+	my_bool			error;
+	union
+	{
+		int64		i;
+		double		d;
+		MYSQL_TIME	t;
+	}				value;
+	char		   *buffer;			/* text form only */
+	unsigned long	buffer_length;
+} StmtColumn;
+
+/* A task recorded in the progress table */
+typedef struct ProgressEntry
+{
+	char	   *relname;
+	char	   *cond;
+	int			chunk_id;
+	int			nchunk;
+	bool		done;
+	long		rows;
+} ProgressEntry;
+
+typedef struct ProgressPlan
+{
+	int				nentry;
+	ProgressEntry  *entries;		/* sorted on relname */
+} ProgressPlan;
+
 static MYSQL *connect_to_mysql(mysql_conn_info* hd);
+static Task_hd *split_tasks_by_key_range(MYSQL *conn, char *db, Task_hd *task, int *ntask, ProgressPlan *plan);
+static ProgressPlan *progress_open(PGconn *conn, char *schemaname, char *db);
+static ProgressEntry *progress_find(ProgressPlan *plan, const char *relname);
+static int progress_chunks(ProgressPlan *plan, Task_hd *task, Task_hd **chunks);
+static bool progress_apply(PGconn *conn, ProgressPlan *plan, char *db, Task_hd *task, int *ntask);
+static bool progress_mark_done(PGconn *conn, char *db, Task_hd *task, long rows);
+static void fetch_table_sizes(MYSQL *conn, char *db, Task_hd *task, int ntask);
+static void schedule_tasks(Task_hd *task, int ntask);
+static int split_table_by_key_range(MYSQL *conn, char *db, Task_hd *task, Task_hd **chunks);
+static char *mysql_get_single_value(MYSQL *conn, const char *query);
+static MYSQL **take_consistent_snapshot(MYSQL *lock_conn, mysql_conn_info *src, int nconn);
 static void *mysql2pgsql_copy_data(void *arg);
-static void quote_literal_local_withoid(StringInfo s, const char *rawstr, Oid type, PQExpBuffer buffer);
+static void copy_pipeline_start(CopyPipeline *pipe, PGconn *conn, int n_col, Oid *column_oids, ColumnEncoder *encoders, char *forms, bool binary, BatchSizer *sizer, GpfdistFeed *feed);
+static RowBatch *copy_pipeline_get_batch(CopyPipeline *pipe);
+static void batch_fetched(CopyPipeline *pipe, RowBatch *batch, TimevalStruct *mark);
+static long fetch_rows_text(MYSQL_RES *my_res, int n_col, CopyPipeline *pipe);
+static MYSQL_STMT *stmt_open(MYSQL *conn, const char *query);
+static StmtColumn *stmt_bind_columns(MYSQL_STMT *stmt, MYSQL_RES *meta, int n_col, MYSQL_BIND **p_binds, char **p_forms);
+static void stmt_free_columns(StmtColumn *cols, MYSQL_BIND *binds, char *forms, int n_col);
+static long fetch_rows_stmt(MYSQL_STMT *stmt, MYSQL_BIND *binds, StmtColumn *cols, int n_col, CopyPipeline *pipe);
+static bool copy_pipeline_finish(CopyPipeline *pipe);
+static void copy_pipeline_fail(CopyPipeline *pipe);
+static void *copy_pipeline_encode(void *arg);
+static void *copy_pipeline_send(void *arg);
+static ColumnEncoder csv_encoder_for_type(Oid type);
+static void encode_csv_plain(PQExpBuffer buffer, const char *value, int len);
+static void encode_csv_timestamp(PQExpBuffer buffer, const char *value, int len);
+static void encode_csv_text(PQExpBuffer buffer, const char *value, int len);
+static bool binary_copy_supported(PGconn *conn, char *schemaname, char *relname, MYSQL_RES *my_res, Oid *column_oids, int n_col);
+static bool append_binary_value(PQExpBuffer buffer, const char *rawstr, int32 len, Oid type);
+static bool append_binary_native(PQExpBuffer buffer, char form, const char *cell, Oid type);
+static const char *native_value_to_text(char form, const char *cell, Oid type, char *buf, size_t size);
+static bool append_binary_numeric(PQExpBuffer buffer, const char *rawstr);
+static bool append_binary_timestamp(PQExpBuffer buffer, const char *rawstr);
 static int setup_connection_from_mysql(PGconn *conn);
 static void sigint_handler(int signum);
 
@@ -52,11 +275,13 @@ sigint_handler(int signum)
 #endif
 
 static Oid *
-fetch_colmum_info(char *schemaname, char *tabname, MYSQL_RES *my_res, bool is_target_gp)
+fetch_colmum_info(char *schemaname, char *tabname, MYSQL_RES *my_res, bool is_target_gp, bool print_ddl,
+				  ColumnEncoder **p_encoders)
 {
 	MYSQL_FIELD *field;
 	int		col_num = 0;
 	Oid		*col_type = NULL;
+	ColumnEncoder *encoders = NULL;
 	int		i = 0;
 	PQExpBuffer ddl;
 	/* Mysql column name len should be no more than 64 */
@@ -74,6 +299,7 @@ fetch_colmum_info(char *schemaname, char *tabname, MYSQL_RES *my_res, bool is_ta
 	
 	col_num = mysql_num_fields(my_res);
 	col_type = palloc0(sizeof(Oid) * col_num);
+	encoders = palloc0(sizeof(ColumnEncoder) * col_num);
     for (i = 0; i < col_num; i++)
     {
 		int type;
@@ -157,8 +383,13 @@ fetch_colmum_info(char *schemaname, char *tabname, MYSQL_RES *my_res, bool is_ta
 
 			default:
 				fprintf(stderr, "unsupported col %s type %d\n", field->org_name, type);
+				destroyPQExpBuffer(ddl);
+				pfree(encoders);
+				pfree(col_type);
 				return NULL;
 		}
+
+		encoders[i] = csv_encoder_for_type(col_type[i]);
     }
 	
 	if (is_target_gp)
@@ -173,10 +404,12 @@ fetch_colmum_info(char *schemaname, char *tabname, MYSQL_RES *my_res, bool is_ta
 		appendPQExpBuffer(ddl, ")");
 	}
 
-	fprintf(stderr, "%s;\n\n", ddl->data);
+	if (print_ddl)
+		fprintf(stderr, "%s;\n\n", ddl->data);
 	
 	destroyPQExpBuffer(ddl);
 
+	*p_encoders = encoders;
 	return col_type;
 }
 
@@ -250,521 +483,2634 @@ connect_to_mysql(mysql_conn_info* hd)
 }
 
 /*
- * Entry point for mysql2pgsql
+ * Open a source connection for each worker and start a consistent snapshot
+ * transaction on all of them under FLUSH TABLES WITH READ LOCK, so that all
+ * tables and all chunks of a table are read as of the same moment.  The
+ * lock is held only while the transactions start and the binlog position
+ * is read; the position is printed for the incremental sync to start from.
+ * Returns NULL on error.
  */
-int 
-mysql2pgsql_sync_main(char *desc, int nthread, mysql_conn_info *hd, char* target_schema, uint32 ignore_error_count)
+static MYSQL **
+take_consistent_snapshot(MYSQL *lock_conn, mysql_conn_info *src, int nconn)
 {
-	int 		i = 0;
-	Thread_hd th_hd;
-	Thread			*thread = NULL;
-	PGresult		*res = NULL;
-	PGconn		*desc_conn;
-	long		s_count = 0;
-	long		t_count = 0;
-	bool		have_err = false;
+	MYSQL	  **conns;
+	MYSQL_RES  *my_res = NULL;
+	MYSQL_ROW	row;
+	char	   *binlog_file = NULL;
+	char	   *binlog_pos = NULL;
+	char	   *gtid_set = NULL;
+	bool		reconnect = false;
+	bool		locked = false;
+	bool		ok = false;
 	TimevalStruct before,
-					after; 
+				after;
 	double		elapsed_msec = 0;
-	int		ntask = 0;
-	MYSQL	*conn_src = NULL;
-	MYSQL_RES	*my_res = NULL;
-	char **p = NULL;
-
-#ifndef WIN32
-	signal(SIGINT, sigint_handler);
-#endif
+	int			i;
 
-	GETTIMEOFDAY(&before);
+	conns = (MYSQL **) palloc0(sizeof(MYSQL *) * nconn);
+	for (i = 0; i < nconn; i++)
+	{
+		conns[i] = connect_to_mysql(src);
+		if (conns[i] == NULL)
+			goto exit;
 
-	memset(&th_hd, 0, sizeof(Thread_hd));
-	th_hd.nth = nthread;
-	th_hd.desc = desc;
-	th_hd.mysql_src = hd;
-	th_hd.ignore_error_count = ignore_error_count;
+		/* A reconnect would leave the snapshot without notice */
+		mysql_options(conns[i], MYSQL_OPT_RECONNECT, &reconnect);
+		if (mysql_query(conns[i], "SET SESSION TRANSACTION ISOLATION LEVEL REPEATABLE READ") != 0)
+		{
+			fprintf(stderr, "set isolation level error: %s\n", mysql_error(conns[i]));
+			goto exit;
+		}
+	}
 
-	conn_src = connect_to_mysql(hd);
-	if (conn_src == NULL)
+	/* Close the open tables first, so that the lock waits less for them */
+	if (mysql_query(lock_conn, "FLUSH /*!40101 LOCAL */ TABLES") != 0)
 	{
-		fprintf(stderr, "init src conn failed.\n");
-		return 1;
+		fprintf(stderr, "flush tables error: %s\n", mysql_error(lock_conn));
+		goto exit;
 	}
 
-	desc_conn = pglogical_connect(desc, EXTENSION_NAME "_main");
-	if (desc_conn == NULL)
+	GETTIMEOFDAY(&before);
+	if (mysql_query(lock_conn, "FLUSH TABLES WITH READ LOCK") != 0)
 	{
-		fprintf(stderr, "init desc conn failed: %s\n", PQerrorMessage(desc_conn));
-		return 1;
+		fprintf(stderr, "flush tables with read lock error, the user needs the RELOAD privilege: %s\n",
+				mysql_error(lock_conn));
+		goto exit;
 	}
-	th_hd.desc_version = PQserverVersion(desc_conn);
-	th_hd.desc_is_greenplum = is_greenplum(desc_conn);
-	PQfinish(desc_conn);
+	locked = true;
 
-	if (hd->tabnames == NULL)
+	for (i = 0; i < nconn; i++)
 	{
-		PQExpBuffer	query;
-		MYSQL_ROW row;
-		int ret = -1;
-
-		query = createPQExpBuffer();
-
-		appendPQExpBuffer(query, STMT_SHOW_TABLES, hd->db);
-		ret = mysql_real_query(conn_src, query->data, strlen(query->data));
-		if (ret != 0)
-		{
-			fprintf(stderr, "init desc conn failed: %s", mysql_error(conn_src));
-			return 1;
-		}
-		
-		my_res = mysql_store_result(conn_src);
-		if (my_res == NULL)
-		{
-			fprintf(stderr, "get src db table failed: %s", mysql_error(conn_src));
-			return 1;
-		}
-	
-		ntask = mysql_num_rows(my_res);
-		th_hd.ntask = ntask;
-		if (th_hd.ntask >= 1)
+		if (mysql_query(conns[i], "START TRANSACTION /*!40100 WITH CONSISTENT SNAPSHOT */") != 0)
 		{
-			th_hd.task = (Task_hd *)palloc0(sizeof(Task_hd) * th_hd.ntask);
+			fprintf(stderr, "start consistent snapshot error: %s\n", mysql_error(conns[i]));
+			goto exit;
 		}
+	}
 
-		/*
-		  * The linked-array th_hd.task serves as a task queue for all the worker threads to pick up tasks and consume
-		  */
-		for (i = 0; i < th_hd.ntask; i++)
-		{
-			row = mysql_fetch_row(my_res);
-			th_hd.task[i].id = i;
-			th_hd.task[i].schemaname = target_schema;
-			th_hd.task[i].relname = pstrdup(row[0]);
-			th_hd.task[i].query = NULL;
-			th_hd.task[i].count = 0;
-			th_hd.task[i].complete = false;
+	/* Renamed SHOW BINARY LOG STATUS in MySQL 8.4 */
+	if ((mysql_query(lock_conn, "SHOW MASTER STATUS") != 0 &&
+		 mysql_query(lock_conn, "SHOW BINARY LOG STATUS") != 0) ||
+		(my_res = mysql_store_result(lock_conn)) == NULL)
+	{
+		fprintf(stderr, "get binlog position error: %s\n", mysql_error(lock_conn));
+		goto exit;
+	}
 
-			/* Set the former entry's link to this entry. Last entry's next feild would remain NULL */
-			if (i != 0)
-			{
-				th_hd.task[i-1].next = &th_hd.task[i];
-			}
-		}
-		mysql_free_result(my_res);
-		PQclear(res);
-		destroyPQExpBuffer(query);
+	row = mysql_fetch_row(my_res);
+	if (row != NULL && row[0] != NULL)
+	{
+		binlog_file = pstrdup(row[0]);
+		binlog_pos = pstrdup(row[1] ? row[1] : "");
+		if (mysql_num_fields(my_res) >= 5 && row[4] != NULL && row[4][0] != '\0')
+			gtid_set = pstrdup(row[4]);
 	}
-	else
+	ok = true;
+
+exit:
+	if (my_res)
+		mysql_free_result(my_res);
+
+	if (locked)
 	{
-		for (i = 0, p = hd->tabnames; *p != NULL; p++, i++)
+		if (mysql_query(lock_conn, "UNLOCK TABLES") != 0)
 		{
+			fprintf(stderr, "unlock tables error: %s\n", mysql_error(lock_conn));
+			ok = false;
 		}
+		GETTIMEOFDAY(&after);
+		DIFF_MSEC(&after, &before, elapsed_msec);
+		fprintf(stderr, "global read lock held %.3f ms\n", elapsed_msec);
+	}
 
-		ntask = i;
-		th_hd.ntask = ntask;
-		th_hd.task = (Task_hd *)palloc0(sizeof(Task_hd) * th_hd.ntask);
-
-		for (i = 0, p = hd->tabnames; *p != NULL; p++, i++)
+	if (!ok)
+	{
+		for (i = 0; i < nconn; i++)
 		{
-			th_hd.task[i].id = i;
-			th_hd.task[i].schemaname = target_schema;
-			th_hd.task[i].relname = *p;
-			th_hd.task[i].query = hd->queries[i];
-
-			th_hd.task[i].count = 0;
-			th_hd.task[i].complete = false;
-			/* Set the former entry's link to this entry. Last entry's next feild would remain NULL */
-			if (i != 0)
-			{
-				th_hd.task[i-1].next = &th_hd.task[i];
-			}		
+			if (conns[i] != NULL)
+				mysql_close(conns[i]);
 		}
+		pfree(conns);
+		return NULL;
 	}
 
-	
-	th_hd.l_task = &(th_hd.task[0]);
+	fprintf(stderr, "consistent snapshot of %d connections taken", nconn);
+	if (binlog_file != NULL)
+		fprintf(stderr, " at binlog file %s position %s", binlog_file, binlog_pos);
+	else
+		fprintf(stderr, ", binary log is disabled");
+	if (gtid_set != NULL)
+		fprintf(stderr, " gtid set %s", gtid_set);
+	fprintf(stderr, "\n");
 
-	th_hd.th = (ThreadArg *)palloc0(sizeof(ThreadArg) * th_hd.nth);
-	for (i = 0; i < th_hd.nth; i++)
-	{
-		th_hd.th[i].id = i;
-		th_hd.th[i].count = 0;
-		th_hd.th[i].all_ok = false;
+	return conns;
+}
 
-		th_hd.th[i].hd = &th_hd;
+/*
+ * Run a query returning one row and return its first column, or NULL.
+ */
+static char *
+mysql_get_single_value(MYSQL *conn, const char *query)
+{
+	MYSQL_RES	*my_res = NULL;
+	MYSQL_ROW	row;
+	char		*result = NULL;
+
+	if (mysql_query(conn, query) != 0)
+	{
+		fprintf(stderr, "run query %s error: %s\n", query, mysql_error(conn));
+		return NULL;
 	}
-	pthread_mutex_init(&th_hd.t_lock, NULL);
 
-	if (!get_ddl_only)
+	my_res = mysql_store_result(conn);
+	if (my_res == NULL)
 	{
-		fprintf(stderr, "Starting data sync\n");
+		fprintf(stderr, "get result of %s error: %s\n", query, mysql_error(conn));
+		return NULL;
 	}
 
-	thread = (Thread *)palloc0(sizeof(Thread) * th_hd.nth);
-	for (i = 0; i < th_hd.nth; i++)
+	row = mysql_fetch_row(my_res);
+	if (row != NULL && row[0] != NULL)
 	{
-		ThreadCreate(&thread[i], mysql2pgsql_copy_data, &th_hd.th[i]);
+		result = pstrdup(row[0]);
 	}
 
-	WaitThreadEnd(th_hd.nth, thread);
+	mysql_free_result(my_res);
 
-	GETTIMEOFDAY(&after);
-	DIFF_MSEC(&after, &before, elapsed_msec);
+	return result;
+}
 
-	for (i = 0; i < th_hd.nth; i++)
+/*
+ * Split one table into chunks on the leading integer column of one of its
+ * indexes, so that several threads can copy disjoint ranges of it at the
+ * same time.  The range between MIN and MAX of the column is cut into equal
+ * pieces, enough of them to get about chunk_rows rows each.  The first and
+ * last chunk are left open so rows outside the sampled range (and NULLs)
+ * are still copied.
+ *
+ * Return the number of chunks written to *chunks, 0 if the table is not
+ * split.
+ */
+static int
+split_table_by_key_range(MYSQL *conn, char *db, Task_hd *task, Task_hd **chunks)
+{
+	PQExpBuffer	query;
+	char		*e_db = NULL;
+	char		*e_rel = NULL;
+	char		*keycol = NULL;
+	char		*value = NULL;
+	long		table_rows = 0;
+	int64		min_key;
+	int64		max_key;
+	uint64		step;
+	int			nchunk = 0;
+	int			i;
+	MYSQL_RES	*my_res = NULL;
+	MYSQL_ROW	row;
+	Task_hd		*result = NULL;
+
+	query = createPQExpBuffer();
+
+	e_db = palloc(strlen(db) * 2 + 1);
+	mysql_real_escape_string(conn, e_db, db, strlen(db));
+	e_rel = palloc(strlen(task->relname) * 2 + 1);
+	mysql_real_escape_string(conn, e_rel, task->relname, strlen(task->relname));
+
+	if (task->est_rows >= 0)
+		table_rows = task->est_rows;
+	else
 	{
-		if(th_hd.th[i].all_ok)
-		{
-			s_count += th_hd.th[i].count;
-		}
-		else
-		{
-			have_err = true;
-		}
+		appendPQExpBuffer(query, STMT_TABLE_ROWS, e_db, e_rel);
+		value = mysql_get_single_value(conn, query->data);
+		if (value == NULL)
+			goto done;
+		table_rows = atol(value);
+		pfree(value);
 	}
 
-	for (i = 0; i < ntask; i++)
+	nchunk = (table_rows + chunk_rows - 1) / chunk_rows;
+	if (nchunk <= 1)
 	{
-		t_count += th_hd.task[i].count;
+		nchunk = 0;
+		goto done;
 	}
 
-	if (!get_ddl_only)
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, STMT_CHUNK_KEY, e_db, e_rel);
+	keycol = mysql_get_single_value(conn, query->data);
+	if (keycol == NULL)
 	{
-		fprintf(stderr, "Number of rows migrated: %ld (number of source tables' rows: %ld) \n", s_count, t_count);
-		fprintf(stderr, "Data sync time cost %.3f ms\n", elapsed_msec);
-	} 
-	else
-	{
-		fprintf(stderr, "-- Number of tables: %d \n", ntask);
+		fprintf(stderr, "-- table %s has no integer index column to split on, copy it as a whole\n", task->relname);
+		nchunk = 0;
+		goto done;
 	}
 
-	if (have_err)
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, STMT_KEY_RANGE, keycol, keycol, db, task->relname);
+	if (mysql_query(conn, query->data) != 0 ||
+		(my_res = mysql_store_result(conn)) == NULL)
 	{
-		fprintf(stderr, "errors occured during migration\n");
+		fprintf(stderr, "get key range of table %s error: %s\n", task->relname, mysql_error(conn));
+		nchunk = 0;
+		goto done;
 	}
 
-	return 0;
-}
-
-static void *
-mysql2pgsql_copy_data(void *arg)
-{
-	ThreadArg *args = (ThreadArg *)arg;
-	Thread_hd *hd = args->hd;
-	MYSQL_RES	*my_res;
-	PGresult   *res2;
-	PQExpBuffer	query;
-	char *nspname;
-	char *relname;
-	Task_hd 	*curr = NULL;
-	TimevalStruct before,
-					after; 
-	double		elapsed_msec = 0;
-	MYSQL *origin_conn = NULL;
-	PGconn *target_conn = NULL;
-	int		ret = -1;
-	MYSQL_ROW	row;
-	Oid		*column_oids = NULL;
-	StringInfoData s_tmp;
-	int		i = 0;
-	int		target_version;
-	bool	isgp = false;
+	row = mysql_fetch_row(my_res);
+	if (row == NULL || row[0] == NULL || row[1] == NULL)
+	{
+		/* Empty table */
+		nchunk = 0;
+		goto done;
+	}
 
-	initStringInfo(&s_tmp);
-	origin_conn = connect_to_mysql(hd->mysql_src);
-	if (origin_conn == NULL)
+	errno = 0;
+	min_key = strtoll(row[0], NULL, 10);
+	max_key = strtoll(row[1], NULL, 10);
+	if (errno == ERANGE)
 	{
-		fprintf(stderr, "init src conn failed");
-		return NULL;
+		/* Unsigned bigint beyond the int64 range */
+		nchunk = 0;
+		goto done;
 	}
-	
-	target_conn = pglogical_connect(hd->desc, EXTENSION_NAME "_copy");
-	if (target_conn == NULL)
+
+	step = ((uint64) max_key - (uint64) min_key) / nchunk + 1;
+	if (step <= 1)
 	{
-		fprintf(stderr, "init desc conn failed: %s", PQerrorMessage(target_conn));
-		return NULL;
+		nchunk = 0;
+		goto done;
 	}
-	target_version = PQserverVersion(target_conn);
-	isgp = is_greenplum(target_conn);
-	setup_connection(target_conn, target_version, isgp);
-	setup_connection_from_mysql(target_conn);
 
-	query = createPQExpBuffer();
-
-	if (get_ddl_only)
-		fprintf(stderr, "\n-- Reference commands to create target tables %s: \n---------------\n\n",
-				isgp ? "(Please choose a distribution key and replace it with <distribution key> for each table)" : "");
-	while(1)
+	result = (Task_hd *) palloc0(sizeof(Task_hd) * nchunk);
+	for (i = 0; i < nchunk; i++)
 	{
-		int			nlist = 0;
-		int			n_col = 0;
-		int			row_count = 0;
+		int64	lower = (int64) ((uint64) min_key + step * i);
+		int64	upper = (int64) ((uint64) min_key + step * (i + 1));
 
-		GETTIMEOFDAY(&before);
-		pthread_mutex_lock(&hd->t_lock);
-		nlist = hd->ntask;
-		if (nlist == 1)
-		{
-		  curr = hd->l_task;
-		  hd->l_task = NULL;
-		  hd->ntask = 0;
-		}
-		else if (nlist > 1)
-		{
-		  Task_hd	*tmp = hd->l_task->next;
-		  curr = hd->l_task;
-		  hd->l_task = tmp;
-		  hd->ntask--;
-		}
+		resetPQExpBuffer(query);
+		if (i == 0)
+			appendPQExpBuffer(query, "`%s` < " INT64_FORMAT " or `%s` is null", keycol, upper, keycol);
+		else if (i == nchunk - 1)
+			appendPQExpBuffer(query, "`%s` >= " INT64_FORMAT, keycol, lower);
 		else
-		{
-			curr = NULL;
-		}
-
-		pthread_mutex_unlock(&hd->t_lock);
+			appendPQExpBuffer(query, "`%s` >= " INT64_FORMAT " and `%s` < " INT64_FORMAT,
+							  keycol, lower, keycol, upper);
+
+		result[i] = *task;
+		result[i].range_cond = pstrdup(query->data);
+		result[i].chunk_id = i;
+		result[i].nchunk = nchunk;
+		if (task->est_bytes >= 0)
+			result[i].est_bytes = task->est_bytes / nchunk;
+		result[i].est_rows = table_rows / nchunk;
+	}
 
-		if(curr == NULL)
-		{
-			break;
-		}
-	
-		if (!get_ddl_only)
-			start_copy_target_tx(target_conn, hd->desc_version, hd->desc_is_greenplum);
+	fprintf(stderr, "-- table %s (about %ld rows) is split into %d chunks on column %s\n",
+			task->relname, table_rows, nchunk, keycol);
 
-		nspname = hd->mysql_src->db;
-		relname = curr->relname;
+done:
+	if (my_res)
+		mysql_free_result(my_res);
+	if (keycol)
+		pfree(keycol);
+	pfree(e_db);
+	pfree(e_rel);
+	destroyPQExpBuffer(query);
+
+	*chunks = result;
+	return nchunk;
+}
 
-		//fprintf(stderr, "relname %s, query %s \n", relname, curr->query ? curr->query : "");
+/*
+ * Build a new task queue in which every large table is replaced by its key
+ * range chunks.  Tables given with their own query are never split.  Tables
+ * in the progress plan of an earlier run keep the chunks recorded there.
+ * Return NULL on error.
+ */
+static Task_hd *
+split_tasks_by_key_range(MYSQL *conn, char *db, Task_hd *task, int *ntask, ProgressPlan *plan)
+{
+	Task_hd		*result = NULL;
+	int			nresult = 0;
+	int			maxresult = *ntask;
+	int			i;
+	int			j;
+
+	result = (Task_hd *) palloc0(sizeof(Task_hd) * maxresult);
+	for (i = 0; i < *ntask; i++)
+	{
+		Task_hd	*chunks = NULL;
+		int		nchunk = 0;
 
-		if (curr && curr->query)
-		{
-			appendPQExpBufferStr(query, curr->query);
-		}
-		else
+		if (task[i].query == NULL)
 		{
-			appendPQExpBuffer(query, STMT_SELECT,
-							 nspname,
-							 relname);
+			if (plan != NULL && progress_find(plan, task[i].relname) != NULL)
+				nchunk = progress_chunks(plan, &task[i], &chunks);
+			else if (chunk_rows > 0)
+				nchunk = split_table_by_key_range(conn, db, &task[i], &chunks);
 		}
 
-		if (get_ddl_only)
+		if (nchunk < 0)
 		{
-			appendPQExpBufferStr(query, " limit 1 ");
+			pfree(result);
+			return NULL;
 		}
-		else
+
+		if (nresult + Max(nchunk, 1) > maxresult)
 		{
-			fprintf(stderr, "Query to get source data for target table %s: %s \n", relname, query->data);
+			maxresult = (nresult + Max(nchunk, 1)) * 2;
+			result = (Task_hd *) repalloc(result, sizeof(Task_hd) * maxresult);
 		}
 
-		ret = mysql_query(origin_conn, query->data);
-		if (ret != 0)
+		if (nchunk == 0)
 		{
-			fprintf(stderr, "run query error: %s\n", mysql_error(origin_conn));
-			goto exit;
+			result[nresult++] = task[i];
 		}
-		my_res = mysql_use_result(origin_conn);
-		column_oids = fetch_colmum_info(curr->schemaname, relname, my_res, isgp);
-		if (column_oids == NULL)
+		else
 		{
-			fprintf(stderr, "get table %s column type error\n", relname);
-			goto exit;
+			for (j = 0; j < nchunk; j++)
+				result[nresult++] = chunks[j];
+			pfree(chunks);
 		}
+	}
 
-		if (get_ddl_only)
-		{
-			curr->complete = true;
-			mysql_free_result(my_res);
-			resetPQExpBuffer(query);
-			continue;
-		}
-		
-		n_col = mysql_num_fields(my_res);
+	/* Renumber the tasks and relink the queue */
+	for (i = 0; i < nresult; i++)
+	{
+		result[i].id = i;
+		result[i].next = (i != nresult - 1) ? &result[i + 1] : NULL;
+	}
 
-		resetPQExpBuffer(query);
-		appendPQExpBuffer(query, "COPY %s%s%s FROM stdin DELIMITERS '|' with csv QUOTE ''''",
-						curr->schemaname ? PQescapeIdentifier(target_conn, curr->schemaname, strlen(curr->schemaname)) : "", curr->schemaname ? "." : "",
-						 PQescapeIdentifier(target_conn, relname,
-											strlen(relname)));
+	*ntask = nresult;
 
-		if (isgp && hd->ignore_error_count > 0)
-		{
-			appendPQExpBuffer(query, " SEGMENT REJECT LIMIT %u",
-									hd->ignore_error_count);
+	return result;
+}
 
-		}
+static int
+task_cmp_relname(const void *a, const void *b)
+{
+	const Task_hd *ta = *(Task_hd * const *) a;
+	const Task_hd *tb = *(Task_hd * const *) b;
+
+	return strcmp(ta->relname, tb->relname);
+}
+
+/*
+ * Fill in est_bytes and est_rows of every plain table task from
+ * information_schema.TABLES, in one query for the whole database.  Tasks
+ * with their own query, and tables not found, keep -1.
+ */
+static void
+fetch_table_sizes(MYSQL *conn, char *db, Task_hd *task, int ntask)
+{
+	PQExpBuffer	query;
+	char		*e_db = NULL;
+	Task_hd		**byname = NULL;
+	MYSQL_RES	*my_res = NULL;
+	MYSQL_ROW	row;
+	int			i;
 
-		res2 = PQexec(target_conn, query->data);
-		if (PQresultStatus(res2) != PGRES_COPY_IN)
+	byname = (Task_hd **) palloc(sizeof(Task_hd *) * ntask);
+	for (i = 0; i < ntask; i++)
+	{
+		task[i].est_bytes = -1;
+		task[i].est_rows = -1;
+		byname[i] = &task[i];
+	}
+	qsort(byname, ntask, sizeof(Task_hd *), task_cmp_relname);
+
+	query = createPQExpBuffer();
+	e_db = palloc(strlen(db) * 2 + 1);
+	mysql_real_escape_string(conn, e_db, db, strlen(db));
+	appendPQExpBuffer(query, STMT_TABLE_SIZES, e_db);
+
+	if (mysql_query(conn, query->data) != 0 ||
+		(my_res = mysql_store_result(conn)) == NULL)
+	{
+		fprintf(stderr, "get table sizes error: %s\n", mysql_error(conn));
+		goto done;
+	}
+
+	while ((row = mysql_fetch_row(my_res)) != NULL)
+	{
+		Task_hd		key;
+		Task_hd		*pkey = &key;
+		Task_hd		**found;
+
+		if (row[0] == NULL)
+			continue;
+
+		key.relname = row[0];
+		found = bsearch(&pkey, byname, ntask, sizeof(Task_hd *), task_cmp_relname);
+		if (found == NULL)
+			continue;
+
+		/* A table may be listed more than once */
+		while (found > byname && strcmp((*(found - 1))->relname, row[0]) == 0)
+			found--;
+
+		for (; found < byname + ntask && strcmp((*found)->relname, row[0]) == 0; found++)
 		{
-			fprintf(stderr,"table copy failed Query '%s': %s", 
-				query->data, PQerrorMessage(target_conn));
-			goto exit;
+			if ((*found)->query != NULL)
+				continue;
+			(*found)->est_bytes = row[1] ? strtoll(row[1], NULL, 10) : 0;
+			(*found)->est_rows = row[2] ? atol(row[2]) : 0;
 		}
+	}
 
+done:
+	if (my_res)
+		mysql_free_result(my_res);
+	pfree(byname);
+	pfree(e_db);
+	destroyPQExpBuffer(query);
+}
 
-		resetPQExpBuffer(query);
-		while ((row = mysql_fetch_row(my_res)) != NULL)
-		{
-			unsigned long *lengths;
+/*
+ * Longest processing time first: higher priority first, then the largest
+ * estimated size first, so that the big tables do not end up running alone
+ * at the end.  Tasks of unknown size, i.e. those with their own query, are
+ * started before the ones of known size, as they may well be large.
+ */
+static int
+task_cmp_schedule(const void *a, const void *b)
+{
+	const Task_hd *ta = (const Task_hd *) a;
+	const Task_hd *tb = (const Task_hd *) b;
+
+	if (ta->priority != tb->priority)
+		return ta->priority > tb->priority ? -1 : 1;
+	if ((ta->est_bytes < 0) != (tb->est_bytes < 0))
+		return ta->est_bytes < 0 ? -1 : 1;
+	if (ta->est_bytes != tb->est_bytes)
+		return ta->est_bytes > tb->est_bytes ? -1 : 1;
+	if (ta->est_rows != tb->est_rows)
+		return ta->est_rows > tb->est_rows ? -1 : 1;
+
+	/* Keep the listed order otherwise, and the chunks of a table together */
+	return ta->id - tb->id;
+}
 
-			lengths = mysql_fetch_lengths(my_res);
-			for (i = 0; i < n_col; i++)
-			{
-				if (i != 0)
-				{
-					appendPQExpBufferStr(query, "|");
-				}
-			
-				/* value of the field is NULL if it is fact NULL */
-				if(lengths[i] > 0 && row[i] != NULL)
-				{
-					quote_literal_local_withoid(&s_tmp, row[i], column_oids[i], query);
-				}
-			}
+/*
+ * Reorder the task queue for scheduling and relink it.
+ */
+static void
+schedule_tasks(Task_hd *task, int ntask)
+{
+	int		i;
 
-			appendPQExpBufferStr(query, "\n");
-			row_count++;
+	qsort(task, ntask, sizeof(Task_hd), task_cmp_schedule);
 
-			if (query->len >= buffer_size)
-			{
-				if (PQputCopyData(target_conn, query->data, query->len) != 1)
-				{
-					fprintf(stderr,"writing to target table failed destination connection reported: %s",
-							 PQerrorMessage(target_conn));
-					goto exit;
-				}
+	for (i = 0; i < ntask; i++)
+	{
+		task[i].id = i;
+		task[i].next = (i != ntask - 1) ? &task[i + 1] : NULL;
+	}
+}
 
-				/* Reset buffer for next use */
-				resetPQExpBuffer(query);	
-			}
-				
-			if (time_to_abort)
-			{
-				args->count = row_count;
-				curr->count = row_count;
-				fprintf(stderr, "receive shutdown sigint\n");
-				goto exit;
-			}
-		}
+static int
+progress_cmp_relname(const void *a, const void *b)
+{
+	return strcmp(((const ProgressEntry *) a)->relname, ((const ProgressEntry *) b)->relname);
+}
 
-		if (query->len > 0)
-		{
-			if (PQputCopyData(target_conn, query->data, query->len) != 1)
-            {
-                fprintf(stderr,"writing to target table failed destination connection reported: %s",
-                             PQerrorMessage(target_conn));
-                 goto exit;
-            }
+/* The condition identifying a task in the progress table */
+static const char *
+progress_task_cond(Task_hd *task)
+{
+	if (task->range_cond)
+		return task->range_cond;
+	if (task->query)
+		return task->query;
+	return "";
+}
 
-			resetPQExpBuffer(query);
-		}
+/*
+ * Find the first progress entry of relname, or NULL.
+ */
+static ProgressEntry *
+progress_find(ProgressPlan *plan, const char *relname)
+{
+	ProgressEntry	key;
+	ProgressEntry	*found;
 
-		args->count = row_count;
-		curr->count = row_count;
+	if (plan->nentry == 0)
+		return NULL;
 
-		/* Send local finish */
-		if (PQputCopyEnd(target_conn, NULL) != 1)
-		{
-			fprintf(stderr,"sending copy-completion to destination connection failed destination connection reported: %s",
-						 PQerrorMessage(target_conn));
-			goto exit;
-		}
-		
-		PQclear(res2);
-		res2 = PQgetResult(target_conn);
-		if (PQresultStatus(res2) != PGRES_COMMAND_OK)
+	key.relname = (char *) relname;
+	found = bsearch(&key, plan->entries, plan->nentry, sizeof(ProgressEntry), progress_cmp_relname);
+	if (found == NULL)
+		return NULL;
+
+	while (found > plan->entries && strcmp((found - 1)->relname, relname) == 0)
+		found--;
+
+	return found;
+}
+
+/*
+ * Create the progress table on the target if needed and load what an
+ * earlier run of the same source db recorded in it.  Return NULL on error.
+ */
+static ProgressPlan *
+progress_open(PGconn *conn, char *schemaname, char *db)
+{
+	PQExpBuffer	query;
+	PGresult	*res = NULL;
+	ProgressPlan *plan = NULL;
+	char		*nsp_literal = NULL;
+	char		*db_literal = NULL;
+	int			i;
+
+	query = createPQExpBuffer();
+
+	if (schemaname)
+	{
+		char	*nsp_ident = PQescapeIdentifier(conn, schemaname, strlen(schemaname));
+
+		appendPQExpBuffer(query, "%s.%s", nsp_ident, PROGRESS_TABLE);
+		PQfreemem(nsp_ident);
+		nsp_literal = PQescapeLiteral(conn, schemaname, strlen(schemaname));
+	}
+	else
+		appendPQExpBufferStr(query, PROGRESS_TABLE);
+	progress_table = pstrdup(query->data);
+
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, STMT_PROGRESS_EXISTS, nsp_literal ? nsp_literal : "current_schema()");
+	res = PQexec(conn, query->data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "look up progress table failed: %s", PQerrorMessage(conn));
+		goto exit;
+	}
+
+	if (strcmp(PQgetvalue(res, 0, 0), "0") == 0)
+	{
+		PQclear(res);
+		resetPQExpBuffer(query);
+		appendPQExpBuffer(query, STMT_PROGRESS_CREATE, progress_table);
+		res = PQexec(conn, query->data);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
 		{
-			fprintf(stderr, "COPY failed for table \"%s\": %s",
-								 relname, PQerrorMessage(target_conn));
+			fprintf(stderr, "create progress table failed: %s", PQerrorMessage(conn));
 			goto exit;
 		}
+	}
+	PQclear(res);
 
-		finish_copy_target_tx(target_conn);
-		curr->complete = true;
-		PQclear(res2);
-		resetPQExpBuffer(query);
-		mysql_free_result(my_res);
+	db_literal = PQescapeLiteral(conn, db, strlen(db));
+	resetPQExpBuffer(query);
+	appendPQExpBuffer(query, STMT_PROGRESS_LOAD, progress_table, db_literal);
+	res = PQexec(conn, query->data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "load progress failed: %s", PQerrorMessage(conn));
+		goto exit;
+	}
 
-		GETTIMEOFDAY(&after);
-		DIFF_MSEC(&after, &before, elapsed_msec);
-		fprintf(stderr,"thread %d migrate task %d table %s.%s %ld rows complete, time cost %.3f ms\n",
-						 args->id, curr->id, nspname, relname, curr->count, elapsed_msec);
+	plan = (ProgressPlan *) palloc0(sizeof(ProgressPlan));
+	plan->nentry = PQntuples(res);
+	plan->entries = (ProgressEntry *) palloc0(sizeof(ProgressEntry) * Max(plan->nentry, 1));
+	for (i = 0; i < plan->nentry; i++)
+	{
+		ProgressEntry *entry = &plan->entries[i];
+
+		entry->relname = pstrdup(PQgetvalue(res, i, 0));
+		entry->cond = pstrdup(PQgetvalue(res, i, 1));
+		entry->chunk_id = atoi(PQgetvalue(res, i, 2));
+		entry->nchunk = atoi(PQgetvalue(res, i, 3));
+		entry->done = strcmp(PQgetvalue(res, i, 4), "t") == 0;
+		entry->rows = atol(PQgetvalue(res, i, 5));
 	}
-	
-	args->all_ok = true;
+	qsort(plan->entries, plan->nentry, sizeof(ProgressEntry), progress_cmp_relname);
 
-	if (get_ddl_only)
-		fprintf(stderr, "---------------\n\n");
+	if (plan->nentry > 0)
+		fprintf(stderr, "-- resume from progress table %s, %d tasks recorded\n", progress_table, plan->nentry);
 
 exit:
-
-	mysql_close(origin_conn);
-	PQfinish(target_conn);
-	ThreadExit(0);
-	return NULL;
+	PQclear(res);
+	if (nsp_literal)
+		PQfreemem(nsp_literal);
+	if (db_literal)
+		PQfreemem(db_literal);
+	destroyPQExpBuffer(query);
+
+	return plan;
 }
 
-static void
-quote_literal_local_withoid(StringInfo s, const char *rawstr, Oid type, PQExpBuffer buffer)
-{
-	char	   *result;
-	int			len;
-	int			newlen;
-	bool need_process = true;
-
-	if (INT2OID == type)
-		need_process = false;
-	else if (INT4OID == type)
-		need_process = false;
-	else if (INT8OID == type)
-		need_process = false;
-	else if (FLOAT4OID == type)
-		need_process = false;
-	else if (FLOAT8OID == type)
-		need_process = false;
-	else if (NUMERICOID == type)
-		need_process = false;
-	else if (TIMESTAMPOID == type)
-	{
-		if (strcmp(rawstr, "0000-00-00") == 0 ||
-			strcmp(rawstr, "00:00:00") == 0 ||
-			strcmp(rawstr, "0000-00-00 00:00:00") == 0 ||
-			strcmp(rawstr, "0000") == 0)
-		{
-			return;
-		}
-	
-		need_process = false;
+/*
+ * Rebuild the chunks of a table from the ranges an earlier run recorded.
+ * Splitting again could give other ranges, as the table may have changed,
+ * which would copy some rows twice and miss others.
+ *
+ * Return the number of chunks written to *chunks, 0 if the table was not
+ * split, -1 if the recorded chunks are unusable.
+ */
+static int
+progress_chunks(ProgressPlan *plan, Task_hd *task, Task_hd **chunks)
+{
+	ProgressEntry *entry = progress_find(plan, task->relname);
+	ProgressEntry *end = plan->entries + plan->nentry;
+	Task_hd		*result = NULL;
+	int			nchunk = 0;
+	int			i;
+
+	if (entry == NULL || entry->nchunk <= 1)
+		return 0;
+
+	nchunk = entry->nchunk;
+	result = (Task_hd *) palloc0(sizeof(Task_hd) * nchunk);
+	for (; entry < end && strcmp(entry->relname, task->relname) == 0; entry++)
+	{
+		if (entry->nchunk != nchunk || entry->chunk_id < 0 || entry->chunk_id >= nchunk)
+			break;
+
+		i = entry->chunk_id;
+		result[i] = *task;
+		result[i].range_cond = entry->cond;
+		result[i].chunk_id = i;
+		result[i].nchunk = nchunk;
+		if (task->est_bytes >= 0)
+			result[i].est_bytes = task->est_bytes / nchunk;
+		if (task->est_rows >= 0)
+			result[i].est_rows = task->est_rows / nchunk;
 	}
 
-	if (need_process == false)
+	for (i = 0; i < nchunk; i++)
 	{
-		appendPQExpBuffer(buffer, "%s", rawstr);
-		return;
+		if (result[i].range_cond == NULL)
+		{
+			fprintf(stderr, "recorded chunks of table %s are inconsistent, clear them from %s to start the table over\n",
+					task->relname, progress_table);
+			pfree(result);
+			return -1;
+		}
 	}
 
-	/*if (TIMESTAMPOID == type)
-		need_process = false;
+	*chunks = result;
+	return nchunk;
+}
+
+/*
+ * Drop the tasks an earlier run finished from the queue, and record the new
+ * ones, in one transaction.  Return false on error.
+ */
+static bool
+progress_apply(PGconn *conn, ProgressPlan *plan, char *db, Task_hd *task, int *ntask)
+{
+	PQExpBuffer	query;
+	char		*db_literal = NULL;
+	int			nleft = 0;
+	int			nskip = 0;
+	long		skip_rows = 0;
+	bool		ok = false;
+	int			i;
 
-	if (need_process == false)
+	query = createPQExpBuffer();
+	db_literal = PQescapeLiteral(conn, db, strlen(db));
+
+	if (ExecuteSqlStatement(conn, "BEGIN") != 0)
+		goto exit;
+
+	for (i = 0; i < *ntask; i++)
 	{
-		appendPQExpBuffer(buffer, "'");
-		appendPQExpBuffer(buffer, "%s", rawstr);
-		appendPQExpBuffer(buffer, "'");
-		return;
-	}*/
+		const char	*cond = progress_task_cond(&task[i]);
+		ProgressEntry *entry = progress_find(plan, task[i].relname);
+		ProgressEntry *end = plan->entries + plan->nentry;
+
+		for (; entry != NULL && entry < end && strcmp(entry->relname, task[i].relname) == 0; entry++)
+		{
+			if (strcmp(entry->cond, cond) == 0)
+				break;
+		}
+
+		if (entry != NULL && entry < end && strcmp(entry->relname, task[i].relname) == 0)
+		{
+			if (entry->done)
+			{
+				nskip++;
+				skip_rows += entry->rows;
+				continue;
+			}
+		}
+		else
+		{
+			char	*rel_literal = PQescapeLiteral(conn, task[i].relname, strlen(task[i].relname));
+			char	*cond_literal = PQescapeLiteral(conn, cond, strlen(cond));
+
+			resetPQExpBuffer(query);
+			appendPQExpBuffer(query, STMT_PROGRESS_INSERT, progress_table, db_literal, rel_literal,
+							  cond_literal, task[i].chunk_id, Max(task[i].nchunk, 1));
+			PQfreemem(rel_literal);
+			PQfreemem(cond_literal);
+			if (ExecuteSqlStatement(conn, query->data) != 0)
+				goto exit;
+		}
+
+		task[nleft++] = task[i];
+	}
 
-	len = strlen(rawstr);
-	resetStringInfo(s);
-	appendStringInfoSpaces(s, len * 2 + 3);
+	if (finish_copy_target_tx(conn) != 0)
+		goto exit;
 
-	result = s->data;
+	if (nskip > 0)
+		fprintf(stderr, "-- %d tasks (%ld rows) were copied by an earlier run, %d tasks left\n",
+				nskip, skip_rows, nleft);
 
-	newlen = quote_literal_internal(result, rawstr, len);
-	result[newlen] = '\0';
+	*ntask = nleft;
+	ok = true;
 
-	appendPQExpBufferStr(buffer, result);
+exit:
+	PQfreemem(db_literal);
+	destroyPQExpBuffer(query);
+
+	return ok;
+}
+
+/*
+ * Mark a task done in the progress table.  Runs in the transaction of the
+ * task's COPY, so the mark is committed if and only if the rows are.
+ */
+static bool
+progress_mark_done(PGconn *conn, char *db, Task_hd *task, long rows)
+{
+	PQExpBuffer	query = createPQExpBuffer();
+	const char	*cond = progress_task_cond(task);
+	char		*db_literal = PQescapeLiteral(conn, db, strlen(db));
+	char		*rel_literal = PQescapeLiteral(conn, task->relname, strlen(task->relname));
+	char		*cond_literal = PQescapeLiteral(conn, cond, strlen(cond));
+	bool		ok;
+
+	appendPQExpBuffer(query, STMT_PROGRESS_DONE, progress_table, rows, db_literal, rel_literal, cond_literal);
+	ok = ExecuteSqlStatement(conn, query->data) == 0;
+
+	PQfreemem(db_literal);
+	PQfreemem(rel_literal);
+	PQfreemem(cond_literal);
+	destroyPQExpBuffer(query);
+
+	return ok;
+}
+
+/*
+ * Entry point for mysql2pgsql
+ */
+int 
+mysql2pgsql_sync_main(char *desc, int nthread, mysql_conn_info *hd, char* target_schema, uint32 ignore_error_count)
+{
+	int 		i = 0;
+	Thread_hd th_hd;
+	Thread			*thread = NULL;
+	PGresult		*res = NULL;
+	PGconn		*desc_conn;
+	long		s_count = 0;
+	long		t_count = 0;
+	bool		have_err = false;
+	TimevalStruct before,
+					after; 
+	double		elapsed_msec = 0;
+	int		ntask = 0;
+	MYSQL	*conn_src = NULL;
+	MYSQL_RES	*my_res = NULL;
+	char **p = NULL;
+	ProgressPlan *plan = NULL;
+
+#ifndef WIN32
+	signal(SIGINT, sigint_handler);
+#endif
+
+	GETTIMEOFDAY(&before);
+
+	memset(&th_hd, 0, sizeof(Thread_hd));
+	th_hd.nth = nthread;
+	th_hd.desc = desc;
+
+	/* Threads up to the maximum are started, the flow control runs some of them */
+	if (flow_max_workers > 0 && !get_ddl_only)
+		th_hd.nth = flow_max_workers;
+	th_hd.mysql_src = hd;
+	th_hd.ignore_error_count = ignore_error_count;
+
+	/*
+	 * Each thread holds up to PIPELINE_DEPTH row batches and as many copy
+	 * chunks, keep the chunks small enough for all of them to fit.
+	 */
+	if (copy_memory_limit > 0)
+	{
+		long	per_thread = (long) copy_memory_limit * 1024 * 1024 / th_hd.nth;
+
+		copy_batch_max = (per_thread - PIPELINE_DEPTH * ROW_BATCH_SIZE) / PIPELINE_DEPTH;
+		copy_batch_max = Max(COPY_BATCH_MIN, Min(COPY_BATCH_MAX, copy_batch_max));
+	}
+
+	conn_src = connect_to_mysql(hd);
+	if (conn_src == NULL)
+	{
+		fprintf(stderr, "init src conn failed.\n");
+		return 1;
+	}
+
+	desc_conn = pglogical_connect(desc, EXTENSION_NAME "_main");
+	if (desc_conn == NULL)
+	{
+		fprintf(stderr, "init desc conn failed: %s\n", PQerrorMessage(desc_conn));
+		return 1;
+	}
+	th_hd.desc_version = PQserverVersion(desc_conn);
+	th_hd.desc_is_greenplum = is_greenplum(desc_conn);
+
+	/* COPY FREEZE came with 9.3, ALTER TABLE SET LOGGED with 9.5 */
+	if (fast_load && (th_hd.desc_is_greenplum || th_hd.desc_version < 90300))
+	{
+		fprintf(stderr, "fast load needs PostgreSQL 9.3 or later on target, copy data as usual\n");
+		fast_load = false;
+	}
+	if (fast_load_unlogged && (!fast_load || th_hd.desc_version < 90500))
+	{
+		if (fast_load)
+			fprintf(stderr, "unlogged load needs PostgreSQL 9.5 or later on target, tables stay logged\n");
+		fast_load_unlogged = false;
+	}
+
+	/* ADD CONSTRAINT USING INDEX came with 9.1 */
+	if (rebuild_workers > 0 && (th_hd.desc_is_greenplum || th_hd.desc_version < 90100))
+	{
+		fprintf(stderr, "deferred index build needs PostgreSQL 9.1 or later on target, indexes are kept during the copy\n");
+		rebuild_workers = 0;
+	}
+
+	if (gpfdist_address != NULL && !get_ddl_only)
+	{
+		if (!th_hd.desc_is_greenplum)
+			fprintf(stderr, "target db is not greenplum, copy data through COPY\n");
+		else if ((gpfdist_server = gpfdist_start(gpfdist_address)) == NULL)
+			return 1;
+	}
+
+	if (resume_copy && !get_ddl_only)
+	{
+		plan = progress_open(desc_conn, target_schema, hd->db);
+		if (plan == NULL)
+			return 1;
+	}
+
+	if (hd->tabnames == NULL)
+	{
+		PQExpBuffer	query;
+		MYSQL_ROW row;
+		int ret = -1;
+
+		query = createPQExpBuffer();
+
+		appendPQExpBuffer(query, STMT_SHOW_TABLES, hd->db);
+		ret = mysql_real_query(conn_src, query->data, strlen(query->data));
+		if (ret != 0)
+		{
+			fprintf(stderr, "init desc conn failed: %s", mysql_error(conn_src));
+			return 1;
+		}
+		
+		my_res = mysql_store_result(conn_src);
+		if (my_res == NULL)
+		{
+			fprintf(stderr, "get src db table failed: %s", mysql_error(conn_src));
+			return 1;
+		}
+	
+		ntask = mysql_num_rows(my_res);
+		th_hd.ntask = ntask;
+		if (th_hd.ntask >= 1)
+		{
+			th_hd.task = (Task_hd *)palloc0(sizeof(Task_hd) * th_hd.ntask);
+		}
+
+		/*
+		  * The linked-array th_hd.task serves as a task queue for all the worker threads to pick up tasks and consume
+		  */
+		for (i = 0; i < th_hd.ntask; i++)
+		{
+			row = mysql_fetch_row(my_res);
+			th_hd.task[i].id = i;
+			th_hd.task[i].schemaname = target_schema;
+			th_hd.task[i].relname = pstrdup(row[0]);
+			th_hd.task[i].query = NULL;
+			th_hd.task[i].count = 0;
+			th_hd.task[i].complete = false;
+
+			/* Set the former entry's link to this entry. Last entry's next feild would remain NULL */
+			if (i != 0)
+			{
+				th_hd.task[i-1].next = &th_hd.task[i];
+			}
+		}
+		mysql_free_result(my_res);
+		PQclear(res);
+		destroyPQExpBuffer(query);
+	}
+	else
+	{
+		for (i = 0, p = hd->tabnames; *p != NULL; p++, i++)
+		{
+		}
+
+		ntask = i;
+		th_hd.ntask = ntask;
+		th_hd.task = (Task_hd *)palloc0(sizeof(Task_hd) * th_hd.ntask);
+
+		for (i = 0, p = hd->tabnames; *p != NULL; p++, i++)
+		{
+			th_hd.task[i].id = i;
+			th_hd.task[i].schemaname = target_schema;
+			th_hd.task[i].relname = *p;
+			th_hd.task[i].query = hd->queries[i];
+			th_hd.task[i].priority = hd->priorities ? hd->priorities[i] : 0;
+
+			th_hd.task[i].count = 0;
+			th_hd.task[i].complete = false;
+			/* Set the former entry's link to this entry. Last entry's next feild would remain NULL */
+			if (i != 0)
+			{
+				th_hd.task[i-1].next = &th_hd.task[i];
+			}		
+		}
+	}
+
+
+	if (!get_ddl_only && ntask > 0)
+		fetch_table_sizes(conn_src, hd->db, th_hd.task, ntask);
+
+	if ((chunk_rows > 0 || plan != NULL) && !get_ddl_only && ntask > 0)
+	{
+		th_hd.task = split_tasks_by_key_range(conn_src, hd->db, th_hd.task, &ntask, plan);
+		if (th_hd.task == NULL)
+			return 1;
+		th_hd.ntask = ntask;
+	}
+
+	if (plan != NULL && ntask > 0)
+	{
+		if (!progress_apply(desc_conn, plan, hd->db, th_hd.task, &ntask))
+			return 1;
+		th_hd.ntask = ntask;
+	}
+
+	/* Dropping the foreign keys first also lets the tables be truncated */
+	if (rebuild_workers > 0 && !get_ddl_only && ntask > 0 &&
+		!rebuild_defer(desc_conn, th_hd.task, ntask))
+	{
+		PQfinish(desc_conn);
+		return 1;
+	}
+
+	if (fast_load && !get_ddl_only && ntask > 0)
+		plan_fast_load(desc_conn, th_hd.task, ntask, fast_load_unlogged);
+	PQfinish(desc_conn);
+
+	/* DDL is printed in the source order, data is copied largest first */
+	if (!get_ddl_only && ntask > 0)
+		schedule_tasks(th_hd.task, ntask);
+
+	th_hd.l_task = &(th_hd.task[0]);
+
+	th_hd.th = (ThreadArg *)palloc0(sizeof(ThreadArg) * th_hd.nth);
+	for (i = 0; i < th_hd.nth; i++)
+	{
+		th_hd.th[i].id = i;
+		th_hd.th[i].count = 0;
+		th_hd.th[i].all_ok = false;
+
+		th_hd.th[i].hd = &th_hd;
+	}
+	pthread_mutex_init(&th_hd.t_lock, NULL);
+
+	if (consistent_snapshot && !get_ddl_only && ntask > 0)
+	{
+		snapshot_conns = take_consistent_snapshot(conn_src, hd, th_hd.nth);
+		if (snapshot_conns == NULL)
+			return 1;
+	}
+
+	if (!get_ddl_only)
+	{
+		fprintf(stderr, "Starting data sync\n");
+	}
+
+	if (!get_ddl_only)
+		rate = ratelimit_start(RATELIMIT_CONFIG);
+	if (flow_max_workers > 0 && !get_ddl_only)
+		flow = flowctl_start(flow_min_workers, flow_max_workers, nthread);
+
+	thread = (Thread *)palloc0(sizeof(Thread) * th_hd.nth);
+	for (i = 0; i < th_hd.nth; i++)
+	{
+		ThreadCreate(&thread[i], mysql2pgsql_copy_data, &th_hd.th[i]);
+	}
+
+	WaitThreadEnd(th_hd.nth, thread);
+	if (flow != NULL)
+		flowctl_stop(flow);
+
+	if (gpfdist_server != NULL)
+	{
+		gpfdist_stop(gpfdist_server);
+		gpfdist_server = NULL;
+	}
+
+	GETTIMEOFDAY(&after);
+	DIFF_MSEC(&after, &before, elapsed_msec);
+
+	for (i = 0; i < th_hd.nth; i++)
+	{
+		if(th_hd.th[i].all_ok)
+		{
+			s_count += th_hd.th[i].count;
+		}
+		else
+		{
+			have_err = true;
+		}
+	}
+
+	for (i = 0; i < ntask; i++)
+	{
+		t_count += th_hd.task[i].count;
+	}
+
+	if (!get_ddl_only)
+	{
+		fprintf(stderr, "Number of rows migrated: %ld (number of source tables' rows: %ld) \n", s_count, t_count);
+		fprintf(stderr, "Data sync time cost %.3f ms\n", elapsed_msec);
+	} 
+	else
+	{
+		fprintf(stderr, "-- Number of tables: %d \n", ntask);
+	}
+
+	if (have_err)
+	{
+		fprintf(stderr, "errors occured during migration\n");
+	}
+
+	if (rebuild_workers > 0 && !get_ddl_only)
+	{
+		if (have_err)
+			fprintf(stderr, "indexes are not rebuilt after errors, they are kept in table %s\n", REBUILD_TABLE);
+		else if (!rebuild_run(desc, rebuild_workers, rebuild_work_mem))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *
+mysql2pgsql_copy_data(void *arg)
+{
+	ThreadArg *args = (ThreadArg *)arg;
+	Thread_hd *hd = args->hd;
+	MYSQL_RES	*my_res;
+	PGresult   *res2;
+	PQExpBuffer	query;
+	char *nspname;
+	char *relname;
+	Task_hd 	*curr = NULL;
+	TimevalStruct before,
+					after; 
+	double		elapsed_msec = 0;
+	MYSQL *origin_conn = NULL;
+	PGconn *target_conn = NULL;
+	int		ret = -1;
+	Oid		*column_oids = NULL;
+	ColumnEncoder *encoders = NULL;
+	CopyPipeline pipe;
+	BatchSizer	sizer;
+	MYSQL_STMT *stmt = NULL;
+	MYSQL_BIND *binds = NULL;
+	StmtColumn *stmt_cols = NULL;
+	char	*forms = NULL;
+	int		target_version;
+	bool	isgp = false;
+	bool	binary_target = false;
+	bool	use_binary = false;
+	GpfdistFeed *feed = NULL;
+	bool	running = false;
+
+	if (snapshot_conns != NULL)
+		origin_conn = snapshot_conns[args->id];
+	else
+		origin_conn = connect_to_mysql(hd->mysql_src);
+	if (origin_conn == NULL)
+	{
+		fprintf(stderr, "init src conn failed");
+		return NULL;
+	}
+	
+	target_conn = pglogical_connect(hd->desc, EXTENSION_NAME "_copy");
+	if (target_conn == NULL)
+	{
+		fprintf(stderr, "init desc conn failed: %s", PQerrorMessage(target_conn));
+		return NULL;
+	}
+	target_version = PQserverVersion(target_conn);
+	isgp = is_greenplum(target_conn);
+	setup_connection(target_conn, target_version, isgp);
+	setup_connection_from_mysql(target_conn);
+
+	if (binary_copy && !get_ddl_only)
+	{
+		const char *integer_datetimes = PQparameterStatus(target_conn, "integer_datetimes");
+
+		binary_target = !isgp && target_version >= 90000 &&
+						integer_datetimes != NULL && strcmp(integer_datetimes, "on") == 0;
+		if (!binary_target && args->id == 0)
+			fprintf(stderr, "binary copy is not supported by the target db, copy data as csv\n");
+	}
+
+	query = createPQExpBuffer();
+	batch_sizer_init(&sizer, COPY_BATCH_MIN, copy_batch_max);
+
+	if (get_ddl_only)
+		fprintf(stderr, "\n-- Reference commands to create target tables %s: \n---------------\n\n",
+				isgp ? "(Please choose a distribution key and replace it with <distribution key> for each table)" : "");
+	while(1)
+	{
+		int			nlist = 0;
+		int			n_col = 0;
+		long		row_count = 0;
+
+		if (flow != NULL)
+		{
+			flowctl_acquire(flow);
+			running = true;
+		}
+
+		GETTIMEOFDAY(&before);
+		pthread_mutex_lock(&hd->t_lock);
+		nlist = hd->ntask;
+		if (nlist == 1)
+		{
+		  curr = hd->l_task;
+		  hd->l_task = NULL;
+		  hd->ntask = 0;
+		}
+		else if (nlist > 1)
+		{
+		  Task_hd	*tmp = hd->l_task->next;
+		  curr = hd->l_task;
+		  hd->l_task = tmp;
+		  hd->ntask--;
+		}
+		else
+		{
+			curr = NULL;
+		}
+
+		pthread_mutex_unlock(&hd->t_lock);
+
+		if(curr == NULL)
+		{
+			break;
+		}
+	
+		if (!get_ddl_only)
+		{
+			start_copy_target_tx(target_conn, hd->desc_version, hd->desc_is_greenplum);
+			if (curr->truncate &&
+				fast_load_prepare(target_conn, curr) != 0)
+				goto exit;
+		}
+
+		nspname = hd->mysql_src->db;
+		relname = curr->relname;
+
+		//fprintf(stderr, "relname %s, query %s \n", relname, curr->query ? curr->query : "");
+
+		if (curr && curr->query)
+		{
+			appendPQExpBufferStr(query, curr->query);
+		}
+		else
+		{
+			appendPQExpBuffer(query, STMT_SELECT,
+							 nspname,
+							 relname);
+			if (curr->range_cond)
+				appendPQExpBuffer(query, STMT_WHERE, curr->range_cond);
+		}
+
+		if (get_ddl_only)
+		{
+			appendPQExpBufferStr(query, " limit 1 ");
+		}
+		else
+		{
+			fprintf(stderr, "Query to get source data for target table %s: %s \n", relname, query->data);
+		}
+
+		if (prepared_fetch && !get_ddl_only)
+		{
+			stmt = stmt_open(origin_conn, query->data);
+			if (stmt == NULL)
+				goto exit;
+
+			my_res = mysql_stmt_result_metadata(stmt);
+			if (my_res == NULL)
+			{
+				fprintf(stderr, "get result metadata error: %s\n", mysql_stmt_error(stmt));
+				goto exit;
+			}
+		}
+		else
+		{
+			ret = mysql_query(origin_conn, query->data);
+			if (ret != 0)
+			{
+				fprintf(stderr, "run query error: %s\n", mysql_error(origin_conn));
+				goto exit;
+			}
+			my_res = mysql_use_result(origin_conn);
+		}
+		column_oids = fetch_colmum_info(curr->schemaname, relname, my_res, isgp, curr->chunk_id == 0,
+										&encoders);
+		if (column_oids == NULL)
+		{
+			fprintf(stderr, "get table %s column type error\n", relname);
+			goto exit;
+		}
+
+		if (get_ddl_only)
+		{
+			curr->complete = true;
+			mysql_free_result(my_res);
+			pfree(column_oids);
+			pfree(encoders);
+			resetPQExpBuffer(query);
+			continue;
+		}
+		
+		n_col = mysql_num_fields(my_res);
+
+		if (stmt != NULL)
+		{
+			stmt_cols = stmt_bind_columns(stmt, my_res, n_col, &binds, &forms);
+			if (stmt_cols == NULL)
+				goto exit;
+		}
+
+		use_binary = binary_target &&
+			binary_copy_supported(target_conn, curr->schemaname, relname, my_res, column_oids, n_col);
+
+		resetPQExpBuffer(query);
+		if (gpfdist_server != NULL)
+		{
+			/* Same csv dialect as the COPY below */
+			appendPQExpBufferStr(query, "FORMAT 'csv' (DELIMITER '|' QUOTE '''') ENCODING 'utf8'");
+			if (hd->ignore_error_count > 0)
+				appendPQExpBuffer(query, " SEGMENT REJECT LIMIT %u", hd->ignore_error_count);
+
+			feed = gpfdist_load_begin(gpfdist_server, target_conn, curr->schemaname, relname, query->data);
+			if (feed == NULL)
+				goto exit;
+		}
+		else
+		{
+			appendPQExpBuffer(query, "COPY %s%s%s FROM stdin %s",
+							curr->schemaname ? PQescapeIdentifier(target_conn, curr->schemaname, strlen(curr->schemaname)) : "", curr->schemaname ? "." : "",
+							 PQescapeIdentifier(target_conn, relname,
+												strlen(relname)),
+							use_binary ? (fast_load_freeze(curr) ? "WITH (FORMAT binary, FREEZE)" : "WITH (FORMAT binary)") :
+							"DELIMITERS '|' with csv QUOTE ''''");
+			if (fast_load_freeze(curr) && !use_binary)
+				appendPQExpBufferStr(query, " FREEZE");
+
+			if (isgp && hd->ignore_error_count > 0)
+				appendPQExpBuffer(query, " SEGMENT REJECT LIMIT %u",
+										hd->ignore_error_count);
+
+			res2 = PQexec(target_conn, query->data);
+			if (PQresultStatus(res2) != PGRES_COPY_IN)
+			{
+				fprintf(stderr,"table copy failed Query '%s': %s", 
+					query->data, PQerrorMessage(target_conn));
+				PQclear(res2);
+				goto exit;
+			}
+			PQclear(res2);
+		}
+
+
+		if (use_binary &&
+			PQputCopyData(target_conn, BINARY_COPY_HEADER, BINARY_COPY_HEADER_LEN) != 1)
+		{
+			fprintf(stderr,"writing to target table failed destination connection reported: %s",
+					 PQerrorMessage(target_conn));
+			goto exit;
+		}
+
+		resetPQExpBuffer(query);
+		copy_pipeline_start(&pipe, target_conn, n_col, column_oids, encoders, forms, use_binary,
+							buffer_size > 0 ? NULL : &sizer, feed);
+		pipe.rate_table = ratelimit_table(rate, relname);
+		if (stmt != NULL)
+			row_count = fetch_rows_stmt(stmt, binds, stmt_cols, n_col, &pipe);
+		else
+			row_count = fetch_rows_text(my_res, n_col, &pipe);
+
+		if (row_count < 0)
+		{
+			copy_pipeline_fail(&pipe);
+			copy_pipeline_finish(&pipe);
+			goto exit;
+		}
+
+		if (!copy_pipeline_finish(&pipe))
+			goto exit;
+
+		if (use_binary &&
+			PQputCopyData(target_conn, BINARY_COPY_TRAILER, 2) != 1)
+		{
+			fprintf(stderr,"writing to target table failed destination connection reported: %s",
+					 PQerrorMessage(target_conn));
+			goto exit;
+		}
+
+		args->count += row_count;
+		curr->count = row_count;
+
+		if (feed != NULL)
+		{
+			GpfdistFeed *done = feed;
+
+			feed = NULL;
+			if (!gpfdist_load_end(done, target_conn, NULL))
+				goto exit;
+		}
+		else
+		{
+			/* Send local finish */
+			if (PQputCopyEnd(target_conn, NULL) != 1)
+			{
+				fprintf(stderr,"sending copy-completion to destination connection failed destination connection reported: %s",
+							 PQerrorMessage(target_conn));
+				goto exit;
+			}
+
+			res2 = PQgetResult(target_conn);
+			if (PQresultStatus(res2) != PGRES_COMMAND_OK)
+			{
+				fprintf(stderr, "COPY failed for table \"%s\": %s",
+									 relname, PQerrorMessage(target_conn));
+				PQclear(res2);
+				goto exit;
+			}
+			PQclear(res2);
+		}
+
+		if (curr->truncate &&
+			fast_load_finish(target_conn, curr) != 0)
+			goto exit;
+
+		if (progress_table != NULL &&
+			!progress_mark_done(target_conn, hd->mysql_src->db, curr, row_count))
+			goto exit;
+
+		finish_copy_target_tx(target_conn);
+		curr->complete = true;
+		resetPQExpBuffer(query);
+		mysql_free_result(my_res);
+		pfree(column_oids);
+		pfree(encoders);
+		if (stmt != NULL)
+		{
+			stmt_free_columns(stmt_cols, binds, forms, n_col);
+			mysql_stmt_close(stmt);
+			stmt = NULL;
+			forms = NULL;
+		}
+
+		GETTIMEOFDAY(&after);
+		DIFF_MSEC(&after, &before, elapsed_msec);
+		if (curr->nchunk > 1)
+			fprintf(stderr,"thread %d migrate task %d table %s.%s chunk %d/%d %ld rows complete, time cost %.3f ms\n",
+							 args->id, curr->id, nspname, relname, curr->chunk_id + 1, curr->nchunk, curr->count, elapsed_msec);
+		else
+			fprintf(stderr,"thread %d migrate task %d table %s.%s %ld rows complete, time cost %.3f ms\n",
+							 args->id, curr->id, nspname, relname, curr->count, elapsed_msec);
+
+		if (flow != NULL)
+		{
+			flowctl_release(flow);
+			running = false;
+		}
+	}
+	
+	args->all_ok = true;
+
+	if (get_ddl_only)
+		fprintf(stderr, "---------------\n\n");
+
+exit:
+	/* A parked worker may take over the rest of the queue */
+	if (running)
+		flowctl_release(flow);
+
+	mysql_close(origin_conn);
+	PQfinish(target_conn);
+	/* Closing the connection has aborted the INSERT reading the feed */
+	if (feed != NULL)
+		gpfdist_load_abort(feed);
+	ThreadExit(0);
+	return NULL;
+}
+
+/*
+ * Account the time a row batch took to fill, less the waits for a free
+ * batch, as time blocked on the source.  Bytes are counted as they are
+ * sent.  Then charge the batch to the rate limit, which may hold the
+ * reader back before it fetches more.
+ */
+static void
+batch_fetched(CopyPipeline *pipe, RowBatch *batch, TimevalStruct *mark)
+{
+	FlowMeter	meter;
+
+	if (flow != NULL)
+	{
+		memset(&meter, 0, sizeof(FlowMeter));
+		meter.rows = batch->nrows;
+		meter.fetch_msec = flowctl_lap(mark);
+		flowctl_report(flow, &meter);
+	}
+
+	ratelimit_consume(rate, pipe->rate_table, batch->nrows, batch->data.len);
+
+	/* The sleep is not time blocked on the source */
+	if (flow != NULL)
+		GETTIMEOFDAY(mark);
+}
+
+/*
+ * Reader for the text protocol: copy the rows of a mysql_use_result result
+ * into row batches.  Returns the number of rows read, or -1 on abort.
+ */
+static long
+fetch_rows_text(MYSQL_RES *my_res, int n_col, CopyPipeline *pipe)
+{
+	MYSQL_ROW	row;
+	RowBatch   *batch = NULL;
+	long		row_count = 0;
+	TimevalStruct mark;
+	int			i;
+
+	while ((row = mysql_fetch_row(my_res)) != NULL)
+	{
+		unsigned long *lengths;
+
+		if (batch == NULL)
+		{
+			/* NULL here means the encoder or sender gave up */
+			if ((batch = copy_pipeline_get_batch(pipe)) == NULL)
+				break;
+			GETTIMEOFDAY(&mark);
+		}
+
+		lengths = mysql_fetch_lengths(my_res);
+		for (i = 0; i < n_col; i++)
+		{
+			int32	len = row[i] != NULL ? (int32) lengths[i] : -1;
+
+			appendBinaryStringInfo(&batch->data, (char *) &len, sizeof(len));
+			if (len > 0)
+				appendBinaryStringInfo(&batch->data, row[i], len);
+			appendStringInfoChar(&batch->data, '\0');
+		}
+
+		batch->nrows++;
+		row_count++;
+
+		if (batch->data.len >= ROW_BATCH_SIZE)
+		{
+			batch_fetched(pipe, batch, &mark);
+			queue_push(&pipe->raw_full, batch);
+			batch = NULL;
+		}
+
+		if (time_to_abort)
+		{
+			fprintf(stderr, "receive shutdown sigint\n");
+			return -1;
+		}
+	}
+
+	if (batch != NULL && batch->nrows > 0)
+	{
+		batch_fetched(pipe, batch, &mark);
+		queue_push(&pipe->raw_full, batch);
+	}
+
+	return row_count;
+}
+
+/*
+ * Prepare and execute query as a server side prepared statement, reading
+ * its result through a read only cursor.
+ */
+static MYSQL_STMT *
+stmt_open(MYSQL *conn, const char *query)
+{
+	MYSQL_STMT *stmt;
+	unsigned long cursor_type = CURSOR_TYPE_READ_ONLY;
+	unsigned long prefetch_rows = STMT_PREFETCH_ROWS;
+
+	stmt = mysql_stmt_init(conn);
+	if (stmt == NULL)
+	{
+		fprintf(stderr, "init statement error: %s\n", mysql_error(conn));
+		return NULL;
+	}
+
+	if (mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursor_type) ||
+		mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch_rows) ||
+		mysql_stmt_prepare(stmt, query, strlen(query)) ||
+		mysql_stmt_execute(stmt))
+	{
+		fprintf(stderr, "run query error: %s\n", mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+
+	return stmt;
+}
+
+/*
+ * Bind a result buffer to every column of the statement.  Integers except
+ * unsigned bigint, floats and dates are fetched in native form, everything
+ * else as text into a buffer of at most STMT_PIECE_SIZE bytes.
+ */
+static StmtColumn *
+stmt_bind_columns(MYSQL_STMT *stmt, MYSQL_RES *meta, int n_col, MYSQL_BIND **p_binds, char **p_forms)
+{
+	MYSQL_FIELD *fields = mysql_fetch_fields(meta);
+	MYSQL_BIND *binds;
+	StmtColumn *cols;
+	char	   *forms;
+	int			i;
+
+	binds = palloc0(sizeof(MYSQL_BIND) * n_col);
+	cols = palloc0(sizeof(StmtColumn) * n_col);
+	forms = palloc0(n_col);
+
+	for (i = 0; i < n_col; i++)
+	{
+		MYSQL_BIND *bind = &binds[i];
+		StmtColumn *col = &cols[i];
+
+		switch (fields[i].type)
+		{
+			case MYSQL_TYPE_TINY:
+			case MYSQL_TYPE_SHORT:
+			case MYSQL_TYPE_INT24:
+			case MYSQL_TYPE_LONG:
+			case MYSQL_TYPE_LONGLONG:
+				if (fields[i].type == MYSQL_TYPE_LONGLONG && (fields[i].flags & UNSIGNED_FLAG))
+				{
+					col->form = CELL_TEXT;
+					break;
+				}
+				col->form = CELL_INT64;
+				bind->buffer_type = MYSQL_TYPE_LONGLONG;
+				bind->buffer = &col->value.i;
+				bind->is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+				break;
+
+			case MYSQL_TYPE_FLOAT:
+			case MYSQL_TYPE_DOUBLE:
+				col->form = CELL_DOUBLE;
+				bind->buffer_type = MYSQL_TYPE_DOUBLE;
+				bind->buffer = &col->value.d;
+				break;
+
+			case MYSQL_TYPE_TIMESTAMP:
+			case MYSQL_TYPE_DATE:
+			case MYSQL_TYPE_DATETIME:
+			case MYSQL_TYPE_NEWDATE:
+				col->form = CELL_TIME;
+				bind->buffer_type = MYSQL_TYPE_DATETIME;
+				bind->buffer = &col->value.t;
+				break;
+
+			default:
+				col->form = CELL_TEXT;
+				break;
+		}
+
+		if (col->form == CELL_TEXT)
+		{
+			col->buffer_length = Max(Min(fields[i].length, STMT_PIECE_SIZE), 64);
+			col->buffer = palloc(col->buffer_length);
+			bind->buffer_type = MYSQL_TYPE_STRING;
+			bind->buffer = col->buffer;
+			bind->buffer_length = col->buffer_length;
+		}
+
+		bind->length = &col->length;
+		bind->is_null = &col->is_null;
+		bind->error = &col->error;
+		forms[i] = col->form;
+	}
+
+	if (mysql_stmt_bind_result(stmt, binds))
+	{
+		fprintf(stderr, "bind result error: %s\n", mysql_stmt_error(stmt));
+		stmt_free_columns(cols, binds, forms, n_col);
+		return NULL;
+	}
+
+	*p_binds = binds;
+	*p_forms = forms;
+	return cols;
+}
+
+static void
+stmt_free_columns(StmtColumn *cols, MYSQL_BIND *binds, char *forms, int n_col)
+{
+	int		i;
+
+	for (i = 0; i < n_col; i++)
+	{
+		if (cols[i].buffer)
+			pfree(cols[i].buffer);
+	}
+
+	pfree(cols);
+	pfree(binds);
+	pfree(forms);
+}
+
+/*
+ * Append the current value of a statement column to a row batch.  Text
+ * longer than the bound buffer is fetched in pieces with
+ * mysql_stmt_fetch_column, straight into the batch.
+ */
+static bool
+stmt_append_cell(MYSQL_STMT *stmt, MYSQL_BIND *bind, StmtColumn *col, int colno, StringInfo buf)
+{
+	int32		len;
+	const char *data = NULL;
+
+	if (col->is_null)
+		len = -1;
+	else if (col->form == CELL_INT64)
+	{
+		len = sizeof(col->value.i);
+		data = (char *) &col->value.i;
+	}
+	else if (col->form == CELL_DOUBLE)
+	{
+		len = sizeof(col->value.d);
+		data = (char *) &col->value.d;
+	}
+	else if (col->form == CELL_TIME)
+	{
+		MYSQL_TIME *tm = &col->value.t;
+
+		/* zero dates are loaded as NULL */
+		if (tm->year == 0 && tm->month == 0 && tm->day == 0)
+			len = -1;
+		else
+		{
+			len = sizeof(MYSQL_TIME);
+			data = (char *) tm;
+		}
+	}
+	else
+	{
+		len = (int32) col->length;
+		data = col->buffer;
+	}
+
+	appendBinaryStringInfo(buf, (char *) &len, sizeof(len));
+
+	if (col->form == CELL_TEXT && len > 0)
+	{
+		unsigned long piece = Min(col->length, col->buffer_length);
+
+		appendBinaryStringInfo(buf, data, piece);
+		if (col->length > piece)
+		{
+			MYSQL_BIND	rest = *bind;
+			unsigned long rest_len = col->length - piece;
+			unsigned long fetched = 0;
+
+			enlargeStringInfo(buf, rest_len);
+			rest.buffer = buf->data + buf->len;
+			rest.buffer_length = rest_len;
+			rest.length = &fetched;
+			if (mysql_stmt_fetch_column(stmt, &rest, colno, piece))
+			{
+				fprintf(stderr, "fetch column %d error: %s\n", colno, mysql_stmt_error(stmt));
+				return false;
+			}
+			buf->len += rest_len;
+		}
+	}
+	else if (len > 0)
+		appendBinaryStringInfo(buf, data, len);
+
+	appendStringInfoChar(buf, '\0');
+
+	return true;
+}
+
+/*
+ * Reader for prepared statement mode, the counterpart of fetch_rows_text.
+ * Returns the number of rows read, or -1 on error or abort.
+ */
+static long
+fetch_rows_stmt(MYSQL_STMT *stmt, MYSQL_BIND *binds, StmtColumn *cols, int n_col, CopyPipeline *pipe)
+{
+	RowBatch   *batch = NULL;
+	long		row_count = 0;
+	TimevalStruct mark;
+	int			rc;
+	int			i;
+
+	while ((rc = mysql_stmt_fetch(stmt)) == 0 || rc == MYSQL_DATA_TRUNCATED)
+	{
+		if (batch == NULL)
+		{
+			/* NULL here means the encoder or sender gave up */
+			if ((batch = copy_pipeline_get_batch(pipe)) == NULL)
+				break;
+			GETTIMEOFDAY(&mark);
+		}
+
+		for (i = 0; i < n_col; i++)
+		{
+			if (!stmt_append_cell(stmt, &binds[i], &cols[i], i, &batch->data))
+				return -1;
+		}
+
+		batch->nrows++;
+		row_count++;
+
+		if (batch->data.len >= ROW_BATCH_SIZE)
+		{
+			batch_fetched(pipe, batch, &mark);
+			queue_push(&pipe->raw_full, batch);
+			batch = NULL;
+		}
+
+		if (time_to_abort)
+		{
+			fprintf(stderr, "receive shutdown sigint\n");
+			return -1;
+		}
+	}
+
+	if (rc == 1)
+	{
+		fprintf(stderr, "fetch rows error: %s\n", mysql_stmt_error(stmt));
+		return -1;
+	}
+
+	if (batch != NULL && batch->nrows > 0)
+	{
+		batch_fetched(pipe, batch, &mark);
+		queue_push(&pipe->raw_full, batch);
+	}
+
+	return row_count;
+}
+
+/*
+ * Set up the queues and buffers of a copy pipeline and start its encoder
+ * and sender threads.  The COPY, or the gpfdist load of feed, must already
+ * be in progress on conn.
+ */
+static void
+copy_pipeline_start(CopyPipeline *pipe, PGconn *conn, int n_col, Oid *column_oids, ColumnEncoder *encoders, char *forms, bool binary, BatchSizer *sizer, GpfdistFeed *feed)
+{
+	int		i;
+
+	pipe->conn = conn;
+	pipe->n_col = n_col;
+	pipe->column_oids = column_oids;
+	pipe->encoders = encoders;
+	pipe->forms = forms;
+	pipe->binary = binary;
+	pipe->sizer = sizer;
+	pipe->feed = feed;
+	pipe->batch_size = sizer ? sizer->size : buffer_size;
+	pipe->failed = false;
+
+	queue_init(&pipe->raw_full, PIPELINE_DEPTH);
+	queue_init(&pipe->raw_free, PIPELINE_DEPTH);
+	queue_init(&pipe->out_full, PIPELINE_DEPTH);
+	queue_init(&pipe->out_free, PIPELINE_DEPTH);
+
+	for (i = 0; i < PIPELINE_DEPTH; i++)
+	{
+		initStringInfo(&pipe->raw[i].data);
+		pipe->raw[i].nrows = 0;
+		queue_push(&pipe->raw_free, &pipe->raw[i]);
+
+		pipe->out[i] = createPQExpBuffer();
+		queue_push(&pipe->out_free, pipe->out[i]);
+	}
+
+	ThreadCreate(&pipe->encoder, copy_pipeline_encode, pipe);
+	ThreadCreate(&pipe->sender, copy_pipeline_send, pipe);
+}
+
+/*
+ * Called by the reader once all rows are queued, or after
+ * copy_pipeline_fail.  Waits for the encoder and sender to drain, releases
+ * the buffers and returns false if any stage failed.
+ */
+static bool
+copy_pipeline_finish(CopyPipeline *pipe)
+{
+	int		i;
+
+	queue_close(&pipe->raw_full);
+	WaitThreadEnd(1, &pipe->encoder);
+	WaitThreadEnd(1, &pipe->sender);
+
+	for (i = 0; i < PIPELINE_DEPTH; i++)
+	{
+		pfree(pipe->raw[i].data.data);
+		destroyPQExpBuffer(pipe->out[i]);
+	}
+
+	queue_destroy(&pipe->raw_full);
+	queue_destroy(&pipe->raw_free);
+	queue_destroy(&pipe->out_full);
+	queue_destroy(&pipe->out_free);
+
+	return !pipe->failed;
+}
+
+/*
+ * Take an empty row batch for the reader, NULL if the pipeline failed.
+ */
+static RowBatch *
+copy_pipeline_get_batch(CopyPipeline *pipe)
+{
+	RowBatch *batch = (RowBatch *) queue_pop(&pipe->raw_free);
+
+	if (batch != NULL)
+	{
+		resetStringInfo(&batch->data);
+		batch->nrows = 0;
+	}
+
+	return batch;
+}
+
+/*
+ * Stop all stages of the pipeline, every blocked push or pop returns.
+ */
+static void
+copy_pipeline_fail(CopyPipeline *pipe)
+{
+	pipe->failed = true;
+
+	queue_close(&pipe->raw_full);
+	queue_close(&pipe->raw_free);
+	queue_close(&pipe->out_full);
+	queue_close(&pipe->out_free);
+}
+
+/*
+ * Encoder stage: format fetched rows as COPY csv text, or as binary copy
+ * tuples when the pipeline is in binary mode.  A chunk is handed to the
+ * sender once it reaches the -b buffer size or the adaptive batch size.
+ */
+static void *
+copy_pipeline_encode(void *arg)
+{
+	CopyPipeline *pipe = (CopyPipeline *) arg;
+	RowBatch	*batch;
+	PQExpBuffer	out = NULL;
+	char		native[64];
+
+	while (!pipe->failed && (batch = (RowBatch *) queue_pop(&pipe->raw_full)) != NULL)
+	{
+		char	*p = batch->data.data;
+		int		r;
+		int		i;
+
+		for (r = 0; r < batch->nrows; r++)
+		{
+			if (out == NULL)
+			{
+				out = (PQExpBuffer) queue_pop(&pipe->out_free);
+				if (out == NULL)
+					goto exit;
+			}
+
+			if (pipe->binary)
+			{
+				uint16	n16 = htons((uint16) pipe->n_col);
+
+				appendBinaryPQExpBuffer(out, (char *) &n16, sizeof(n16));
+			}
+
+			for (i = 0; i < pipe->n_col; i++)
+			{
+				int32	len;
+				const char *value;
+				char	form = pipe->forms ? pipe->forms[i] : CELL_TEXT;
+
+				memcpy(&len, p, sizeof(len));
+				value = p + sizeof(len);
+				p = (char *) value + (len > 0 ? len : 0) + 1;
+
+				if (pipe->binary)
+				{
+					bool	ok;
+
+					if (form != CELL_TEXT && len > 0)
+						ok = append_binary_native(out, form, value, pipe->column_oids[i]);
+					else
+						ok = append_binary_value(out, value, len, pipe->column_oids[i]);
+
+					if (!ok)
+					{
+						copy_pipeline_fail(pipe);
+						goto exit;
+					}
+					continue;
+				}
+
+				if (i != 0)
+				{
+					appendPQExpBufferChar(out, '|');
+				}
+
+				/* value of the field is NULL if it is fact NULL */
+				if (len > 0)
+				{
+					if (form != CELL_TEXT)
+					{
+						value = native_value_to_text(form, value, pipe->column_oids[i], native, sizeof(native));
+						len = strlen(value);
+					}
+					pipe->encoders[i](out, value, len);
+				}
+			}
+
+			if (!pipe->binary)
+				appendPQExpBufferChar(out, '\n');
+
+			if (out->len >= pipe->batch_size)
+			{
+				queue_push(&pipe->out_full, out);
+				out = NULL;
+			}
+		}
+
+		queue_push(&pipe->raw_free, batch);
+	}
+
+	if (out != NULL && out->len > 0)
+		queue_push(&pipe->out_full, out);
+
+exit:
+	queue_close(&pipe->out_full);
+	ThreadExit(0);
+	return NULL;
+}
+
+/*
+ * Sender stage: write encoded chunks to the target COPY, and feed how long
+ * each write took back into the adaptive batch size.
+ */
+static void *
+copy_pipeline_send(void *arg)
+{
+	CopyPipeline *pipe = (CopyPipeline *) arg;
+	PQExpBuffer	out;
+	TimevalStruct before,
+					after;
+	double		elapsed_msec = 0;
+
+	while ((out = (PQExpBuffer) queue_pop(&pipe->out_full)) != NULL)
+	{
+		GETTIMEOFDAY(&before);
+		if (!pipe->failed && pipe->feed != NULL)
+		{
+			if (!gpfdist_load_send(pipe->feed, pipe->conn, out->data, out->len))
+				copy_pipeline_fail(pipe);
+		}
+		else if (!pipe->failed &&
+			PQputCopyData(pipe->conn, out->data, out->len) != 1)
+		{
+			fprintf(stderr,"writing to target table failed destination connection reported: %s",
+					 PQerrorMessage(pipe->conn));
+			copy_pipeline_fail(pipe);
+		}
+
+		if ((pipe->sizer != NULL || flow != NULL) && !pipe->failed)
+		{
+			GETTIMEOFDAY(&after);
+			DIFF_MSEC(&after, &before, elapsed_msec);
+		}
+
+		if (pipe->sizer != NULL && !pipe->failed)
+		{
+			batch_sizer_observe(pipe->sizer, out->len, elapsed_msec);
+			pipe->batch_size = pipe->sizer->size;
+		}
+
+		if (flow != NULL && !pipe->failed)
+		{
+			FlowMeter	meter;
+
+			memset(&meter, 0, sizeof(FlowMeter));
+			meter.bytes = out->len;
+			meter.send_msec = elapsed_msec;
+			flowctl_report(flow, &meter);
+		}
+
+		/* Reset buffer for next use */
+		resetPQExpBuffer(out);
+		queue_push(&pipe->out_free, out);
+	}
+
+	ThreadExit(0);
+	return NULL;
+}
+
+static ColumnEncoder
+csv_encoder_for_type(Oid type)
+{
+	switch (type)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			return encode_csv_plain;
+		case TIMESTAMPOID:
+			return encode_csv_timestamp;
+		default:
+			return encode_csv_text;
+	}
+}
+
+/* Numbers never need quoting */
+static void
+encode_csv_plain(PQExpBuffer buffer, const char *value, int len)
+{
+	appendBinaryPQExpBuffer(buffer, value, len);
+}
+
+/* Mysql zero dates and times are loaded as NULL */
+static void
+encode_csv_timestamp(PQExpBuffer buffer, const char *value, int len)
+{
+	switch (len)
+	{
+		case 4:
+			if (memcmp(value, "0000", 4) == 0)
+				return;
+			break;
+		case 8:
+			if (memcmp(value, "00:00:00", 8) == 0)
+				return;
+			break;
+		case 10:
+			if (memcmp(value, "0000-00-00", 10) == 0)
+				return;
+			break;
+		case 19:
+			if (memcmp(value, "0000-00-00 00:00:00", 19) == 0)
+				return;
+			break;
+	}
+
+	appendBinaryPQExpBuffer(buffer, value, len);
+}
+
+/*
+ * Quote a text value straight into the output buffer.  A value is cut at an
+ * embedded NUL byte, which copy data cannot carry.
+ */
+static void
+encode_csv_text(PQExpBuffer buffer, const char *value, int len)
+{
+	const char *nul = memchr(value, '\0', len);
+
+	if (nul != NULL)
+		len = nul - value;
+
+	append_quoted_csv(buffer, value, len);
+}
+
+/*
+ * Binary copy input is checked strictly against the column types, so it is
+ * only used when every column of the target table has the type the data is
+ * encoded as (text may also go to varchar or char).  Mysql TIME and YEAR
+ * values are not timestamps, tables having them are always copied as csv.
+ */
+static bool
+binary_copy_supported(PGconn *conn, char *schemaname, char *relname, MYSQL_RES *my_res, Oid *column_oids, int n_col)
+{
+	MYSQL_FIELD *fields;
+	PQExpBuffer	sql;
+	PGresult   *res;
+	char	   *rel_literal;
+	char	   *nsp_literal = NULL;
+	bool		ok = true;
+	int			i;
+
+	fields = mysql_fetch_fields(my_res);
+	for (i = 0; i < n_col; i++)
+	{
+		if (fields[i].type == MYSQL_TYPE_TIME || fields[i].type == MYSQL_TYPE_YEAR)
+			return false;
+	}
+
+	sql = createPQExpBuffer();
+	rel_literal = PQescapeLiteral(conn, relname, strlen(relname));
+	if (schemaname)
+	{
+		PQExpBuffer	cond = createPQExpBuffer();
+
+		nsp_literal = PQescapeLiteral(conn, schemaname, strlen(schemaname));
+		appendPQExpBuffer(cond, "n.nspname = %s", nsp_literal);
+		appendPQExpBuffer(sql, STMT_TARGET_COLUMN_TYPES, rel_literal, cond->data);
+		destroyPQExpBuffer(cond);
+	}
+	else
+		appendPQExpBuffer(sql, STMT_TARGET_COLUMN_TYPES, rel_literal,
+						  "pg_catalog.pg_table_is_visible(c.oid)");
+
+	res = PQexec(conn, sql->data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "get target column types of table %s failed: %s",
+				relname, PQerrorMessage(conn));
+		ok = false;
+	}
+	else if (PQntuples(res) != n_col)
+		ok = false;
+
+	for (i = 0; ok && i < n_col; i++)
+	{
+		Oid		typid = (Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10);
+
+		if (typid == column_oids[i])
+			continue;
+		if (column_oids[i] == TEXTOID && (typid == VARCHAROID || typid == BPCHAROID))
+			continue;
+
+		ok = false;
+	}
+
+	if (!ok)
+		fprintf(stderr, "column types of target table %s do not allow binary copy, copy data as csv\n", relname);
+
+	PQclear(res);
+	PQfreemem(rel_literal);
+	if (nsp_literal)
+		PQfreemem(nsp_literal);
+	destroyPQExpBuffer(sql);
+
+	return ok;
+}
+
+static void
+append_binary_int16(PQExpBuffer buffer, int16 value)
+{
+	uint16	n16 = htons((uint16) value);
+
+	appendBinaryPQExpBuffer(buffer, (char *) &n16, sizeof(n16));
+}
+
+static void
+append_binary_int32(PQExpBuffer buffer, int32 value)
+{
+	uint32	n32 = htonl((uint32) value);
+
+	appendBinaryPQExpBuffer(buffer, (char *) &n32, sizeof(n32));
+}
+
+static void
+append_binary_int64(PQExpBuffer buffer, int64 value)
+{
+	append_binary_int32(buffer, (int32) ((uint64) value >> 32));
+	append_binary_int32(buffer, (int32) value);
+}
+
+/* Append an integer field, false if it is out of range of the column type */
+static bool
+append_binary_integer(PQExpBuffer buffer, int64 ival, Oid type)
+{
+	if (type == INT2OID)
+	{
+		if (ival < PG_INT16_MIN || ival > PG_INT16_MAX)
+			return false;
+		append_binary_int32(buffer, 2);
+		append_binary_int16(buffer, (int16) ival);
+	}
+	else if (type == INT4OID)
+	{
+		if (ival < PG_INT32_MIN || ival > PG_INT32_MAX)
+			return false;
+		append_binary_int32(buffer, 4);
+		append_binary_int32(buffer, (int32) ival);
+	}
+	else
+	{
+		append_binary_int32(buffer, 8);
+		append_binary_int64(buffer, ival);
+	}
+
+	return true;
+}
+
+static void
+append_binary_float(PQExpBuffer buffer, double fval, Oid type)
+{
+	if (type == FLOAT4OID)
+	{
+		union
+		{
+			float4	f;
+			int32	i;
+		}			swap;
+
+		swap.f = (float4) fval;
+		append_binary_int32(buffer, 4);
+		append_binary_int32(buffer, swap.i);
+	}
+	else
+	{
+		union
+		{
+			float8	f;
+			int64	i;
+		}			swap;
+
+		swap.f = fval;
+		append_binary_int32(buffer, 8);
+		append_binary_int64(buffer, swap.i);
+	}
+}
+
+/*
+ * Append one field of a binary copy tuple: the length word followed by the
+ * value in the type's send format.  len is -1 for NULL.  As in the csv path,
+ * empty non-text values and zero dates are sent as NULL.
+ */
+static bool
+append_binary_value(PQExpBuffer buffer, const char *rawstr, int32 len, Oid type)
+{
+	char	   *end;
+	int64		ival;
+	double		fval;
+
+	if (len < 0 || (len == 0 && type != TEXTOID))
+	{
+		append_binary_int32(buffer, -1);
+		return true;
+	}
+
+	switch (type)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			errno = 0;
+			ival = strtoll(rawstr, &end, 10);
+			if (errno != 0 || *end != '\0' ||
+				!append_binary_integer(buffer, ival, type))
+				break;
+			return true;
+
+		case FLOAT4OID:
+		case FLOAT8OID:
+			fval = strtod(rawstr, &end);
+			if (*end != '\0')
+				break;
+
+			append_binary_float(buffer, fval, type);
+			return true;
+
+		case NUMERICOID:
+			if (!append_binary_numeric(buffer, rawstr))
+				break;
+			return true;
+
+		case TIMESTAMPOID:
+			if (!append_binary_timestamp(buffer, rawstr))
+				break;
+			return true;
+
+		default:
+			append_binary_int32(buffer, len);
+			appendBinaryPQExpBuffer(buffer, rawstr, len);
+			return true;
+	}
+
+	fprintf(stderr, "invalid value \"%s\" for binary copy of type %u\n", rawstr, type);
+	return false;
+}
+
+/*
+ * Mysql decimals come as plain [-]digits[.digits], convert them to the
+ * base 10000 digits of numeric's send format.
+ */
+static bool
+append_binary_numeric(PQExpBuffer buffer, const char *rawstr)
+{
+	const char *p = rawstr;
+	const char *int_part;
+	const char *frac_part = NULL;
+	int			int_len;
+	int			frac_len = 0;
+	int			lead;
+	int			total;
+	int			ndigits;
+	int			first;
+	int16		weight;
+	int16		sign = 0;
+	char	   *dec;
+	int16	   *digits;
+	int			i;
+
+	if (*p == '-')
+	{
+		sign = 0x4000;
+		p++;
+	}
+	else if (*p == '+')
+		p++;
+
+	int_part = p;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	int_len = p - int_part;
+
+	if (*p == '.')
+	{
+		frac_part = ++p;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		frac_len = p - frac_part;
+	}
+
+	if (*p != '\0' || int_len + frac_len == 0)
+		return false;
+
+	while (int_len > 0 && *int_part == '0')
+	{
+		int_part++;
+		int_len--;
+	}
+
+	/* pad with zeros so the decimal point falls on a base 10000 digit boundary */
+	lead = (4 - int_len % 4) % 4;
+	total = lead + int_len + frac_len;
+	total += (4 - total % 4) % 4;
+
+	dec = palloc(total + 1);
+	memset(dec, '0', total);
+	memcpy(dec + lead, int_part, int_len);
+	if (frac_len > 0)
+		memcpy(dec + lead + int_len, frac_part, frac_len);
+
+	ndigits = total / 4;
+	weight = (lead + int_len) / 4 - 1;
+	digits = palloc(sizeof(int16) * (ndigits + 1));
+	for (i = 0; i < ndigits; i++)
+	{
+		char	*d = dec + i * 4;
+
+		digits[i] = (d[0] - '0') * 1000 + (d[1] - '0') * 100 + (d[2] - '0') * 10 + (d[3] - '0');
+	}
+
+	/* strip leading and trailing zero digits */
+	first = 0;
+	while (first < ndigits && digits[first] == 0)
+	{
+		first++;
+		weight--;
+	}
+	while (ndigits > first && digits[ndigits - 1] == 0)
+		ndigits--;
+	ndigits -= first;
+
+	if (ndigits == 0)
+	{
+		weight = 0;
+		sign = 0;
+	}
+
+	append_binary_int32(buffer, (4 + ndigits) * sizeof(int16));
+	append_binary_int16(buffer, ndigits);
+	append_binary_int16(buffer, weight);
+	append_binary_int16(buffer, sign);
+	append_binary_int16(buffer, frac_len);
+	for (i = 0; i < ndigits; i++)
+		append_binary_int16(buffer, digits[first + i]);
+
+	pfree(dec);
+	pfree(digits);
+
+	return true;
+}
+
+/* Julian day number of a gregorian date, as date2j() in the server */
+static int
+date2j_local(int y, int m, int d)
+{
+	int			julian;
+	int			century;
+
+	if (m > 2)
+	{
+		m += 1;
+		y += 4800;
+	}
+	else
+	{
+		m += 13;
+		y += 4799;
+	}
+
+	century = y / 100;
+	julian = y * 365 - 32167;
+	julian += y / 4 - century + century / 4;
+	julian += 7834 * m / 256 + d;
+
+	return julian;
+}
+
+/* Microseconds since 2000-01-01 of a date and time */
+static int64
+timestamp_from_parts(int year, int mon, int mday, int hour, int min, int sec, int64 usec)
+{
+	int64		result;
+
+	result = (int64) (date2j_local(year, mon, mday) - PG_EPOCH_JDATE) * 86400;
+	result = (result + hour * 3600 + min * 60 + sec) * 1000000 + usec;
+
+	return result;
+}
+
+/*
+ * Mysql dates and datetimes come as YYYY-MM-DD[ HH:MM:SS[.ffffff]], convert
+ * them to microseconds since 2000-01-01.  Zero dates are sent as NULL.
+ */
+static bool
+append_binary_timestamp(PQExpBuffer buffer, const char *rawstr)
+{
+	int			year;
+	int			mon;
+	int			mday;
+	int			hour = 0;
+	int			min = 0;
+	int			sec = 0;
+	int64		usec = 0;
+	int			n = 0;
+	const char *p;
+
+	if (sscanf(rawstr, "%4d-%2d-%2d%n", &year, &mon, &mday, &n) != 3)
+		return false;
+	p = rawstr + n;
+
+	if (year == 0 && mon == 0 && mday == 0)
+	{
+		append_binary_int32(buffer, -1);
+		return true;
+	}
+
+	if (*p == ' ')
+	{
+		if (sscanf(p, " %2d:%2d:%2d%n", &hour, &min, &sec, &n) != 3)
+			return false;
+		p += n;
+
+		if (*p == '.')
+		{
+			int		ndigit = 0;
+
+			for (p++; *p >= '0' && *p <= '9'; p++)
+			{
+				if (ndigit < 6)
+				{
+					usec = usec * 10 + (*p - '0');
+					ndigit++;
+				}
+			}
+			for (; ndigit < 6; ndigit++)
+				usec *= 10;
+		}
+	}
+
+	if (*p != '\0' || mon < 1 || mon > 12 || mday < 1 || mday > 31 ||
+		hour > 23 || min > 59 || sec > 60)
+		return false;
+
+	append_binary_int32(buffer, 8);
+	append_binary_int64(buffer, timestamp_from_parts(year, mon, mday, hour, min, sec, usec));
+
+	return true;
+}
+
+/*
+ * Append a native value fetched through a prepared statement.  Zero dates
+ * were already stored as NULL by the reader.
+ */
+static bool
+append_binary_native(PQExpBuffer buffer, char form, const char *cell, Oid type)
+{
+	int64		ival;
+	double		fval;
+	MYSQL_TIME	tm;
+
+	switch (form)
+	{
+		case CELL_INT64:
+			memcpy(&ival, cell, sizeof(ival));
+			if (!append_binary_integer(buffer, ival, type))
+			{
+				fprintf(stderr, "invalid value " INT64_FORMAT " for binary copy of type %u\n", ival, type);
+				return false;
+			}
+			return true;
+
+		case CELL_DOUBLE:
+			memcpy(&fval, cell, sizeof(fval));
+			append_binary_float(buffer, fval, type);
+			return true;
+
+		case CELL_TIME:
+			memcpy(&tm, cell, sizeof(tm));
+
+			/* Partly zero dates, as the text path rejects them */
+			if (tm.month < 1 || tm.month > 12 || tm.day < 1 || tm.day > 31 ||
+				tm.hour > 23 || tm.minute > 59 || tm.second > 60 || tm.second_part > 999999)
+			{
+				fprintf(stderr, "invalid value %04u-%02u-%02u %02u:%02u:%02u for binary copy of type %u\n",
+						tm.year, tm.month, tm.day, tm.hour, tm.minute, tm.second, type);
+				return false;
+			}
+			append_binary_int32(buffer, 8);
+			append_binary_int64(buffer, timestamp_from_parts(tm.year, tm.month, tm.day,
+															 tm.hour, tm.minute, tm.second,
+															 tm.second_part));
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Render a native value as text for the csv path, in buf.
+ */
+static const char *
+native_value_to_text(char form, const char *cell, Oid type, char *buf, size_t size)
+{
+	int64		ival;
+	double		fval;
+	MYSQL_TIME	tm;
+
+	switch (form)
+	{
+		case CELL_INT64:
+			memcpy(&ival, cell, sizeof(ival));
+			snprintf(buf, size, INT64_FORMAT, ival);
+			break;
+
+		case CELL_DOUBLE:
+			memcpy(&fval, cell, sizeof(fval));
+			if (type == FLOAT4OID)
+				snprintf(buf, size, "%.9g", (float4) fval);
+			else
+				snprintf(buf, size, "%.17g", fval);
+			break;
+
+		case CELL_TIME:
+			memcpy(&tm, cell, sizeof(tm));
+			if (tm.second_part > 0)
+				snprintf(buf, size, "%04u-%02u-%02u %02u:%02u:%02u.%06lu",
+						 tm.year, tm.month, tm.day, tm.hour, tm.minute, tm.second, tm.second_part);
+			else
+				snprintf(buf, size, "%04u-%02u-%02u %02u:%02u:%02u",
+						 tm.year, tm.month, tm.day, tm.hour, tm.minute, tm.second);
+			break;
+
+		default:
+			buf[0] = '\0';
+	}
 
-	return;
+	return buf;
 }
 
 static int
@@ -22,6 +22,7 @@
 #include "libpq/pqformat.h"
 #include "pg_logicaldecode.h"
 #include "pqexpbuffer.h"
+#include "sendrecv.h"
 
 #include <time.h>
 
@@ -32,9 +33,75 @@ static bool process_remote_commit(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
 static bool process_remote_insert(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
 static bool process_remote_update(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
 static bool process_remote_delete(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
-static bool read_tuple_parts(StringInfo s, Decode_TupleData *tup);
+static bool process_remote_relation(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
+static bool read_relation(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
+static bool read_tuple_parts(StringInfo s, ALI_PG_DECODE_MESSAGE *msg, Decode_TupleData *tup);
 static bool process_read_colunm_info(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
+static void *decode_arena_alloc(DecodeArena *arena, Size size);
+static DecodeRelation *relcache_lookup(DecodeRelCache *relcache, uint32 relid);
+static void relcache_insert(DecodeRelCache *relcache, DecodeRelation *rel);
+static void set_relation(ALI_PG_DECODE_MESSAGE *msg, DecodeRelation *rel);
 
+/* first size of the arena block */
+#define DECODE_ARENA_SIZE	8192
+
+/*
+ * Clear the message and its arena for the next message.  What the previous
+ * message spilled is added to the block now that nothing points into it.
+ */
+void
+decode_message_reset(ALI_PG_DECODE_MESSAGE *msg, DecodeArena *arena)
+{
+	while (arena->spills != NULL)
+	{
+		DecodeArenaSpill *next = arena->spills->next;
+
+		pfree(arena->spills);
+		arena->spills = next;
+	}
+
+	if (arena->block == NULL || arena->spilled > 0)
+	{
+		Size		size = Max(DECODE_ARENA_SIZE, arena->size + arena->spilled);
+
+		if (arena->block != NULL)
+			pfree(arena->block);
+		arena->block = palloc(size);
+		arena->size = size;
+	}
+	arena->used = 0;
+	arena->spilled = 0;
+
+	memset(msg, 0, sizeof(ALI_PG_DECODE_MESSAGE));
+	msg->arena = arena;
+}
+
+/* Zeroed memory that lasts until the next message */
+static void *
+decode_arena_alloc(DecodeArena *arena, Size size)
+{
+	char	   *p;
+
+	size = MAXALIGN(size);
+	if (arena->used + size <= arena->size)
+	{
+		p = arena->block + arena->used;
+		arena->used += size;
+	}
+	else
+	{
+		DecodeArenaSpill *spill;
+
+		spill = (DecodeArenaSpill *) palloc(MAXALIGN(sizeof(DecodeArenaSpill)) + size);
+		spill->next = arena->spills;
+		arena->spills = spill;
+		arena->spilled += size;
+		p = (char *) spill + MAXALIGN(sizeof(DecodeArenaSpill));
+	}
+
+	memset(p, 0, size);
+	return p;
+}
 
 
 /*
@@ -70,6 +137,10 @@ bdr_process_remote_action(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 		case 'D':
 			rc = process_remote_delete(s,msg);
 			break;
+			/* RELATION */
+		case 'R':
+			rc = process_remote_relation(s,msg);
+			break;
 		default:
 		{
 			fprintf(stderr, "unknown action of type %c", action);
@@ -77,7 +148,7 @@ bdr_process_remote_action(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 		}
 	}
 
-	return true;
+	return rc;
 }
 
 static bool
@@ -144,21 +215,11 @@ static bool
 process_remote_insert(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 {
 	char		action;
-	int			relnamelen;
-	int			nspnamelen;
-	char	*schemaname;
-	char	*relname;
 
 	msg->type = MSGKIND_INSERT;
 
-	nspnamelen = pq_getmsgint(s, 2);
-	schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
-
-	relnamelen = pq_getmsgint(s, 2);
-	relname = (char *) pq_getmsgbytes(s, relnamelen);
-
-	msg->relname = relname;
-	msg->schemaname = schemaname;
+	if (!read_relation(s, msg))
+		return false;
 
 	action = pq_getmsgbyte(s);
 	if (action != 'N' && action != 'C')
@@ -181,7 +242,7 @@ process_remote_insert(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 		return false;
 	}
 
-	return read_tuple_parts(s, &msg->newtuple);
+	return read_tuple_parts(s, msg, &msg->newtuple);
 }
 
 static bool
@@ -189,21 +250,11 @@ process_remote_update(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 {
 	char		action;
 	bool		pkey_sent;
-	int			relnamelen;
-	int			nspnamelen;
-	char	*schemaname;
-	char	*relname;
 	
 	msg->type = MSGKIND_UPDATE;
 
-	nspnamelen = pq_getmsgint(s, 2);
-	schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
-
-	relnamelen = pq_getmsgint(s, 2);
-	relname = (char *) pq_getmsgbytes(s, relnamelen);
-
-	msg->relname = relname;
-	msg->schemaname = schemaname;
+	if (!read_relation(s, msg))
+		return false;
 
 	action = pq_getmsgbyte(s);
 
@@ -232,7 +283,8 @@ process_remote_update(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 	{
 		pkey_sent = true;
 		msg->has_key_or_old = true;
-		read_tuple_parts(s, &msg->oldtuple);
+		if (!read_tuple_parts(s, msg, &msg->oldtuple))
+			return false;
 		action = pq_getmsgbyte(s);
 	}
 	else
@@ -247,7 +299,7 @@ process_remote_update(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 	}
 
 	/* read new tuple */
-	return read_tuple_parts(s, &msg->newtuple);
+	return read_tuple_parts(s, msg, &msg->newtuple);
 }
 
 static bool
@@ -260,6 +312,8 @@ process_read_colunm_info(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 	natt = pq_getmsgint(s, 2);
 
 	msg->natt = natt;
+	msg->attname = (char **) decode_arena_alloc(msg->arena, sizeof(char *) * natt);
+	msg->atttype = (char **) decode_arena_alloc(msg->arena, sizeof(char *) * natt);
 	for (i = 0; i < natt; i++)
 	{
 		char *tmp;
@@ -299,6 +353,7 @@ process_read_colunm_info(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 	natt = pq_getmsgint(s, 2);
 
 	msg->k_natt = natt;
+	msg->k_attname = (char **) decode_arena_alloc(msg->arena, sizeof(char *) * natt);
 	for (i = 0; i < natt; i++)
 	{
 		char	*tmp;
@@ -318,21 +373,11 @@ static bool
 process_remote_delete(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 {
 	char		action;
-	int			relnamelen;
-	int			nspnamelen;
-	char	*schemaname;
-	char	*relname;
 
 	msg->type = MSGKIND_DELETE; 
 
-	nspnamelen = pq_getmsgint(s, 2);
-	schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
-
-	relnamelen = pq_getmsgint(s, 2);
-	relname = (char *) pq_getmsgbytes(s, relnamelen);
-
-	msg->relname = relname;
-	msg->schemaname = schemaname;
+	if (!read_relation(s, msg))
+		return false;
 
 	action = pq_getmsgbyte(s);
 
@@ -361,12 +406,199 @@ process_remote_delete(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
 	}
 	
 	msg->has_key_or_old = true;
-	return read_tuple_parts(s, &msg->oldtuple);
+	return read_tuple_parts(s, msg, &msg->oldtuple);
 
 }
 
+/*
+ * Read the relation of a row message: the schema and table names, or with
+ * the relation cache the id of a relation described before.
+ */
 static bool
-read_tuple_parts(StringInfo s, Decode_TupleData *tup)
+read_relation(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	int			nspnamelen;
+	int			relnamelen;
+
+	if (msg->relcache != NULL)
+	{
+		uint32		relid = pq_getmsgint(s, 4);
+		DecodeRelation *rel = relcache_lookup(msg->relcache, relid);
+
+		if (rel == NULL)
+		{
+			fprintf(stderr, "change of relation %u which was not described\n", relid);
+			return false;
+		}
+
+		set_relation(msg, rel);
+		return true;
+	}
+
+	nspnamelen = pq_getmsgint(s, 2);
+	msg->schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
+
+	relnamelen = pq_getmsgint(s, 2);
+	msg->relname = (char *) pq_getmsgbytes(s, relnamelen);
+
+	return true;
+}
+
+static DecodeRelation *
+relcache_lookup(DecodeRelCache *relcache, uint32 relid)
+{
+	DecodeRelation *rel;
+
+	for (rel = relcache->buckets[relid % DECODE_RELCACHE_BUCKETS]; rel != NULL; rel = rel->next)
+	{
+		if (rel->relid == relid)
+			break;
+	}
+
+	return rel;
+}
+
+static void
+set_relation(ALI_PG_DECODE_MESSAGE *msg, DecodeRelation *rel)
+{
+	msg->schemaname = rel->schemaname;
+	msg->relname = rel->relname;
+	msg->natt = rel->natt;
+	msg->attname = rel->attname;
+	msg->atttype = rel->atttype;
+	msg->k_natt = rel->k_natt;
+	msg->k_attname = rel->k_attname;
+}
+
+static char **
+copy_names(char **names, int n)
+{
+	char	  **copy = (char **) palloc0(sizeof(char *) * Max(n, 1));
+	int			i;
+
+	for (i = 0; i < n; i++)
+		copy[i] = names[i] ? pstrdup(names[i]) : NULL;
+
+	return copy;
+}
+
+static void
+free_names(char **names, int n)
+{
+	int			i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (names[i] != NULL)
+			pfree(names[i]);
+	}
+	pfree(names);
+}
+
+static void
+free_relation(DecodeRelation *rel)
+{
+	pfree(rel->schemaname);
+	pfree(rel->relname);
+	free_names(rel->attname, rel->natt);
+	free_names(rel->atttype, rel->natt);
+	free_names(rel->k_attname, rel->k_natt);
+	pfree(rel);
+}
+
+/*
+ * A relation description: id, schema and table names, and the column info
+ * as after 'C'.  It is kept until the stream is started again, the message
+ * itself is of type MSGKIND_RELATION and carries no change.
+ */
+static bool
+process_remote_relation(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	DecodeRelation *rel;
+	uint32		relid;
+	int			len;
+
+	msg->type = MSGKIND_RELATION;
+
+	if (msg->relcache == NULL)
+	{
+		fprintf(stderr, "got a relation description without relation_cache\n");
+		return false;
+	}
+
+	relid = pq_getmsgint(s, 4);
+	len = pq_getmsgint(s, 2);
+	msg->schemaname = (char *) pq_getmsgbytes(s, len);
+	len = pq_getmsgint(s, 2);
+	msg->relname = (char *) pq_getmsgbytes(s, len);
+	if (!process_read_colunm_info(s, msg))
+		return false;
+
+	rel = (DecodeRelation *) palloc0(sizeof(DecodeRelation));
+	rel->relid = relid;
+	rel->schemaname = pstrdup(msg->schemaname);
+	rel->relname = pstrdup(msg->relname);
+	rel->natt = msg->natt;
+	rel->attname = copy_names(msg->attname, msg->natt);
+	rel->atttype = copy_names(msg->atttype, msg->natt);
+	rel->k_natt = msg->k_natt;
+	rel->k_attname = copy_names(msg->k_attname, msg->k_natt);
+	relcache_insert(msg->relcache, rel);
+
+	return true;
+}
+
+/* Add a relation to the cache, in place of an older description */
+static void
+relcache_insert(DecodeRelCache *relcache, DecodeRelation *rel)
+{
+	DecodeRelation **link;
+
+	/* A schema change describes the relation again */
+	for (link = &relcache->buckets[rel->relid % DECODE_RELCACHE_BUCKETS]; *link != NULL; link = &(*link)->next)
+	{
+		if ((*link)->relid == rel->relid)
+		{
+			DecodeRelation *old = *link;
+
+			*link = old->next;
+			free_relation(old);
+			break;
+		}
+	}
+	rel->next = relcache->buckets[rel->relid % DECODE_RELCACHE_BUCKETS];
+	relcache->buckets[rel->relid % DECODE_RELCACHE_BUCKETS] = rel;
+}
+
+/* Forget all relations, the plugin describes them again on a new stream */
+void
+decode_relcache_reset(DecodeRelCache *relcache)
+{
+	int			i;
+
+	for (i = 0; i < DECODE_RELCACHE_BUCKETS; i++)
+	{
+		while (relcache->buckets[i] != NULL)
+		{
+			DecodeRelation *next = relcache->buckets[i]->next;
+
+			free_relation(relcache->buckets[i]);
+			relcache->buckets[i] = next;
+		}
+	}
+
+	while (relcache->types != NULL)
+	{
+		DecodeType *next = relcache->types->next;
+
+		pfree(relcache->types->name);
+		pfree(relcache->types);
+		relcache->types = next;
+	}
+}
+
+static bool
+read_tuple_parts(StringInfo s, ALI_PG_DECODE_MESSAGE *msg, Decode_TupleData *tup)
 {
 	int			i;
 	int			rnatts;
@@ -380,78 +612,434 @@ read_tuple_parts(StringInfo s, Decode_TupleData *tup)
 		return false;
 	}
 
-	memset(tup->isnull, 1, sizeof(tup->isnull));
-	memset(tup->changed, 1, sizeof(tup->changed));
-
 	rnatts = pq_getmsgint(s, 4);
 
 	tup->natt = rnatts;
+	tup->nulls = (bits8 *) decode_arena_alloc(msg->arena, DECODE_BITMAPLEN(rnatts));
+	tup->unchanged = (bits8 *) decode_arena_alloc(msg->arena, DECODE_BITMAPLEN(rnatts));
+	tup->svalues = (char **) decode_arena_alloc(msg->arena, sizeof(char *) * rnatts);
+	tup->lengths = (int *) decode_arena_alloc(msg->arena, sizeof(int) * rnatts);
+	tup->formats = (char *) decode_arena_alloc(msg->arena, rnatts);
 	
 	/* FIXME: unaligned data accesses */
 	for (i = 0; i < rnatts; i++)
 	{
 		char		kind = pq_getmsgbyte(s);
-		//const char *data;
 		int			len;
 
 		switch (kind)
 		{
 			case 'n':
-				tup->svalues[i] = NULL;
+				tup->nulls[i / 8] |= 1 << (i % 8);
 				break;
 			case 'u':
-				tup->isnull[i] = true;
-				tup->changed[i] = false;
-				tup->svalues[i] = NULL; 
-
+				tup->nulls[i / 8] |= 1 << (i % 8);
+				tup->unchanged[i / 8] |= 1 << (i % 8);
 				break;
-/*
 			case 'b':
-				tup->isnull[i] = false;
+			case 's':
 				len = pq_getmsgint(s, 4);
 
-				data = pq_getmsgbytes(s, len);
+				tup->svalues[i] = (char *) pq_getmsgbytes(s, len);
+				tup->lengths[i] = len;
+				tup->formats[i] = kind;
+				if (!binary_value_valid(DECODE_ATTTYPE(msg, i), kind, tup->svalues[i], len))
+				{
+					fprintf(stderr, "can not read binary value '%c' of column %d, type %s\n",
+							kind, i, DECODE_ATTTYPE(msg, i) ? DECODE_ATTTYPE(msg, i) : "unknown");
+					return false;
+				}
+				break;
+			case 't':
+				len = pq_getmsgint(s, 4);
 
-				tup->svalues[i] = palloc0(len + 1);
-				memcpy(tup->svalues[i], data, len);
-				
+				tup->svalues[i] = (char *) pq_getmsgbytes(s, len);
+				tup->lengths[i] = len;
+				tup->formats[i] = kind;
 				break;
-			case 's':
-				{
-					StringInfoData buf;
+			default:
+			{
+				fprintf(stderr, "unknown column type '%c'", kind);
+				return false;
+			}
+		}
+
+	}
 
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4);
+	return true;
+}
 
-					initStringInfo(&buf);
-					buf.data = (char *) pq_getmsgbytes(s, len);
-					buf.len = len;
-					
-					tup->svalues[i] = palloc0(len + 1);
-					memcpy(tup->svalues[i], buf.data, len);
 
-					break;
-				}
-*/			
+/*
+ * Decoder of the built-in pgoutput plugin, protocol versions 1 and 2.  It
+ * fills the same message as the ali_decoding decoder above.  Relations are
+ * always described once by a Relation message, types that are not built in
+ * by a Type message, and the changes carry the relation id.  Between Stream
+ * Start and Stream Stop every message begins with the xid of the
+ * (sub)transaction it belongs to.
+ */
+
+/* format_type names of the built-in types the apply path tells apart */
+static const struct
+{
+	Oid			typid;
+	const char *name;
+} pgoutput_builtin_types[] =
+{
+	{16, "boolean"},
+	{17, "bytea"},
+	{19, "name"},
+	{20, "bigint"},
+	{21, "smallint"},
+	{23, "integer"},
+	{25, "text"},
+	{26, "oid"},
+	{114, "json"},
+	{700, "real"},
+	{701, "double precision"},
+	{790, "money"},
+	{1042, "character"},
+	{1043, "character varying"},
+	{1082, "date"},
+	{1083, "time without time zone"},
+	{1114, "timestamp without time zone"},
+	{1184, "timestamp with time zone"},
+	{1186, "interval"},
+	{1266, "time with time zone"},
+	{1700, "numeric"},
+	{2950, "uuid"},
+	{0, NULL}
+};
+
+/*
+ * Name of a column type.  Values of other types are quoted as they come,
+ * so the name only has to tell them apart from the ones above.
+ */
+static char *
+pgoutput_type_name(DecodeRelCache *relcache, Oid typid)
+{
+	DecodeType *type;
+	int			i;
+
+	for (i = 0; pgoutput_builtin_types[i].name != NULL; i++)
+	{
+		if (pgoutput_builtin_types[i].typid == typid)
+			return pstrdup(pgoutput_builtin_types[i].name);
+	}
+
+	for (type = relcache->types; type != NULL; type = type->next)
+	{
+		if (type->typid == typid)
+			return pstrdup(type->name);
+	}
+
+	return psprintf("type %u", typid);
+}
+
+/* The xid that starts every message of a streamed transaction */
+static void
+pgoutput_read_xid(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	if (msg->stream == NULL || !msg->stream->active)
+		return;
+
+	msg->streamed = true;
+	msg->xid = msg->stream->xid;
+	msg->subxid = pq_getmsgint(s, 4);
+}
+
+static bool
+pgoutput_read_relid(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	uint32		relid = pq_getmsgint(s, 4);
+	DecodeRelation *rel = relcache_lookup(msg->relcache, relid);
+
+	if (rel == NULL)
+	{
+		fprintf(stderr, "change of relation %u which was not described\n", relid);
+		return false;
+	}
+
+	set_relation(msg, rel);
+	return true;
+}
+
+static bool
+pgoutput_process_relation(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	DecodeRelation *rel;
+	const char *nspname;
+	int			i;
+
+	msg->type = MSGKIND_RELATION;
+	pgoutput_read_xid(s, msg);
+
+	rel = (DecodeRelation *) palloc0(sizeof(DecodeRelation));
+	rel->relid = pq_getmsgint(s, 4);
+	nspname = pq_getmsgstring(s);
+	rel->schemaname = pstrdup(*nspname != '\0' ? nspname : "pg_catalog");
+	rel->relname = pstrdup(pq_getmsgstring(s));
+
+	/* replica identity, the columns of the key are flagged */
+	pq_getmsgbyte(s);
+
+	rel->natt = pq_getmsgint(s, 2);
+	rel->attname = (char **) palloc0(sizeof(char *) * Max(rel->natt, 1));
+	rel->atttype = (char **) palloc0(sizeof(char *) * Max(rel->natt, 1));
+	rel->k_attname = (char **) palloc0(sizeof(char *) * Max(rel->natt, 1));
+	for (i = 0; i < rel->natt; i++)
+	{
+		int			flags = pq_getmsgbyte(s);
+		const char *attname = pq_getmsgstring(s);
+		Oid			typid = pq_getmsgint(s, 4);
+
+		/* typmod */
+		pq_getmsgint(s, 4);
+
+		rel->attname[i] = pstrdup(attname);
+		rel->atttype[i] = pgoutput_type_name(msg->relcache, typid);
+		if (flags & 1)
+			rel->k_attname[rel->k_natt++] = pstrdup(attname);
+	}
+
+	relcache_insert(msg->relcache, rel);
+	set_relation(msg, rel);
+
+	return true;
+}
+
+static bool
+pgoutput_process_type(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	DecodeType *type;
+	const char *nspname;
+	const char *typname;
+	Oid			typid;
+
+	msg->type = MSGKIND_TYPE;
+	pgoutput_read_xid(s, msg);
+
+	typid = pq_getmsgint(s, 4);
+	nspname = pq_getmsgstring(s);
+	typname = pq_getmsgstring(s);
+
+	for (type = msg->relcache->types; type != NULL; type = type->next)
+	{
+		if (type->typid == typid)
+			break;
+	}
+	if (type == NULL)
+	{
+		type = (DecodeType *) palloc0(sizeof(DecodeType));
+		type->typid = typid;
+		type->next = msg->relcache->types;
+		msg->relcache->types = type;
+	}
+	else
+		pfree(type->name);
+
+	type->name = psprintf("%s.%s", nspname, typname);
+
+	return true;
+}
+
+/*
+ * TupleData of pgoutput.  Text values are not terminated, so they are copied
+ * to the arena, binary ones are in the send/recv form.
+ */
+static bool
+pgoutput_read_tuple(StringInfo s, ALI_PG_DECODE_MESSAGE *msg, Decode_TupleData *tup)
+{
+	int			natt = pq_getmsgint(s, 2);
+	int			i;
+
+	tup->natt = natt;
+	tup->nulls = (bits8 *) decode_arena_alloc(msg->arena, DECODE_BITMAPLEN(natt));
+	tup->unchanged = (bits8 *) decode_arena_alloc(msg->arena, DECODE_BITMAPLEN(natt));
+	tup->svalues = (char **) decode_arena_alloc(msg->arena, sizeof(char *) * natt);
+	tup->lengths = (int *) decode_arena_alloc(msg->arena, sizeof(int) * natt);
+	tup->formats = (char *) decode_arena_alloc(msg->arena, natt);
+
+	for (i = 0; i < natt; i++)
+	{
+		char		kind = pq_getmsgbyte(s);
+		const char *data;
+		int			len;
+
+		switch (kind)
+		{
+			case 'n':
+				tup->nulls[i / 8] |= 1 << (i % 8);
+				break;
+			case 'u':
+				tup->nulls[i / 8] |= 1 << (i % 8);
+				tup->unchanged[i / 8] |= 1 << (i % 8);
+				break;
 			case 't':
-				{
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4);
+				len = pq_getmsgint(s, 4);
+				data = pq_getmsgbytes(s, len);
+
+				tup->svalues[i] = (char *) decode_arena_alloc(msg->arena, len + 1);
+				memcpy(tup->svalues[i], data, len);
+				tup->lengths[i] = len;
+				tup->formats[i] = 't';
+				break;
+			case 'b':
+				len = pq_getmsgint(s, 4);
 
-					tup->svalues[i] = (char *) pq_getmsgbytes(s, len);
-					//tup->svalues[i] = palloc0(len + 1);
-					//memcpy(tup->svalues[i], data, len);
+				tup->svalues[i] = (char *) pq_getmsgbytes(s, len);
+				tup->lengths[i] = len;
+				tup->formats[i] = 's';
+				if (!binary_value_valid(DECODE_ATTTYPE(msg, i), 's', tup->svalues[i], len))
+				{
+					fprintf(stderr, "can not read binary value of column %d, type %s\n",
+							i, DECODE_ATTTYPE(msg, i) ? DECODE_ATTTYPE(msg, i) : "unknown");
+					return false;
 				}
 				break;
 			default:
-			{
-				fprintf(stderr, "unknown column type '%c'", kind);
+				fprintf(stderr, "unknown column type '%c'\n", kind);
 				return false;
-			}
 		}
+	}
+
+	return true;
+}
+
+static bool
+pgoutput_process_change(StringInfo s, ALI_PG_DECODE_MESSAGE *msg, char action)
+{
+	char		kind;
+
+	msg->type = action;
+	pgoutput_read_xid(s, msg);
+	if (!pgoutput_read_relid(s, msg))
+		return false;
+
+	kind = pq_getmsgbyte(s);
+
+	/* the key or the whole old row */
+	if (action != MSGKIND_INSERT && (kind == 'K' || kind == 'O'))
+	{
+		msg->has_key_or_old = true;
+		if (!pgoutput_read_tuple(s, msg, &msg->oldtuple))
+			return false;
+		if (action == MSGKIND_DELETE)
+			return true;
+		kind = pq_getmsgbyte(s);
+	}
 
+	if (action == MSGKIND_DELETE || kind != 'N')
+	{
+		fprintf(stderr, "unexpected tuple '%c' in change '%c'\n", kind, action);
+		return false;
+	}
+
+	return pgoutput_read_tuple(s, msg, &msg->newtuple);
+}
+
+static bool
+pgoutput_process_truncate(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	int			i;
+
+	msg->type = MSGKIND_TRUNCATE;
+	pgoutput_read_xid(s, msg);
+
+	msg->nrels = pq_getmsgint(s, 4);
+	msg->truncate_flags = pq_getmsgbyte(s);
+	msg->rels = (DecodeRelation **) decode_arena_alloc(msg->arena, sizeof(DecodeRelation *) * msg->nrels);
+	for (i = 0; i < msg->nrels; i++)
+	{
+		uint32		relid = pq_getmsgint(s, 4);
+
+		msg->rels[i] = relcache_lookup(msg->relcache, relid);
+		if (msg->rels[i] == NULL)
+		{
+			fprintf(stderr, "truncate of relation %u which was not described\n", relid);
+			return false;
+		}
 	}
 
 	return true;
 }
 
+/*
+ * Read a pgoutput message.  Origin and logical decoding messages are read
+ * over and come back as MSGKIND_UNKNOWN.
+ */
+bool
+pgoutput_process_action(StringInfo s, ALI_PG_DECODE_MESSAGE *msg)
+{
+	char		action = pq_getmsgbyte(s);
+
+	if (msg->relcache == NULL || msg->stream == NULL)
+	{
+		fprintf(stderr, "pgoutput decoding without relation cache\n");
+		return false;
+	}
+
+	switch (action)
+	{
+		case 'B':
+			msg->type = MSGKIND_BEGIN;
+			msg->lsn = pq_getmsgint64(s);
+			msg->tm = pq_getmsgint64(s);
+			msg->xid = pq_getmsgint(s, 4);
+			break;
+		case 'C':
+			/* flags, unused */
+			pq_getmsgbyte(s);
+			msg->type = MSGKIND_COMMIT;
+			msg->lsn = pq_getmsgint64(s);
+			msg->end_lsn = pq_getmsgint64(s);
+			msg->tm = pq_getmsgint64(s);
+			break;
+		case 'O':
+			msg->type = MSGKIND_UNKNOWN;
+			break;
+		case 'M':
+			msg->type = MSGKIND_UNKNOWN;
+			break;
+		case 'R':
+			return pgoutput_process_relation(s, msg);
+		case 'Y':
+			return pgoutput_process_type(s, msg);
+		case 'I':
+		case 'U':
+		case 'D':
+			return pgoutput_process_change(s, msg, action);
+		case 'T':
+			return pgoutput_process_truncate(s, msg);
+		case 'S':
+			msg->type = MSGKIND_STREAM_START;
+			msg->xid = pq_getmsgint(s, 4);
+			msg->stream->active = true;
+			msg->stream->xid = msg->xid;
+			break;
+		case 'E':
+			msg->type = MSGKIND_STREAM_STOP;
+			msg->xid = msg->stream->xid;
+			msg->stream->active = false;
+			break;
+		case 'c':
+			msg->type = MSGKIND_STREAM_COMMIT;
+			msg->xid = pq_getmsgint(s, 4);
+			/* flags, unused */
+			pq_getmsgbyte(s);
+			msg->lsn = pq_getmsgint64(s);
+			msg->end_lsn = pq_getmsgint64(s);
+			msg->tm = pq_getmsgint64(s);
+			break;
+		case 'A':
+			msg->type = MSGKIND_STREAM_ABORT;
+			msg->xid = pq_getmsgint(s, 4);
+			msg->subxid = pq_getmsgint(s, 4);
+			break;
+		default:
+			fprintf(stderr, "unknown pgoutput message of type %c\n", action);
+			return false;
+	}
+
+	return true;
+}
@@ -35,8 +35,6 @@ typedef double timestamp;
 typedef double TimestampTz;
 #endif
 
-#define MaxTupleAttributeNumber 1664	/* 8 * 208 */
-
 #define		  MSGKIND_BEGIN			'B'		
 #define		  MSGKIND_COMMIT		'C'		
 #define		  MSGKIND_INSERT		'I'		
@@ -44,15 +42,107 @@ typedef double TimestampTz;
 #define		  MSGKIND_DELETE		'D'	
 #define		  MSGKIND_DDL			'L'	
 #define		  MSGKIND_UNKNOWN		'K'	
+#define		  MSGKIND_RELATION		'R'
+#define		  MSGKIND_TYPE			'Y'
+#define		  MSGKIND_TRUNCATE		'T'
+#define		  MSGKIND_STREAM_START	'S'
+#define		  MSGKIND_STREAM_STOP	'E'
+#define		  MSGKIND_STREAM_COMMIT	'c'
+#define		  MSGKIND_STREAM_ABORT	'A'
+
+/* options of a truncate, as pgoutput sends them */
+#define		  DECODE_TRUNCATE_CASCADE		(1 << 0)
+#define		  DECODE_TRUNCATE_RESTART_SEQS	(1 << 1)
+
+/*
+ * Memory of the decoded message.  The column arrays and bitmaps of a message
+ * are carved out of one block, which is reset before the next message, so
+ * decoding a change costs in proportion to its columns.  A message that does
+ * not fit spills into blocks of its own, and the block is grown to fit the
+ * next time.
+ */
+typedef struct DecodeArenaSpill
+{
+	struct DecodeArenaSpill *next;
+} DecodeArenaSpill;
+
+typedef struct DecodeArena
+{
+	char	   *block;
+	Size		size;
+	Size		used;
+	Size		spilled;		/* bytes in spills since the last reset */
+	DecodeArenaSpill *spills;
+} DecodeArena;
+
+#define DECODE_BITMAPLEN(natt)	(((natt) + 7) / 8)
 
+/*
+ * A column of a decoded tuple is either null, an unchanged toasted value
+ * that is not sent, which also counts as null, or a text value.  The value
+ * points into the received message.
+ */
 typedef struct Decode_TupleData
 {
 	int			natt;
-	bool		isnull[MaxTupleAttributeNumber];
-	bool		changed[MaxTupleAttributeNumber];
-	char		*svalues[MaxTupleAttributeNumber];
+	bits8	   *nulls;			/* bit set for null or unchanged */
+	bits8	   *unchanged;		/* bit set for unchanged toasted */
+	char	  **svalues;		/* NULL if null or unchanged */
+	int		   *lengths;		/* length of each value */
+	char	   *formats;		/* 't' text, 's' send/recv or 'b' internal, see sendrecv.h */
 } Decode_TupleData;
 
+/*
+ * Relation described once by an 'R' message, when the plugin is started with
+ * relation_cache 'on'.  Row messages then carry the relation id instead of
+ * the names and the column info, and are resolved against the cache.  The
+ * plugin sends the relation again after a schema change, which replaces the
+ * entry.
+ */
+typedef struct DecodeRelation
+{
+	uint32		relid;
+	char	   *schemaname;
+	char	   *relname;
+	int			natt;
+	char	  **attname;
+	char	  **atttype;
+	int			k_natt;
+	char	  **k_attname;
+	struct DecodeRelation *next;
+} DecodeRelation;
+
+#define DECODE_RELCACHE_BUCKETS	256
+
+/* Type that pgoutput described by a 'Y' message, not a built-in one */
+typedef struct DecodeType
+{
+	Oid			typid;
+	char	   *name;			/* qualified name */
+	struct DecodeType *next;
+} DecodeType;
+
+typedef struct DecodeRelCache
+{
+	DecodeRelation *buckets[DECODE_RELCACHE_BUCKETS];
+	DecodeType *types;
+} DecodeRelCache;
+
+/*
+ * pgoutput streams a large transaction in chunks before it commits, between
+ * Stream Start and Stream Stop messages, each change tagged with the xid of
+ * its (sub)transaction.  The transaction then ends with a Stream Commit or
+ * a Stream Abort.
+ */
+typedef struct DecodeStream
+{
+	bool		active;			/* between Stream Start and Stream Stop */
+	TransactionId xid;			/* toplevel transaction being streamed */
+} DecodeStream;
+
+#define DECODE_ISNULL(tup, i)	(((tup)->nulls[(i) / 8] & (1 << ((i) % 8))) != 0)
+#define DECODE_CHANGED(tup, i)	(((tup)->unchanged[(i) / 8] & (1 << ((i) % 8))) == 0)
+
 typedef struct ALI_PG_DECODE_MESSAGE
 {
 	char			type;
@@ -60,25 +150,38 @@ typedef struct ALI_PG_DECODE_MESSAGE
 	XLogRecPtr		lsn;
 	TimestampTz		tm;
 	
-	TransactionId	xid;		/* begin */
+	TransactionId	xid;		/* begin, stream messages and streamed changes */
+	TransactionId	subxid;		/* streamed changes and stream abort */
 	TimestampTz		end_lsn;	/* commit */
+	bool			streamed;	/* change of a transaction that did not commit yet */
 
 	char	*relname;
 	char	*schemaname;
 
 	int			natt;
-	char		*attname[MaxTupleAttributeNumber];
-	char		*atttype[MaxTupleAttributeNumber];
+	char		**attname;		/* NULL entry for a dropped column */
+	char		**atttype;
 	
 	int			k_natt;
-	char		*k_attname[MaxTupleAttributeNumber];
+	char		**k_attname;
 
 	bool		has_key_or_old;
 	Decode_TupleData newtuple;
 	Decode_TupleData oldtuple;
 
+	int			nrels;			/* truncate */
+	DecodeRelation **rels;
+	int			truncate_flags;
+
+	DecodeArena	*arena;			/* the arrays above live here */
+	DecodeRelCache *relcache;	/* NULL if relations come by name */
+	DecodeStream *stream;		/* pgoutput only */
 } ALI_PG_DECODE_MESSAGE;
 
+/* Name and type of column i, NULL if dropped or not described */
+#define DECODE_ATTNAME(msg, i)	((i) < (msg)->natt ? (msg)->attname[i] : NULL)
+#define DECODE_ATTTYPE(msg, i)	((i) < (msg)->natt ? (msg)->atttype[i] : NULL)
+
 typedef struct Decoder_handler
 {
 	bool do_create_slot;
@@ -100,7 +203,29 @@ typedef struct Decoder_handler
 	XLogRecPtr flushpos;
 	XLogRecPtr last_recvpos;
 
+	/*
+	 * If set, the position applied so far when it moves apart from what the
+	 * caller receives, read into flushpos before each feedback.
+	 */
+	XLogRecPtr (*get_flushpos) (void *arg);
+	void	   *flushpos_arg;
+
 	ALI_PG_DECODE_MESSAGE msg;
+	DecodeArena	arena;
+
+	bool	relation_cache;		/* ask the plugin to describe relations once */
+	bool	binary_values;		/* ask the plugin for values in send/recv form */
+	DecodeRelCache *relcache;
+
+	/*
+	 * Decode the built-in pgoutput plugin instead of ali_decoding.  It
+	 * always describes relations by id, and streams large transactions
+	 * before they commit when the source is 14 or later.
+	 */
+	bool	pgoutput;
+	char	*publication_names;	/* comma separated */
+	bool	streaming;			/* set by init_streaming */
+	DecodeStream stream;
 	
 	int verbose;
 
@@ -149,6 +274,9 @@ typedef struct Decoder_handler
 #endif
 
 extern bool bdr_process_remote_action(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
+extern bool pgoutput_process_action(StringInfo s, ALI_PG_DECODE_MESSAGE *msg);
+extern void decode_message_reset(ALI_PG_DECODE_MESSAGE *msg, DecodeArena *arena);
+extern void decode_relcache_reset(DecodeRelCache *relcache);
 
 /*
 #define elog  \
@@ -177,6 +305,7 @@ extern int drop_replication_slot(Decoder_handler *hander);
 extern int init_logfile(Decoder_handler *hander);
 extern int init_streaming(Decoder_handler *hander);
 extern ALI_PG_DECODE_MESSAGE *exec_logical_decoder(Decoder_handler *hander, volatile bool *time_to_stop);
+extern bool exec_logical_receive(Decoder_handler *hander, volatile bool *time_to_stop, StringInfo s);
 extern void pg_sleep(long microsec);
 extern Decoder_handler *init_hander(void);
 
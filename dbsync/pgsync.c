@@ -16,6 +16,10 @@
 #include "pqexpbuffer.h"
 #include "pgsync.h"
 #include "libpq/pqsignal.h"
+#include "gpfdist.h"
+#include "rebuild.h"
+#include "flowctl.h"
+#include "ratelimit.h"
 
 #include <time.h>
 
@@ -23,12 +27,35 @@
 #include <pthread.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#define HAVE_COPY_EVENT_LOOP
+#endif
 
+typedef struct DecodeChange DecodeChange;
+typedef struct DecodePipeline DecodePipeline;
 
+static Task_hd *next_task(Thread_hd *hd);
 static void *copy_table_data(void *arg);
+#ifdef HAVE_COPY_EVENT_LOOP
+static void *copy_table_data_async(void *arg);
+#endif
 static char *get_synchronized_snapshot(PGconn *conn);
+static int get_segment_count(PGconn *conn);
+static int table_chunk_count(long relpages, int nsegment);
+static bool binary_copy_compatible(PGconn *origin_conn, PGconn *target_conn, char *nspname, char *relname);
+static int put_binary_copy_data(PGconn **writers, int nwriter, Task_hd *task, bool first, char *data, int len);
 static bool is_slot_exists(PGconn *conn, char *slotname);
 static void *logical_decoding_receive_thread(void *arg);
+static bool spool_stream_message(PGconn *local_conn, DecodeChange *change);
+static bool reset_staging(PGconn *local_conn, bool streaming);
+static DecodePipeline *decode_pipeline_start(Decoder_handler *hander, PGconn *local_conn, const char *stmtname, int nworkers);
+static bool decode_pipeline_put(DecodePipeline *pipe, StringInfo s, XLogRecPtr recvpos);
+static XLogRecPtr decode_pipeline_flushpos(void *arg);
+static XLogRecPtr decode_pipeline_finish(DecodePipeline *pipe);
+static void *decode_pipeline_decode(void *arg);
+static void *decode_pipeline_write(void *arg);
 static void get_task_status(PGconn *conn, char **full_start, char **full_end, char **decoder_start, char **apply_id);
 static void update_task_status(PGconn *conn, bool full_start, bool full_end, bool decoder_start, int64 apply_id);
 static void *logical_decoding_apply_thread(void *arg);
@@ -37,6 +64,47 @@ static void sigint_handler(int signum);
 
 static volatile bool time_to_abort = false;
 
+/* tables with more pages than this are copied as ctid block range chunks, 0 disables */
+int chunk_pages = 0;
+/* greenplum source tables are copied by groups of this many segments, 0 disables */
+int segment_group = 0;
+/* target connections the rows of one source COPY are dealt to, round robin */
+int fan_out = 1;
+/* copy tables whose column types match on both sides in binary format */
+bool binary_copy = false;
+/* copies each thread drives at once through an event loop, 1 for one blocking copy */
+int copies_per_thread = 1;
+/* have the decoding plugin describe each relation once, not with every change */
+bool relation_cache = false;
+/* have the decoding plugin send values in send/recv form, not as text */
+bool binary_values = false;
+/* decode with the built-in pgoutput plugin from these publications, not ali_decoding */
+char *publication_names = NULL;
+/* threads that decode the received changes and render their SQL */
+int decode_workers = 2;
+/* bounds of the adaptive number of copy workers, 0 for a fixed number */
+int flow_min_workers = 0;
+int flow_max_workers = 0;
+static FlowControl *flow = NULL;
+/* limits of the source reads, read from my.cfg and again on SIGHUP */
+static RateLimit *rate = NULL;
+
+/* rows a copy worker moves between two reports to the flow control */
+#define FLOW_REPORT_ROWS	4096
+/* host:port to serve copy data to greenplum segments on, NULL to copy through the master */
+char *gpfdist_address = NULL;
+static GpfdistServer *gpfdist_server = NULL;
+/* truncate and COPY FREEZE in one transaction, and load into unlogged tables */
+bool fast_load = false;
+bool fast_load_unlogged = false;
+/* workers rebuilding the indexes dropped before the copy, 0 keeps them during the copy */
+int rebuild_workers = 0;
+/* maintenance_work_mem of the rebuild workers, NULL for the server default */
+char *rebuild_work_mem = NULL;
+
+/* rows are handed to the segments in blocks of about this size */
+#define GPFDIST_BLOCK_SIZE	(1024 * 1024)
+
 
 #define ERROR_DUPLICATE_KEY		23505
 
@@ -47,9 +115,84 @@ static volatile bool time_to_abort = false;
 
 #define RECONNECT_SLEEP_TIME 5
 
-#define ALL_DB_TABLE_SQL "select n.nspname, c.relname from pg_class c, pg_namespace n where n.oid = c.relnamespace and c.relkind = 'r' and n.nspname not in ('pg_catalog','tiger','tiger_data','topology','postgis','information_schema','gp_toolkit','pg_aoseg','pg_toast') order by c.relpages desc;"
+/* messages received but not yet staged, the network thread waits beyond */
+#define DECODE_PIPELINE_DEPTH	1024
+
+/*
+ * A message of the stream on its way through the decode pipeline, from the
+ * network thread through a decode worker to the staging writer.  The buffers
+ * are kept and reused for later messages.
+ */
+struct DecodeChange
+{
+	uint64			seq;			/* order in which the message came */
+	XLogRecPtr		recvpos;		/* stream position once it is staged */
+	StringInfoData	data;			/* the message after the XLogData header */
+	DecodeStream	stream;			/* pgoutput stream state it was sent in */
+
+	/* set by the decode worker */
+	char			type;
+	bool			streamed;
+	TransactionId	xid;
+	TransactionId	subxid;
+	PQExpBuffer		sql;			/* empty if there is nothing to stage */
+	bool			decoded;
+	bool			failed;
+};
+
+/*
+ * Incremental sync receiver.  The network thread receives the messages and
+ * numbers them, a pool of workers decodes them and renders their SQL in
+ * parallel, and the writer stages the SQL in the local database in the order
+ * the messages came, so that transactions stay in commit order.  Changes go
+ * to the workers through the decode queue and to the writer through the
+ * order queue, and come back through the free queue once staged, so the
+ * network thread waits once DECODE_PIPELINE_DEPTH messages are in flight.
+ *
+ * Relation and type descriptions change the state the workers decode with.
+ * The network thread waits until the messages before one are decoded and
+ * decodes it itself.
+ */
+struct DecodePipeline
+{
+	Decoder_handler *hander;
+	PGconn		   *local_conn;
+	const char	   *stmtname;		/* prepared INSERT INTO sync_sqls */
+
+	BoundedQueue	decode;
+	BoundedQueue	order;
+	BoundedQueue	free;
+	DecodeChange	changes[DECODE_PIPELINE_DEPTH];
+
+	uint64			next_seq;
+	DecodeStream	stream;			/* pgoutput stream state, network thread only */
+	ALI_PG_DECODE_MESSAGE msg;		/* descriptions decoded by the network thread */
+	DecodeArena		arena;
+
+	int				nworkers;
+	Thread		   *workers;
+	Thread			writer;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	decoded;		/* a change was decoded */
+	int				pending;		/* queued changes not decoded yet */
+	XLogRecPtr		flushpos;		/* staged up to here */
+	volatile bool	failed;
+	volatile bool	stopping;
+};
+
+#define ALL_DB_TABLE_SQL "select n.nspname, c.relname, c.relpages from pg_class c, pg_namespace n where n.oid = c.relnamespace and c.relkind = 'r' and n.nspname not in ('pg_catalog','tiger','tiger_data','topology','postgis','information_schema','gp_toolkit','pg_aoseg','pg_toast') order by c.relpages desc;"
 #define GET_NAPSHOT "SELECT pg_export_snapshot()"
 
+#define COLUMN_TYPES_SQL "SELECT a.atttypid, a.atttypmod FROM pg_catalog.pg_attribute a WHERE a.attrelid = %s::pg_catalog.regclass AND a.attnum > 0 AND NOT a.attisdropped ORDER BY a.attnum"
+
+/* signature, flags and header extension length in front of binary COPY data */
+#define BINARY_SIGNATURE		"PGCOPY\n\377\r\n\0"
+#define BINARY_SIGNATURE_LEN	11
+#define BINARY_HEADER_LEN		(BINARY_SIGNATURE_LEN + 8)
+
+#define MAJOR_VERSION(v)	((v) >= 100000 ? (v) / 10000 : (v) / 100)
+
 #define TASK_ID "1"
 
 #ifndef WIN32
@@ -66,6 +209,24 @@ static int64 atoll(const char *nptr)
 #endif
 
 
+/* Take the next task off the queue, NULL when there is none left */
+static Task_hd *
+next_task(Thread_hd *hd)
+{
+	Task_hd    *curr = NULL;
+
+	pthread_mutex_lock(&hd->t_lock);
+	if (hd->ntask > 0)
+	{
+		curr = hd->l_task;
+		hd->l_task = hd->ntask > 1 ? curr->next : NULL;
+		hd->ntask--;
+	}
+	pthread_mutex_unlock(&hd->t_lock);
+
+	return curr;
+}
+
 /*
  * COPY single table over wire.
  */
@@ -79,12 +240,24 @@ copy_table_data(void *arg)
 	int			bytes;
 	char	   *copybuf;
 	StringInfoData	query;
+	StringInfoData	block;
+	GpfdistFeed *feed = NULL;
 	char *nspname;
 	char *relname;
 	Task_hd 	*curr = NULL;
 	TimevalStruct before,
 					after; 
 	double		elapsed_msec = 0;
+	PGconn	  **writers = NULL;
+	int			nwriter;
+	int			w;
+	bool		binary;
+	bool		first;
+	bool		running = false;
+	FlowMeter	meter;
+	TimevalStruct mark;
+	RateCharge	charge;
+	char	   *table;
 
 	PGconn *origin_conn = args->from;
 	PGconn *target_conn = args->to;
@@ -102,52 +275,78 @@ copy_table_data(void *arg)
 		fprintf(stderr, "init desc conn failed: %s", PQerrorMessage(target_conn));
 		return NULL;
 	}
+
+	/*
+	 * The source sends rows much faster than one COPY FROM can store them.
+	 * With fan_out, each task is written by that many target connections,
+	 * each in a transaction of its own, committed once all of them have
+	 * taken their rows.  Segments already load a greenplum feed in parallel.
+	 */
+	nwriter = (fan_out > 1 && gpfdist_server == NULL) ? fan_out : 1;
+	writers = (PGconn **) palloc0(sizeof(PGconn *) * nwriter);
+	writers[0] = target_conn;
+	for (w = 1; w < nwriter; w++)
+	{
+		writers[w] = pglogical_connect(hd->desc, EXTENSION_NAME "_copy");
+		if (writers[w] == NULL)
+		{
+			fprintf(stderr, "open writer connection %d of %d to target failed\n", w + 1, nwriter);
+			goto exit;
+		}
+	}
 	
+	memset(&meter, 0, sizeof(FlowMeter));
 	initStringInfo(&query);
+	initStringInfo(&block);
 	while(1)
 	{
-		int			nlist = 0;
-
-		GETTIMEOFDAY(&before);
-		pthread_mutex_lock(&hd->t_lock);
-		nlist = hd->ntask;
-		if (nlist == 1)
+		if (flow != NULL)
 		{
-		  curr = hd->l_task;
-		  hd->l_task = NULL;
-		  hd->ntask = 0;
+			flowctl_acquire(flow);
+			running = true;
 		}
-		else if (nlist > 1)
-		{
-		  Task_hd	*tmp = hd->l_task->next;
-		  curr = hd->l_task;
-		  hd->l_task = tmp;
-		  hd->ntask--;
-		}
-		else
-		{
-			curr = NULL;
-		}
-
-		pthread_mutex_unlock(&hd->t_lock);
 
+		GETTIMEOFDAY(&before);
+		curr = next_task(hd);
 		if(curr == NULL)
 		{
 			break;
 		}
 
 		start_copy_origin_tx(origin_conn, hd->snapshot, hd->src_version, hd->desc_is_greenplum);
-		start_copy_target_tx(target_conn, hd->desc_version, hd->desc_is_greenplum);
+		for (w = 0; w < nwriter; w++)
+			start_copy_target_tx(writers[w], hd->desc_version, hd->desc_is_greenplum);
+		if (curr->truncate &&
+			fast_load_prepare(target_conn, curr) != 0)
+			goto exit;
 
 		nspname = curr->schemaname;
 		relname = curr->relname;
+		binary = binary_copy && gpfdist_server == NULL &&
+			binary_copy_compatible(origin_conn, target_conn, nspname, relname);
+		first = true;
+
+		table = psprintf("%s.%s", nspname, relname);
+		memset(&charge, 0, sizeof(RateCharge));
+		charge.table = ratelimit_table(rate, table);
+		pfree(table);
 
 		/* Build COPY TO query. */
-		appendStringInfo(&query, "COPY %s.%s TO stdout",
-						 PQescapeIdentifier(origin_conn, nspname,
-											strlen(nspname)),
-						 PQescapeIdentifier(origin_conn, relname,
-											strlen(relname)));
+		if (curr->range_cond)
+			appendStringInfo(&query, "COPY (SELECT * FROM %s.%s WHERE %s) TO stdout%s",
+							 PQescapeIdentifier(origin_conn, nspname,
+												strlen(nspname)),
+							 PQescapeIdentifier(origin_conn, relname,
+												strlen(relname)),
+							 curr->range_cond,
+							 binary ? " WITH (FORMAT binary)" : "");
+		else
+			appendStringInfo(&query, "COPY %s.%s TO stdout%s",
+							 PQescapeIdentifier(origin_conn, nspname,
+												strlen(nspname)),
+							 PQescapeIdentifier(origin_conn, relname,
+												strlen(relname)),
+							 binary ? " WITH (FORMAT binary)" : "");
 
 		/* Execute COPY TO. */
 		res1 = PQexec(origin_conn, query.data);
@@ -158,34 +357,100 @@ copy_table_data(void *arg)
 			goto exit;
 		}
 
-		/* Build COPY FROM query. */
-		resetStringInfo(&query);
-		appendStringInfo(&query, "COPY %s.%s FROM stdin",
-						 PQescapeIdentifier(target_conn, nspname,
-											strlen(nspname)),
-						 PQescapeIdentifier(target_conn, relname,
-											strlen(relname)));
-
-		/* Execute COPY FROM. */
-		res2 = PQexec(target_conn, query.data);
-		if (PQresultStatus(res2) != PGRES_COPY_IN)
+		res2 = NULL;
+		if (gpfdist_server != NULL)
 		{
-			fprintf(stderr,"table copy failed Query '%s': %s", 
-				query.data, PQerrorMessage(target_conn));
-			goto exit;
+			/* The segments read the text format COPY TO writes */
+			feed = gpfdist_load_begin(gpfdist_server, target_conn, nspname, relname,
+									  "FORMAT 'text' ENCODING 'utf8'");
+			if (feed == NULL)
+				goto exit;
 		}
+		else
+		{
+			/* Build COPY FROM query. */
+			resetStringInfo(&query);
+			appendStringInfo(&query, "COPY %s.%s FROM stdin%s",
+							 PQescapeIdentifier(target_conn, nspname,
+												strlen(nspname)),
+							 PQescapeIdentifier(target_conn, relname,
+												strlen(relname)),
+							 binary ? (fast_load_freeze(curr) ? " WITH (FORMAT binary, FREEZE)" : " WITH (FORMAT binary)") :
+							 (fast_load_freeze(curr) ? " WITH (FREEZE)" : ""));
+
+			/* Execute COPY FROM. */
+			res2 = PQexec(target_conn, query.data);
+			if (PQresultStatus(res2) != PGRES_COPY_IN)
+			{
+				fprintf(stderr,"table copy failed Query '%s': %s", 
+					query.data, PQerrorMessage(target_conn));
+				goto exit;
+			}
+
+			for (w = 1; w < nwriter; w++)
+			{
+				PGresult   *res3 = PQexec(writers[w], query.data);
 
+				if (PQresultStatus(res3) != PGRES_COPY_IN)
+				{
+					fprintf(stderr,"table copy failed Query '%s': %s",
+						query.data, PQerrorMessage(writers[w]));
+					PQclear(res3);
+					goto exit;
+				}
+				PQclear(res3);
+			}
+		}
+
+		if (flow != NULL)
+			GETTIMEOFDAY(&mark);
 		while ((bytes = PQgetCopyData(origin_conn, &copybuf, false)) > 0)
 		{
-			if (PQputCopyData(target_conn, copybuf, bytes) != 1)
+			int		rows = 1;
+
+			if (flow != NULL)
+				meter.fetch_msec += flowctl_lap(&mark);
+
+			if (feed != NULL)
+			{
+				appendBinaryStringInfo(&block, copybuf, bytes);
+				if (block.len >= GPFDIST_BLOCK_SIZE)
+				{
+					if (!gpfdist_load_send(feed, target_conn, block.data, block.len))
+						goto exit;
+					resetStringInfo(&block);
+				}
+			}
+			else if (binary)
+			{
+				rows = put_binary_copy_data(writers, nwriter, curr, first, copybuf, bytes);
+				if (rows < 0)
+					goto exit;
+				first = false;
+			}
+			else if (PQputCopyData(writers[curr->count % nwriter], copybuf, bytes) != 1)
 			{
 				fprintf(stderr,"writing to target table failed destination connection reported: %s",
-							 PQerrorMessage(target_conn));
+							 PQerrorMessage(writers[curr->count % nwriter]));
 				goto exit;
 			}
-			args->count++;
-			curr->count++;
+			args->count += rows;
+			curr->count += rows;
 			PQfreemem(copybuf);
+
+			if (flow != NULL)
+			{
+				meter.send_msec += flowctl_lap(&mark);
+				meter.rows += rows;
+				meter.bytes += bytes;
+				if (meter.rows >= FLOW_REPORT_ROWS)
+					flowctl_report(flow, &meter);
+			}
+
+			/* The sleep is time blocked on neither side */
+			ratelimit_charge(rate, &charge, rows, bytes, false);
+			if (flow != NULL)
+				GETTIMEOFDAY(&mark);
 		}
 
 		if (bytes != -1)
@@ -194,26 +459,54 @@ copy_table_data(void *arg)
 						bytes, PQerrorMessage(origin_conn));
 			goto exit;
 		}
+		ratelimit_charge(rate, &charge, 0, 0, true);
 
-		/* Send local finish */
-		if (PQputCopyEnd(target_conn, NULL) != 1)
+		if (feed != NULL)
 		{
-			fprintf(stderr,"sending copy-completion to destination connection failed destination connection reported: %s",
-						 PQerrorMessage(target_conn));
-			goto exit;
-		}
+			GpfdistFeed *done = feed;
 
-		PQclear(res2);
-		res2 = PQgetResult(target_conn);
-		if (PQresultStatus(res2) != PGRES_COMMAND_OK)
+			if (block.len > 0 &&
+				!gpfdist_load_send(feed, target_conn, block.data, block.len))
+				goto exit;
+			resetStringInfo(&block);
+
+			feed = NULL;
+			if (!gpfdist_load_end(done, target_conn, NULL))
+				goto exit;
+		}
+		else
 		{
-			fprintf(stderr, "COPY failed for table \"%s\": %s",
-								 relname, PQerrorMessage(target_conn));
-			goto exit;
+			/* Send local finish */
+			for (w = 0; w < nwriter; w++)
+			{
+				if (PQputCopyEnd(writers[w], NULL) != 1)
+				{
+					fprintf(stderr,"sending copy-completion to destination connection failed destination connection reported: %s",
+								 PQerrorMessage(writers[w]));
+					goto exit;
+				}
+			}
+
+			for (w = 0; w < nwriter; w++)
+			{
+				PQclear(res2);
+				res2 = PQgetResult(writers[w]);
+				if (PQresultStatus(res2) != PGRES_COMMAND_OK)
+				{
+					fprintf(stderr, "COPY failed for table \"%s\": %s",
+										 relname, PQerrorMessage(writers[w]));
+					goto exit;
+				}
+			}
 		}
 
+		if (curr->truncate &&
+			fast_load_finish(target_conn, curr) != 0)
+			goto exit;
+
 		finish_copy_origin_tx(origin_conn);
-		finish_copy_target_tx(target_conn);
+		for (w = 0; w < nwriter; w++)
+			finish_copy_target_tx(writers[w]);
 		curr->complete = true;
 		PQclear(res1);
 		PQclear(res2);
@@ -221,19 +514,606 @@ copy_table_data(void *arg)
 
 		GETTIMEOFDAY(&after);
 		DIFF_MSEC(&after, &before, elapsed_msec);
-		fprintf(stderr,"thread %d migrate task %d table %s.%s %ld rows complete, time cost %.3f ms\n",
-						 args->id, curr->id, nspname, relname, curr->count, elapsed_msec);
+		if (curr->nchunk > 1)
+			fprintf(stderr,"thread %d migrate task %d table %s.%s chunk %d/%d %ld rows complete, time cost %.3f ms\n",
+							 args->id, curr->id, nspname, relname, curr->chunk_id + 1, curr->nchunk, curr->count, elapsed_msec);
+		else
+			fprintf(stderr,"thread %d migrate task %d table %s.%s %ld rows complete, time cost %.3f ms\n",
+							 args->id, curr->id, nspname, relname, curr->count, elapsed_msec);
+
+		if (flow != NULL)
+		{
+			flowctl_report(flow, &meter);
+			flowctl_release(flow);
+			running = false;
+		}
 	}
 	
 	args->all_ok = true;
 
 exit:
+	/* A parked worker may take over the rest of the queue */
+	if (running)
+		flowctl_release(flow);
 
 	PQfinish(origin_conn);
 	PQfinish(target_conn);
+	/* Closing the other writers rolls back their part of a failed task */
+	for (w = 1; writers != NULL && w < nwriter; w++)
+		PQfinish(writers[w]);
+	/* Closing the connection has aborted the INSERT reading the feed */
+	if (feed != NULL)
+		gpfdist_load_abort(feed);
+	ThreadExit(0);
+	return NULL;
+}
+
+#ifdef HAVE_COPY_EVENT_LOOP
+/*
+ * Event loop copy engine.  A thread drives copies_per_thread copies at once,
+ * each of them a slot with an origin and a target connection in
+ * nonblocking mode, all sockets watched by one epoll set.  The statements
+ * starting and ending a task are sent as one query string per side, so a
+ * small table costs few round trips, and those of different slots overlap.
+ */
+typedef enum CopySlotState
+{
+	SLOT_IDLE,					/* no task */
+	SLOT_STARTING,				/* BEGIN and COPY sent, waiting for COPY mode */
+	SLOT_COPYING,				/* moving rows */
+	SLOT_ENDING,				/* source done, finishing both COPY commands */
+	SLOT_COMMITTING				/* ROLLBACK and COMMIT sent */
+} CopySlotState;
+
+typedef struct CopySlot
+{
+	int			id;
+	PGconn	   *origin;
+	PGconn	   *target;
+	CopySlotState state;
+	Task_hd    *task;
+	TimevalStruct before;
+
+	bool		origin_done;	/* origin reached the state the slot waits for */
+	bool		target_done;
+	bool		end_sent;		/* PQputCopyEnd queued on target */
+	bool		origin_flush;	/* output left to flush */
+	bool		target_flush;
+	char	   *pending;		/* row read but not queued on target yet */
+	int			pending_len;
+	int			unflushed;		/* bytes queued on target since the last flush */
+	RateCharge	charge;			/* rows read not charged to the rate limit yet */
+} CopySlot;
+
+#define SLOT_RESULT_ERROR	-1
+#define SLOT_RESULT_WAIT	0
+#define SLOT_RESULT_DONE	1
+#define SLOT_RESULT_COPY	2
+
+/* rows queued on target before a flush, and no more rows while it is pending */
+#define SLOT_FLUSH_BYTES	65536
+
+/*
+ * Read the results of the query sent on conn that have arrived, without
+ * blocking.
+ */
+static int
+slot_results(PGconn *conn)
+{
+	while (!PQisBusy(conn))
+	{
+		PGresult   *res = PQgetResult(conn);
+
+		if (res == NULL)
+			return SLOT_RESULT_DONE;
+
+		switch (PQresultStatus(res))
+		{
+			case PGRES_COMMAND_OK:
+			case PGRES_TUPLES_OK:
+				PQclear(res);
+				break;
+			case PGRES_COPY_OUT:
+			case PGRES_COPY_IN:
+				PQclear(res);
+				return SLOT_RESULT_COPY;
+			default:
+				fprintf(stderr, "%s", PQresultErrorMessage(res));
+				PQclear(res);
+				return SLOT_RESULT_ERROR;
+		}
+	}
+
+	return SLOT_RESULT_WAIT;
+}
+
+/*
+ * Whether the source of a slot is left unread: while the target does not
+ * keep up, and while the target COPY has not started after the source one
+ * did, so that its rows wait in the socket and not in libpq buffers.
+ */
+static bool
+slot_source_held(CopySlot *slot)
+{
+	return slot->pending || slot->target_flush ||
+		(slot->state == SLOT_STARTING && slot->origin_done);
+}
+
+/* Watch the sockets of a slot for what it waits on */
+static void
+slot_watch(CopySlot *slot, int epfd, int op)
+{
+	struct epoll_event ev;
+
+	ev.data.ptr = slot;
+	ev.events = (slot_source_held(slot) ? 0 : EPOLLIN) | (slot->origin_flush ? EPOLLOUT : 0);
+	if (slot->state == SLOT_IDLE)
+		ev.events = 0;
+	epoll_ctl(epfd, op, PQsocket(slot->origin), &ev);
+
+	ev.data.ptr = slot;
+	ev.events = EPOLLIN | (slot->pending || slot->target_flush ? EPOLLOUT : 0);
+	if (slot->state == SLOT_IDLE)
+		ev.events = 0;
+	epoll_ctl(epfd, op, PQsocket(slot->target), &ev);
+}
+
+/*
+ * Drop the connections of a slot whose task failed.  Closing them rolls the
+ * task back, the slot connects again for its next task.
+ */
+static void
+slot_reset(CopySlot *slot, int epfd)
+{
+	if (slot->origin != NULL && PQsocket(slot->origin) >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, PQsocket(slot->origin), NULL);
+	if (slot->target != NULL && PQsocket(slot->target) >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, PQsocket(slot->target), NULL);
+	PQfinish(slot->origin);
+	PQfinish(slot->target);
+	slot->origin = NULL;
+	slot->target = NULL;
+
+	if (slot->pending)
+		PQfreemem(slot->pending);
+	slot->pending = NULL;
+	slot->origin_flush = false;
+	slot->target_flush = false;
+	slot->task = NULL;
+	slot->state = SLOT_IDLE;
+}
+
+static char *
+slot_table_name(PGconn *conn, Task_hd *task)
+{
+	char	   *nsp = PQescapeIdentifier(conn, task->schemaname, strlen(task->schemaname));
+	char	   *rel = PQescapeIdentifier(conn, task->relname, strlen(task->relname));
+	char	   *result = psprintf("%s.%s", nsp, rel);
+
+	PQfreemem(nsp);
+	PQfreemem(rel);
+
+	return result;
+}
+
+/*
+ * Start a task on a slot, connecting the slot first if it is new.  The
+ * session settings are made once per connection, in blocking mode.
+ */
+static bool
+slot_start(CopySlot *slot, Thread_hd *hd, Task_hd *task, int epfd)
+{
+	PQExpBuffer	query;
+	char	   *table;
+	bool		ok;
+
+	if (slot->origin == NULL)
+	{
+		slot->origin = pglogical_connect(hd->src, EXTENSION_NAME "_copy");
+		slot->target = pglogical_connect(hd->desc, EXTENSION_NAME "_copy");
+		if (slot->origin == NULL || slot->target == NULL)
+		{
+			fprintf(stderr, "init copy slot %d conn failed\n", slot->id);
+			return false;
+		}
+		setup_connection(slot->origin, hd->src_version, hd->src_is_greenplum);
+		setup_connection(slot->target, hd->desc_version, hd->desc_is_greenplum);
+		if (PQsetnonblocking(slot->origin, 1) != 0 || PQsetnonblocking(slot->target, 1) != 0)
+		{
+			fprintf(stderr, "set copy slot %d nonblocking failed\n", slot->id);
+			return false;
+		}
+		slot_watch(slot, epfd, EPOLL_CTL_ADD);
+	}
+
+	slot->task = task;
+	slot->origin_done = false;
+	slot->target_done = false;
+	slot->end_sent = false;
+	slot->unflushed = 0;
+	GETTIMEOFDAY(&slot->before);
+
+	memset(&slot->charge, 0, sizeof(RateCharge));
+	table = psprintf("%s.%s", task->schemaname, task->relname);
+	slot->charge.table = ratelimit_table(rate, table);
+	pfree(table);
+
+	query = createPQExpBuffer();
+	table = slot_table_name(slot->origin, task);
+	appendPQExpBufferStr(query, hd->src_is_greenplum ? "BEGIN;\n" :
+						 "BEGIN TRANSACTION ISOLATION LEVEL REPEATABLE READ, READ ONLY;\n");
+	if (hd->snapshot)
+		appendPQExpBuffer(query, "SET TRANSACTION SNAPSHOT '%s';\n", hd->snapshot);
+	if (task->range_cond)
+		appendPQExpBuffer(query, "COPY (SELECT * FROM %s WHERE %s) TO stdout", table, task->range_cond);
+	else
+		appendPQExpBuffer(query, "COPY %s TO stdout", table);
+	pfree(table);
+	ok = PQsendQuery(slot->origin, query->data) == 1;
+
+	resetPQExpBuffer(query);
+	table = slot_table_name(slot->target, task);
+	appendPQExpBufferStr(query, "BEGIN TRANSACTION ISOLATION LEVEL READ COMMITTED;\n");
+	if (task->truncate)
+	{
+		char	   *sql = fast_load_start_sql(slot->target, task);
+
+		appendPQExpBuffer(query, "%s;\n", sql);
+		pfree(sql);
+	}
+	appendPQExpBuffer(query, "COPY %s FROM stdin%s", table, fast_load_freeze(task) ? " WITH (FREEZE)" : "");
+	pfree(table);
+	ok = ok && PQsendQuery(slot->target, query->data) == 1;
+	destroyPQExpBuffer(query);
+
+	if (!ok)
+	{
+		fprintf(stderr, "start copy of table %s.%s failed: %s%s", task->schemaname, task->relname,
+				PQerrorMessage(slot->origin), PQerrorMessage(slot->target));
+		return false;
+	}
+
+	slot->state = SLOT_STARTING;
+	slot->origin_flush = PQflush(slot->origin) > 0;
+	slot->target_flush = PQflush(slot->target) > 0;
+	slot_watch(slot, epfd, EPOLL_CTL_MOD);
+	return true;
+}
+
+/*
+ * Move rows from origin to target until the origin has no more at hand or
+ * the target does not take more.  Return SLOT_RESULT_DONE at the end of
+ * the source data.
+ */
+static int
+slot_copy_rows(CopySlot *slot, ThreadArg *args)
+{
+	while (1)
+	{
+		int			bytes;
+
+		if (slot->target_flush)
+		{
+			int			rc = PQflush(slot->target);
+
+			if (rc < 0)
+				break;
+			if (rc > 0)
+				return SLOT_RESULT_WAIT;
+			slot->target_flush = false;
+			slot->unflushed = 0;
+		}
+
+		if (slot->pending)
+		{
+			int			rc = PQputCopyData(slot->target, slot->pending, slot->pending_len);
+
+			if (rc < 0)
+				break;
+			if (rc == 0)
+				return SLOT_RESULT_WAIT;
+
+			slot->unflushed += slot->pending_len;
+			PQfreemem(slot->pending);
+			slot->pending = NULL;
+			args->count++;
+			slot->task->count++;
+
+			if (slot->unflushed >= SLOT_FLUSH_BYTES)
+				slot->target_flush = true;
+			continue;
+		}
+
+		bytes = PQgetCopyData(slot->origin, &slot->pending, 1);
+		if (bytes == 0)
+			return SLOT_RESULT_WAIT;
+		if (bytes == -1)
+		{
+			slot->pending = NULL;
+			ratelimit_charge(rate, &slot->charge, 0, 0, true);
+			return SLOT_RESULT_DONE;
+		}
+		if (bytes < -1)
+		{
+			fprintf(stderr, "reading from origin table failed source connection returned %d: %s",
+					bytes, PQerrorMessage(slot->origin));
+			slot->pending = NULL;
+			return SLOT_RESULT_ERROR;
+		}
+		slot->pending_len = bytes;
+
+		/* A sleep here holds up the other slots of the thread as well */
+		ratelimit_charge(rate, &slot->charge, 1, bytes, false);
+	}
+
+	fprintf(stderr, "writing to target table failed destination connection reported: %s",
+			PQerrorMessage(slot->target));
+	return SLOT_RESULT_ERROR;
+}
+
+/*
+ * Take a slot as far as it goes without waiting.  Return false on error.
+ */
+static bool
+slot_advance(CopySlot *slot, ThreadArg *args, int epfd)
+{
+	Task_hd    *task = slot->task;
+	int			rc;
+
+	if ((!slot_source_held(slot) && !PQconsumeInput(slot->origin)) ||
+		!PQconsumeInput(slot->target))
+	{
+		fprintf(stderr, "copy of table %s.%s failed: %s%s", task->schemaname, task->relname,
+				PQerrorMessage(slot->origin), PQerrorMessage(slot->target));
+		return false;
+	}
+
+	if (slot->state == SLOT_STARTING)
+	{
+		if (!slot->origin_done)
+		{
+			rc = slot_results(slot->origin);
+			if (rc == SLOT_RESULT_ERROR || rc == SLOT_RESULT_DONE)
+				goto fail;
+			slot->origin_done = rc == SLOT_RESULT_COPY;
+		}
+		if (!slot->target_done)
+		{
+			rc = slot_results(slot->target);
+			if (rc == SLOT_RESULT_ERROR || rc == SLOT_RESULT_DONE)
+				goto fail;
+			slot->target_done = rc == SLOT_RESULT_COPY;
+		}
+		if (slot->origin_done && slot->target_done)
+		{
+			slot->origin_done = false;
+			slot->target_done = false;
+			slot->state = SLOT_COPYING;
+		}
+	}
+
+	if (slot->state == SLOT_COPYING)
+	{
+		rc = slot_copy_rows(slot, args);
+		if (rc == SLOT_RESULT_ERROR)
+			goto fail;
+		if (rc == SLOT_RESULT_DONE)
+			slot->state = SLOT_ENDING;
+	}
+
+	if (slot->state == SLOT_ENDING)
+	{
+		if (!slot->origin_done)
+		{
+			rc = slot_results(slot->origin);
+			if (rc == SLOT_RESULT_ERROR)
+				goto fail;
+			slot->origin_done = rc == SLOT_RESULT_DONE;
+		}
+		if (!slot->end_sent)
+		{
+			rc = PQputCopyEnd(slot->target, NULL);
+			if (rc < 0)
+				goto fail;
+			slot->end_sent = rc == 1;
+		}
+		if (slot->end_sent && !slot->target_done)
+		{
+			rc = slot_results(slot->target);
+			if (rc == SLOT_RESULT_ERROR)
+				goto fail;
+			slot->target_done = rc == SLOT_RESULT_DONE;
+		}
+		if (slot->origin_done && slot->target_done)
+		{
+			char	   *commit = "COMMIT";
+			char	   *sql = task->truncate ? fast_load_end_sql(slot->target, task) : NULL;
+
+			if (sql != NULL)
+				commit = psprintf("%s;\nCOMMIT", sql);
+			rc = PQsendQuery(slot->origin, "ROLLBACK") == 1 &&
+				PQsendQuery(slot->target, commit) == 1;
+			if (sql != NULL)
+			{
+				pfree(commit);
+				pfree(sql);
+			}
+			if (!rc)
+				goto fail;
+
+			slot->origin_done = false;
+			slot->target_done = false;
+			slot->state = SLOT_COMMITTING;
+		}
+	}
+
+	if (slot->state == SLOT_COMMITTING)
+	{
+		if (!slot->origin_done)
+		{
+			rc = slot_results(slot->origin);
+			if (rc == SLOT_RESULT_ERROR)
+				goto fail;
+			slot->origin_done = rc == SLOT_RESULT_DONE;
+		}
+		if (!slot->target_done)
+		{
+			rc = slot_results(slot->target);
+			if (rc == SLOT_RESULT_ERROR)
+				goto fail;
+			slot->target_done = rc == SLOT_RESULT_DONE;
+		}
+		if (slot->origin_done && slot->target_done)
+		{
+			TimevalStruct after;
+			double		elapsed_msec = 0;
+
+			task->complete = true;
+			GETTIMEOFDAY(&after);
+			DIFF_MSEC(&after, &slot->before, elapsed_msec);
+			if (task->nchunk > 1)
+				fprintf(stderr,"thread %d slot %d migrate task %d table %s.%s chunk %d/%d %ld rows complete, time cost %.3f ms\n",
+						args->id, slot->id, task->id, task->schemaname, task->relname, task->chunk_id + 1,
+						task->nchunk, task->count, elapsed_msec);
+			else
+				fprintf(stderr,"thread %d slot %d migrate task %d table %s.%s %ld rows complete, time cost %.3f ms\n",
+						args->id, slot->id, task->id, task->schemaname, task->relname, task->count, elapsed_msec);
+
+			slot->task = NULL;
+			slot->state = SLOT_IDLE;
+		}
+	}
+
+	if ((rc = PQflush(slot->origin)) < 0)
+		goto fail;
+	slot->origin_flush = rc > 0;
+	if (!slot->target_flush || slot->state != SLOT_COPYING)
+	{
+		if ((rc = PQflush(slot->target)) < 0)
+			goto fail;
+		slot->target_flush = rc > 0;
+	}
+
+	slot_watch(slot, epfd, EPOLL_CTL_MOD);
+	return true;
+
+fail:
+	fprintf(stderr, "copy of table %s.%s failed: %s%s", task->schemaname, task->relname,
+			PQerrorMessage(slot->origin), PQerrorMessage(slot->target));
+	return false;
+}
+
+/*
+ * COPY tables over wire, copies_per_thread of them at a time.  A task that
+ * fails is rolled back on its own, the other slots go on.
+ */
+static void *
+copy_table_data_async(void *arg)
+{
+	ThreadArg  *args = (ThreadArg *) arg;
+	Thread_hd  *hd = args->hd;
+	int			nslot = copies_per_thread;
+	CopySlot   *slots;
+	struct epoll_event *events;
+	int			epfd;
+	int			nactive = 0;
+	bool		no_more_tasks = false;
+	bool		ok = true;
+	bool		failed = false;
+	int			i;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+	{
+		fprintf(stderr, "thread %d create epoll failed: %s\n", args->id, strerror(errno));
+		ThreadExit(0);
+		return NULL;
+	}
+
+	slots = (CopySlot *) palloc0(sizeof(CopySlot) * nslot);
+	events = (struct epoll_event *) palloc0(sizeof(struct epoll_event) * nslot * 2);
+	for (i = 0; i < nslot; i++)
+		slots[i].id = i;
+
+	while (ok)
+	{
+		int			nevent;
+
+		/* Give the idle slots new tasks */
+		for (i = 0; i < nslot && !no_more_tasks; i++)
+		{
+			Task_hd    *task;
+
+			if (slots[i].state != SLOT_IDLE)
+				continue;
+
+			task = next_task(hd);
+			if (task == NULL)
+			{
+				no_more_tasks = true;
+				break;
+			}
+			if (!slot_start(&slots[i], hd, task, epfd))
+			{
+				slot_reset(&slots[i], epfd);
+				failed = true;
+				continue;
+			}
+			nactive++;
+		}
+
+		if (!ok || time_to_abort || (nactive == 0 && no_more_tasks))
+			break;
+		if (nactive == 0)
+			continue;
+
+		nevent = epoll_wait(epfd, events, nslot * 2, -1);
+		if (nevent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "thread %d epoll wait failed: %s\n", args->id, strerror(errno));
+			ok = false;
+			break;
+		}
+
+		for (i = 0; i < nevent && ok; i++)
+		{
+			CopySlot   *slot = (CopySlot *) events[i].data.ptr;
+
+			/* Both sockets of a slot can report in one round */
+			if (slot->state == SLOT_IDLE)
+				continue;
+
+			if (!slot_advance(slot, args, epfd))
+			{
+				slot_reset(slot, epfd);
+				failed = true;
+			}
+			if (slot->state == SLOT_IDLE)
+				nactive--;
+		}
+	}
+
+	if (ok && !failed && !time_to_abort)
+		args->all_ok = true;
+
+	/* Closing the connections rolls back the tasks left unfinished */
+	for (i = 0; i < nslot; i++)
+	{
+		if (slots[i].pending)
+			PQfreemem(slots[i].pending);
+		PQfinish(slots[i].origin);
+		PQfinish(slots[i].target);
+	}
+	close(epfd);
+	pfree(events);
+	pfree(slots);
+
 	ThreadExit(0);
 	return NULL;
 }
+#endif
 
 
 int 
@@ -251,6 +1131,7 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 	long		s_count = 0;
 	long		t_count = 0;
 	bool		have_err = false;
+	bool		rebuild_failed = false;
 	TimevalStruct before,
 					after; 
 	double		elapsed_msec = 0;
@@ -263,6 +1144,7 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 	char	*decoder_start = NULL;
 	char	*apply_id = NULL;
 	int		ntask = 0;
+	int		nsegment = 0;
 
 #ifndef WIN32
 		signal(SIGINT, sigint_handler);
@@ -273,6 +1155,15 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 	memset(&th_hd, 0, sizeof(Thread_hd));
 	th_hd.nth = nthread;
 	th_hd.src = src;
+
+	/* Threads up to the maximum are started, the flow control runs some of them */
+	if (flow_max_workers > 0 && copies_per_thread > 1)
+	{
+		fprintf(stderr, "adaptive workers do not apply to event loop copy, run %d threads\n", nthread);
+		flow_max_workers = 0;
+	}
+	if (flow_max_workers > 0)
+		th_hd.nth = flow_max_workers;
 	th_hd.desc = desc;
 	th_hd.local = local;
 
@@ -293,7 +1184,56 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 	}
 	th_hd.desc_version = PQserverVersion(desc_conn);
 	th_hd.desc_is_greenplum = is_greenplum(desc_conn);
-	PQfinish(desc_conn);
+
+	/* COPY FREEZE came with 9.3, ALTER TABLE SET LOGGED with 9.5 */
+	if (fast_load && (th_hd.desc_is_greenplum || th_hd.desc_version < 90300))
+	{
+		fprintf(stderr, "fast load needs PostgreSQL 9.3 or later on target, copy data as usual\n");
+		fast_load = false;
+	}
+	if (fast_load_unlogged && (!fast_load || th_hd.desc_version < 90500))
+	{
+		if (fast_load)
+			fprintf(stderr, "unlogged load needs PostgreSQL 9.5 or later on target, tables stay logged\n");
+		fast_load_unlogged = false;
+	}
+
+	/* ADD CONSTRAINT USING INDEX came with 9.1 */
+	if (rebuild_workers > 0 && (th_hd.desc_is_greenplum || th_hd.desc_version < 90100))
+	{
+		fprintf(stderr, "deferred index build needs PostgreSQL 9.1 or later on target, indexes are kept during the copy\n");
+		rebuild_workers = 0;
+	}
+
+	/* Binary COPY data is only exchanged between servers of one major version */
+	if (binary_copy && (th_hd.src_is_greenplum || th_hd.desc_is_greenplum || th_hd.src_version < 90000 ||
+						MAJOR_VERSION(th_hd.src_version) != MAJOR_VERSION(th_hd.desc_version)))
+	{
+		fprintf(stderr, "binary copy needs the same PostgreSQL major version on source and target, copy data as text\n");
+		binary_copy = false;
+	}
+
+	if (gpfdist_address != NULL)
+	{
+		if (!th_hd.desc_is_greenplum)
+			fprintf(stderr, "target db is not greenplum, copy data through COPY\n");
+		else if ((gpfdist_server = gpfdist_start(gpfdist_address)) == NULL)
+			return 1;
+	}
+
+#ifdef HAVE_COPY_EVENT_LOOP
+	if (copies_per_thread > 1 && (fan_out > 1 || binary_copy || gpfdist_server != NULL))
+	{
+		fprintf(stderr, "event loop copy does not combine with -k, -B or -g, copy one table per thread\n");
+		copies_per_thread = 1;
+	}
+#else
+	if (copies_per_thread > 1)
+	{
+		fprintf(stderr, "event loop copy needs epoll, copy one table per thread\n");
+		copies_per_thread = 1;
+	}
+#endif
 
 	local_conn = pglogical_connect(local, EXTENSION_NAME "_main");
 	if (local_conn == NULL)
@@ -304,6 +1244,7 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 	else
 	{
 		ExecuteSqlStatement(local_conn, "CREATE TABLE IF NOT EXISTS sync_sqls(id bigserial, sql text)");
+		ExecuteSqlStatement(local_conn, "CREATE TABLE IF NOT EXISTS sync_stream_sqls(id bigserial, xid bigint, subxid bigint, sql text)");
 		ExecuteSqlStatement(local_conn, "CREATE TABLE IF NOT EXISTS db_sync_status(id bigserial primary key, full_s_start timestamp DEFAULT NULL, full_s_end timestamp DEFAULT NULL, decoder_start timestamp DEFAULT NULL, apply_id bigint DEFAULT NULL)");
 		ExecuteSqlStatement(local_conn, "insert into db_sync_status (id) values (" TASK_ID ");");
 		get_task_status(local_conn, &full_start, &full_end, &decoder_start, &apply_id);
@@ -344,6 +1285,7 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 
 			hander = init_hander();
 			hander->connection_string = src;
+			hander->pgoutput = publication_names != NULL;
 			init_logfile(hander);
 			rc = initialize_connection(hander);
 			if(rc != 0)
@@ -403,10 +1345,12 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 			if (th_hd.src_version >= 90200)
 			{
 				snapshot = get_synchronized_snapshot(origin_conn_repl);
-				th_hd.snapshot = snapshot;
 			}
 		}
 
+		/* Every copy thread imports the same snapshot */
+		th_hd.snapshot = snapshot;
+
 		appendPQExpBuffer(query, ALL_DB_TABLE_SQL);
 		res = PQexec(origin_conn_repl, query->data);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
@@ -415,23 +1359,116 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 			return 1;
 		}
 
-		ntask = PQntuples(res);
+		if (segment_group > 0 && !th_hd.src_is_greenplum)
+		{
+			fprintf(stderr, "source db is not greenplum, tables are not split by segment\n");
+			segment_group = 0;
+		}
+		if (segment_group > 0)
+		{
+			nsegment = get_segment_count(origin_conn_repl);
+			if (nsegment <= 0)
+				return 1;
+			fprintf(stderr, "source greenplum has %d segments, copy %d of them per task\n",
+					nsegment, Min(segment_group, nsegment));
+		}
+		else if (chunk_pages > 0 && (th_hd.src_is_greenplum || th_hd.src_version < 140000))
+		{
+			fprintf(stderr, "ctid range scan needs PostgreSQL 14 or later on source, copy every table as a whole\n");
+			chunk_pages = 0;
+		}
+
+		/*
+		 * A table with more than chunk_pages pages is copied as several ctid
+		 * block ranges, each of them a task of its own.  The first and last
+		 * range are left open so pages added after relpages was computed are
+		 * still copied.  On a greenplum source the chunks are groups of
+		 * segments instead, each of them read by its own COPY.
+		 */
+		ntask = 0;
+		for (i = 0; i < PQntuples(res); i++)
+			ntask += table_chunk_count(atol(PQgetvalue(res, i, 2)), nsegment);
+
 		th_hd.ntask = ntask;
 		if (th_hd.ntask >= 1)
 		{
 			th_hd.task = (Task_hd *)palloc0(sizeof(Task_hd) * th_hd.ntask);
 		}
 
-		for (i = 0; i < th_hd.ntask; i++)
+		ntask = 0;
+		for (i = 0; i < PQntuples(res); i++)
+		{
+			char	*schemaname = pstrdup(PQgetvalue(res, i, 0));
+			char	*relname = pstrdup(PQgetvalue(res, i, 1));
+			long	relpages = atol(PQgetvalue(res, i, 2));
+			int		nchunk = table_chunk_count(relpages, nsegment);
+			int		j;
+
+			for (j = 0; j < nchunk; j++)
+			{
+				Task_hd	*task = &th_hd.task[ntask];
+
+				task->id = ntask;
+				task->schemaname = schemaname;
+				task->relname = relname;
+				task->count = 0;
+				task->complete = false;
+				if (nchunk > 1 && nsegment > 0)
+				{
+					int		first = j * segment_group;
+					int		last = Min(first + segment_group, nsegment) - 1;
+
+					if (first == last)
+						task->range_cond = psprintf("gp_segment_id = %d", first);
+					else
+						task->range_cond = psprintf("gp_segment_id BETWEEN %d AND %d", first, last);
+					task->chunk_id = j;
+					task->nchunk = nchunk;
+				}
+				else if (nchunk > 1)
+				{
+					if (j == 0)
+						task->range_cond = psprintf("ctid < '(%ld,0)'", (long) chunk_pages);
+					else if (j == nchunk - 1)
+						task->range_cond = psprintf("ctid >= '(%ld,0)'", (long) chunk_pages * j);
+					else
+						task->range_cond = psprintf("ctid >= '(%ld,0)' AND ctid < '(%ld,0)'",
+													(long) chunk_pages * j, (long) chunk_pages * (j + 1));
+					task->chunk_id = j;
+					task->nchunk = nchunk;
+				}
+				if (ntask != th_hd.ntask - 1)
+				{
+					task->next = &th_hd.task[ntask + 1];
+				}
+				ntask++;
+			}
+		}
+
+		/* Dropping the foreign keys first also lets the tables be truncated */
+		if (rebuild_workers > 0 && ntask > 0 &&
+			!rebuild_defer(desc_conn, th_hd.task, ntask))
 		{
-			th_hd.task[i].id = i;
-			th_hd.task[i].schemaname = pstrdup(PQgetvalue(res, i, 0));
-			th_hd.task[i].relname = pstrdup(PQgetvalue(res, i, 1));
-			th_hd.task[i].count = 0;
-			th_hd.task[i].complete = false;
-			if (i != th_hd.ntask - 1)
+			PQfinish(desc_conn);
+			return 1;
+		}
+
+		if (fast_load && ntask > 0)
+			plan_fast_load(desc_conn, th_hd.task, ntask, fast_load_unlogged);
+
+		/* The writers of a task cannot all be in the truncating transaction */
+		if (fast_load && fan_out > 1 && gpfdist_server == NULL)
+		{
+			fprintf(stderr, "tables written by %d connections are truncated before the copy, without FREEZE%s\n",
+					fan_out, fast_load_unlogged ? ", and are not loaded unlogged" : "");
+			for (i = 0; i < ntask; i++)
 			{
-				th_hd.task[i].next = &th_hd.task[i+1];
+				if (th_hd.task[i].truncate)
+				{
+					th_hd.task[i].unlogged = false;
+					fast_load_prepare(desc_conn, &th_hd.task[i]);
+					th_hd.task[i].truncate = false;
+				}
 			}
 		}
 
@@ -446,100 +1483,305 @@ db_sync_main(char *src, char *desc, char *local, int nthread)
 			th_hd.th[i].count = 0;
 			th_hd.th[i].all_ok = false;
 
-			th_hd.th[i].hd = &th_hd;
-		}
-		pthread_mutex_init(&th_hd.t_lock, NULL);
+			th_hd.th[i].hd = &th_hd;
+		}
+		pthread_mutex_init(&th_hd.t_lock, NULL);
+
+		fprintf(stderr, "starting full sync");
+		if (snapshot)
+		{
+			fprintf(stderr, " with snapshot %s", snapshot);
+		}
+		fprintf(stderr, "\n");
+
+		rate = ratelimit_start(RATELIMIT_CONFIG);
+		if (flow_max_workers > 0)
+			flow = flowctl_start(flow_min_workers, flow_max_workers, nthread);
+
+		thread = (Thread *)palloc0(sizeof(Thread) * th_hd.nth);
+		for (i = 0; i < th_hd.nth; i++)
+		{
+#ifdef HAVE_COPY_EVENT_LOOP
+			if (copies_per_thread > 1)
+			{
+				ThreadCreate(&thread[i], copy_table_data_async, &th_hd.th[i]);
+				continue;
+			}
+#endif
+			ThreadCreate(&thread[i], copy_table_data, &th_hd.th[i]);
+		}
+
+		update_task_status(local_conn, true, false, false, -1);
+	}
+	PQfinish(desc_conn);
+	
+	if (replication_sync)
+	{
+		decoder = (Thread *)palloc0(sizeof(Thread) * 2);
+		fprintf(stderr, "starting logical decoding sync thread\n");
+		ThreadCreate(&decoder[0], logical_decoding_receive_thread, &th_hd);
+		update_task_status(local_conn, false, false, true, -1);
+	}
+		
+	if (need_full_sync)
+	{
+		WaitThreadEnd(th_hd.nth, thread);
+		if (flow != NULL)
+			flowctl_stop(flow);
+		if (gpfdist_server != NULL)
+		{
+			gpfdist_stop(gpfdist_server);
+			gpfdist_server = NULL;
+		}
+		update_task_status(local_conn, false, true, false, -1);
+
+		GETTIMEOFDAY(&after);
+		DIFF_MSEC(&after, &before, elapsed_msec);
+
+		for (i = 0; i < th_hd.nth; i++)
+		{
+			if(th_hd.th[i].all_ok)
+			{
+				s_count += th_hd.th[i].count;
+			}
+			else
+			{
+				have_err = true;
+			}
+		}
+
+		for (i = 0; i < ntask; i++)
+		{
+			t_count += th_hd.task[i].count;
+		}
+
+		fprintf(stderr, "job migrate row %ld task row %ld \n", s_count, t_count);
+		fprintf(stderr, "full sync time cost %.3f ms\n", elapsed_msec);
+		if (have_err)
+		{
+			fprintf(stderr, "migration process with errors\n");
+		}
+
+		if (rebuild_workers > 0)
+		{
+			if (have_err)
+				fprintf(stderr, "indexes are not rebuilt after errors, they are kept in table %s\n", REBUILD_TABLE);
+			else
+				rebuild_failed = !rebuild_run(desc, rebuild_workers, rebuild_work_mem);
+		}
+	}
+
+	if (replication_sync)
+	{
+		ThreadCreate(&decoder[1], logical_decoding_apply_thread, &th_hd);
+		fprintf(stderr, "starting decoder apply thread\n");
+		WaitThreadEnd(2, decoder);
+	}
+	
+	PQfinish(origin_conn_repl);
+	PQfinish(local_conn);
+
+	return rebuild_failed ? 1 : 0;
+}
+
+
+static char *
+get_synchronized_snapshot(PGconn *conn)
+{
+	char	   *query = "SELECT pg_export_snapshot()";
+	char	   *result;
+	PGresult   *res;
+
+	res = PQexec(conn, query);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "init sql run failed: %s", PQresultErrorMessage(res));
+		return NULL;
+	}
+	result = pstrdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	return result;
+}
+
+/* Column types of a table, as a result of COLUMN_TYPES_SQL, NULL on error */
+static PGresult *
+get_column_types(PGconn *conn, char *nspname, char *relname)
+{
+	char	   *nsp = PQescapeIdentifier(conn, nspname, strlen(nspname));
+	char	   *rel = PQescapeIdentifier(conn, relname, strlen(relname));
+	char	   *qualified = psprintf("%s.%s", nsp, rel);
+	char	   *literal = PQescapeLiteral(conn, qualified, strlen(qualified));
+	char	   *query = psprintf(COLUMN_TYPES_SQL, literal);
+	PGresult   *res;
+
+	res = PQexec(conn, query);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "get column types of table %s failed: %s", qualified, PQerrorMessage(conn));
+		PQclear(res);
+		res = NULL;
+	}
+
+	pfree(query);
+	PQfreemem(literal);
+	pfree(qualified);
+	PQfreemem(rel);
+	PQfreemem(nsp);
+
+	return res;
+}
+
+/*
+ * Whether a table can be copied in binary format: its columns must have
+ * the same types and typmods on both sides, and all of them built in.  The
+ * binary form of arrays and composites carries type oids, which only
+ * built in types have the same in two databases.
+ */
+static bool
+binary_copy_compatible(PGconn *origin_conn, PGconn *target_conn, char *nspname, char *relname)
+{
+	PGresult   *origin_res = get_column_types(origin_conn, nspname, relname);
+	PGresult   *target_res = get_column_types(target_conn, nspname, relname);
+	bool		compatible = false;
+	int			i;
+
+	if (origin_res == NULL || target_res == NULL ||
+		PQntuples(origin_res) != PQntuples(target_res))
+		goto exit;
+
+	for (i = 0; i < PQntuples(origin_res); i++)
+	{
+		if (atooid(PQgetvalue(origin_res, i, 0)) >= FirstNormalObjectId ||
+			strcmp(PQgetvalue(origin_res, i, 0), PQgetvalue(target_res, i, 0)) != 0 ||
+			strcmp(PQgetvalue(origin_res, i, 1), PQgetvalue(target_res, i, 1)) != 0)
+			goto exit;
+	}
+	compatible = true;
+
+exit:
+	if (!compatible)
+		fprintf(stderr, "column types of table %s.%s differ or are not built in, copy it as text\n",
+				nspname, relname);
+	PQclear(origin_res);
+	PQclear(target_res);
+
+	return compatible;
+}
+
+/*
+ * Write one message of binary COPY data to the writers of a task.  The
+ * header comes in front of the first row and the trailer as a message of
+ * its own, each writer's COPY needs both of them.  Return the number of
+ * rows written, -1 on error.
+ */
+static int
+put_binary_copy_data(PGconn **writers, int nwriter, Task_hd *task, bool first, char *data, int len)
+{
+	int			w;
+
+	if (first)
+	{
+		const unsigned char *p = (const unsigned char *) data;
+		uint32		extlen;
+		int			hlen;
 
-		fprintf(stderr, "starting full sync");
-		if (snapshot)
+		if (len < BINARY_HEADER_LEN || memcmp(data, BINARY_SIGNATURE, BINARY_SIGNATURE_LEN) != 0)
 		{
-			fprintf(stderr, " with snapshot %s", snapshot);
+			fprintf(stderr, "invalid binary copy header from table %s\n", task->relname);
+			return -1;
 		}
-		fprintf(stderr, "\n");
-
-		thread = (Thread *)palloc0(sizeof(Thread) * th_hd.nth);
-		for (i = 0; i < th_hd.nth; i++)
+		extlen = ((uint32) p[15] << 24) | ((uint32) p[16] << 16) | ((uint32) p[17] << 8) | p[18];
+		if (extlen > (uint32) (len - BINARY_HEADER_LEN))
 		{
-			ThreadCreate(&thread[i], copy_table_data, &th_hd.th[i]);
+			fprintf(stderr, "invalid binary copy header from table %s\n", task->relname);
+			return -1;
 		}
+		hlen = BINARY_HEADER_LEN + extlen;
 
-		update_task_status(local_conn, true, false, false, -1);
-	}
-	
-	if (replication_sync)
-	{
-		decoder = (Thread *)palloc0(sizeof(Thread) * 2);
-		fprintf(stderr, "starting logical decoding sync thread\n");
-		ThreadCreate(&decoder[0], logical_decoding_receive_thread, &th_hd);
-		update_task_status(local_conn, false, false, true, -1);
-	}
-		
-	if (need_full_sync)
-	{
-		WaitThreadEnd(th_hd.nth, thread);
-		update_task_status(local_conn, false, true, false, -1);
-
-		GETTIMEOFDAY(&after);
-		DIFF_MSEC(&after, &before, elapsed_msec);
-
-		for (i = 0; i < th_hd.nth; i++)
+		for (w = 0; w < nwriter; w++)
 		{
-			if(th_hd.th[i].all_ok)
-			{
-				s_count += th_hd.th[i].count;
-			}
-			else
+			if (PQputCopyData(writers[w], data, hlen) != 1)
 			{
-				have_err = true;
+				fprintf(stderr,"writing to target table failed destination connection reported: %s",
+						PQerrorMessage(writers[w]));
+				return -1;
 			}
 		}
+		data += hlen;
+		len -= hlen;
+		if (len == 0)
+			return 0;
+	}
 
-		for (i = 0; i < ntask; i++)
-		{
-			t_count += th_hd.task[i].count;
-		}
-
-		fprintf(stderr, "job migrate row %ld task row %ld \n", s_count, t_count);
-		fprintf(stderr, "full sync time cost %.3f ms\n", elapsed_msec);
-		if (have_err)
+	/* A field count of -1 is the trailer, no row has it */
+	if (len == 2 && (unsigned char) data[0] == 0xff && (unsigned char) data[1] == 0xff)
+	{
+		for (w = 0; w < nwriter; w++)
 		{
-			fprintf(stderr, "migration process with errors\n");
+			if (PQputCopyData(writers[w], data, len) != 1)
+			{
+				fprintf(stderr,"writing to target table failed destination connection reported: %s",
+						PQerrorMessage(writers[w]));
+				return -1;
+			}
 		}
+		return 0;
 	}
 
-	if (replication_sync)
+	w = task->count % nwriter;
+	if (PQputCopyData(writers[w], data, len) != 1)
 	{
-		ThreadCreate(&decoder[1], logical_decoding_apply_thread, &th_hd);
-		fprintf(stderr, "starting decoder apply thread\n");
-		WaitThreadEnd(2, decoder);
+		fprintf(stderr,"writing to target table failed destination connection reported: %s",
+				PQerrorMessage(writers[w]));
+		return -1;
 	}
-	
-	PQfinish(origin_conn_repl);
-	PQfinish(local_conn);
 
-	return 0;
+	return 1;
 }
 
-
-static char *
-get_synchronized_snapshot(PGconn *conn)
+/* Number of primary segments of a greenplum db, -1 on error */
+static int
+get_segment_count(PGconn *conn)
 {
-	char	   *query = "SELECT pg_export_snapshot()";
-	char	   *result;
+	char	   *query = "SELECT count(*) FROM gp_segment_configuration WHERE role = 'p' AND content >= 0";
+	int			result;
 	PGresult   *res;
 
 	res = PQexec(conn, query);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
-		fprintf(stderr, "init sql run failed: %s", PQresultErrorMessage(res));
-		return NULL;
+		fprintf(stderr, "get segment count failed: %s", PQresultErrorMessage(res));
+		PQclear(res);
+		return -1;
 	}
-	result = pstrdup(PQgetvalue(res, 0, 0));
+	result = atoi(PQgetvalue(res, 0, 0));
 	PQclear(res);
 
 	return result;
 }
 
+/*
+ * Number of tasks a table is copied by.  With nsegment, every table larger
+ * than chunk_pages, or every table if it is 0, is split by segment; the
+ * relpages of a greenplum master are only a hint.
+ */
+static int
+table_chunk_count(long relpages, int nsegment)
+{
+	if (nsegment > 0)
+	{
+		if (chunk_pages == 0 || relpages > chunk_pages)
+			return (nsegment + segment_group - 1) / segment_group;
+		return 1;
+	}
+
+	if (chunk_pages > 0 && relpages > chunk_pages)
+		return (relpages + chunk_pages - 1) / chunk_pages;
+
+	return 1;
+}
+
 static bool
 is_slot_exists(PGconn *conn, char *slotname)
 {
@@ -665,14 +1907,11 @@ logical_decoding_receive_thread(void *arg)
 	int		rc = 0;
 	bool	init = false;
 	PGconn *local_conn;
-	PQExpBuffer buffer;
     char    *stmtname = "insert_sqls";
     Oid     type[1];
-	const char *paramValues[1];
 	PGresult *res = NULL;
 
     type[0] = 25;
-	buffer = createPQExpBuffer();
 
 	local_conn = pglogical_connect(hd->local, EXTENSION_NAME "_decoding");
 	if (local_conn == NULL)
@@ -693,6 +1932,10 @@ logical_decoding_receive_thread(void *arg)
 
 	hander = init_hander();
 	hander->connection_string = hd->src;
+	hander->relation_cache = relation_cache;
+	hander->binary_values = binary_values;
+	hander->pgoutput = publication_names != NULL;
+	hander->publication_names = publication_names;
 	init_logfile(hander);
 	rc = check_handler_parameters(hander);
 	if(rc != 0)
@@ -710,93 +1953,475 @@ logical_decoding_receive_thread(void *arg)
 	init_streaming(hander);
 	init = true;
 
-	while (true)
+	while (!time_to_abort)
 	{
-		ALI_PG_DECODE_MESSAGE *msg = NULL;
+		DecodePipeline *pipe;
+		StringInfoData s;
+
+		if (!init)
+		{
+			/* Received changes beyond the staged ones were dropped, get them again */
+			hander->startpos = hander->flushpos;
+			initialize_connection(hander);
+			init_streaming(hander);
+			init = true;
+		}
+
+		/* The server sends again what was not confirmed */
+		if (!reset_staging(local_conn, hander->streaming))
+		{
+			time_to_abort = true;
+			break;
+		}
+
+		/* Every feedback, keepalive replies too, confirms what is staged */
+		pipe = decode_pipeline_start(hander, local_conn, stmtname, decode_workers);
+		hander->get_flushpos = decode_pipeline_flushpos;
+		hander->flushpos_arg = pipe;
+		while (exec_logical_receive(hander, &time_to_abort, &s))
+		{
+			if (!decode_pipeline_put(pipe, &s, hander->recvpos))
+				break;
+		}
+		hander->get_flushpos = NULL;
+		hander->flushpos_arg = NULL;
+		hander->flushpos = Max(hander->flushpos, decode_pipeline_finish(pipe));
 
 		if (time_to_abort)
+			break;
+
+		if (hander->conn != NULL)
 		{
-			if (hander->copybuf != NULL)
-			{
-				PQfreemem(hander->copybuf);
-				hander->copybuf = NULL;
-			}
-			if (hander->conn)
-			{
-				PQfinish(hander->conn);
-				hander->conn = NULL;
-			}
-			if (local_conn)
+			PQfinish(hander->conn);
+			hander->conn = NULL;
+		}
+		fprintf(stderr, "decoding receive no record, sleep and reconnect");
+		pg_sleep(RECONNECT_SLEEP_TIME * 1000000);
+		init = false;
+	}
+
+	if (hander->copybuf != NULL)
+	{
+		PQfreemem(hander->copybuf);
+		hander->copybuf = NULL;
+	}
+	if (hander->conn)
+	{
+		PQfinish(hander->conn);
+		hander->conn = NULL;
+	}
+	if (local_conn)
+	{
+		PQdescribePrepared(local_conn, stmtname);
+		PQfinish(local_conn);
+	}
+
+exit:
+
+	ThreadExit(0);
+	return NULL;
+}
+
+static DecodePipeline *
+decode_pipeline_start(Decoder_handler *hander, PGconn *local_conn, const char *stmtname, int nworkers)
+{
+	DecodePipeline *pipe = (DecodePipeline *) palloc0(sizeof(DecodePipeline));
+	int		i;
+
+	pipe->hander = hander;
+	pipe->local_conn = local_conn;
+	pipe->stmtname = stmtname;
+	pipe->nworkers = Max(nworkers, 1);
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->decoded, NULL);
+
+	queue_init(&pipe->decode, DECODE_PIPELINE_DEPTH);
+	queue_init(&pipe->order, DECODE_PIPELINE_DEPTH);
+	queue_init(&pipe->free, DECODE_PIPELINE_DEPTH);
+	for (i = 0; i < DECODE_PIPELINE_DEPTH; i++)
+	{
+		initStringInfo(&pipe->changes[i].data);
+		pipe->changes[i].sql = createPQExpBuffer();
+		queue_push(&pipe->free, &pipe->changes[i]);
+	}
+
+	pipe->workers = (Thread *) palloc0(sizeof(Thread) * pipe->nworkers);
+	for (i = 0; i < pipe->nworkers; i++)
+		ThreadCreate(&pipe->workers[i], decode_pipeline_decode, pipe);
+	ThreadCreate(&pipe->writer, decode_pipeline_write, pipe);
+
+	return pipe;
+}
+
+/*
+ * Queue a received message, waiting while the pipeline is full.  Returns
+ * false once a stage failed.
+ */
+static bool
+decode_pipeline_put(DecodePipeline *pipe, StringInfo s, XLogRecPtr recvpos)
+{
+	Decoder_handler *hander = pipe->hander;
+	DecodeChange *change;
+	char	action;
+
+	if (pipe->failed || s->cursor >= s->len)
+		return !pipe->failed;
+
+	action = s->data[s->cursor];
+	if (action == MSGKIND_RELATION || (hander->pgoutput && action == MSGKIND_TYPE))
+	{
+		bool	rc;
+
+		/* Decoded against the relations as they were before */
+		pthread_mutex_lock(&pipe->lock);
+		while (pipe->pending > 0 && !pipe->failed)
+			pthread_cond_wait(&pipe->decoded, &pipe->lock);
+		pthread_mutex_unlock(&pipe->lock);
+
+		decode_message_reset(&pipe->msg, &pipe->arena);
+		pipe->msg.relcache = hander->relcache;
+		if (hander->pgoutput)
+		{
+			pipe->msg.stream = &pipe->stream;
+			rc = pgoutput_process_action(s, &pipe->msg);
+		}
+		else
+			rc = bdr_process_remote_action(s, &pipe->msg);
+		if (!rc)
+			pipe->failed = true;
+
+		return rc;
+	}
+
+	/* Changes between Stream Start and Stop start with an xid */
+	if (hander->pgoutput && action == MSGKIND_STREAM_START && s->len - s->cursor >= 5)
+	{
+		StringInfoData peek = *s;
+
+		pq_getmsgbyte(&peek);
+		pipe->stream.active = true;
+		pipe->stream.xid = pq_getmsgint(&peek, 4);
+	}
+	else if (hander->pgoutput && action == MSGKIND_STREAM_STOP)
+		pipe->stream.active = false;
+
+	change = (DecodeChange *) queue_pop(&pipe->free);
+	if (change == NULL)
+		return false;
+
+	change->seq = pipe->next_seq++;
+	change->recvpos = recvpos;
+	change->stream = pipe->stream;
+	change->decoded = false;
+	change->failed = false;
+	resetStringInfo(&change->data);
+	appendBinaryStringInfo(&change->data, s->data + s->cursor, s->len - s->cursor);
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->pending++;
+	pthread_mutex_unlock(&pipe->lock);
+
+	queue_push(&pipe->order, change);
+	queue_push(&pipe->decode, change);
+
+	return !pipe->failed;
+}
+
+/* Position up to which the changes are staged, to confirm to the server */
+static XLogRecPtr
+decode_pipeline_flushpos(void *arg)
+{
+	DecodePipeline *pipe = (DecodePipeline *) arg;
+	XLogRecPtr	flushpos;
+
+	pthread_mutex_lock(&pipe->lock);
+	flushpos = pipe->flushpos;
+	pthread_mutex_unlock(&pipe->lock);
+
+	return flushpos;
+}
+
+/*
+ * Stop the pipeline when the stream ends.  Changes still in it are dropped,
+ * the server sends them again.  Returns the position staged up to.
+ */
+static XLogRecPtr
+decode_pipeline_finish(DecodePipeline *pipe)
+{
+	XLogRecPtr	flushpos;
+	int		i;
+
+	pipe->stopping = true;
+	queue_close(&pipe->decode);
+	WaitThreadEnd(pipe->nworkers, pipe->workers);
+	queue_close(&pipe->order);
+	WaitThreadEnd(1, &pipe->writer);
+
+	flushpos = pipe->flushpos;
+	for (i = 0; i < DECODE_PIPELINE_DEPTH; i++)
+	{
+		pfree(pipe->changes[i].data.data);
+		destroyPQExpBuffer(pipe->changes[i].sql);
+	}
+	queue_destroy(&pipe->decode);
+	queue_destroy(&pipe->order);
+	queue_destroy(&pipe->free);
+	if (pipe->arena.block != NULL)
+		pfree(pipe->arena.block);
+	pfree(pipe->workers);
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->decoded);
+	pfree(pipe);
+
+	return flushpos;
+}
+
+/* Decode worker: decode changes and render their SQL, in any order */
+static void *
+decode_pipeline_decode(void *arg)
+{
+	DecodePipeline *pipe = (DecodePipeline *) arg;
+	Decoder_handler *hander = pipe->hander;
+	ALI_PG_DECODE_MESSAGE msg;
+	DecodeArena arena;
+	DecodeChange *change;
+
+	memset(&arena, 0, sizeof(DecodeArena));
+	while ((change = (DecodeChange *) queue_pop(&pipe->decode)) != NULL)
+	{
+		bool	rc = false;
+
+		resetPQExpBuffer(change->sql);
+		if (!pipe->failed && !pipe->stopping)
+		{
+			decode_message_reset(&msg, &arena);
+			msg.relcache = hander->relcache;
+			if (hander->pgoutput)
 			{
-				PQdescribePrepared(local_conn, stmtname);
-				PQfinish(local_conn);
+				msg.stream = &change->stream;
+				rc = pgoutput_process_action(&change->data, &msg);
 			}
-			break;
+			else
+				rc = bdr_process_remote_action(&change->data, &msg);
 		}
 
-		if (!init)
+		if (rc)
 		{
-			initialize_connection(hander);
-			init_streaming(hander);
-			init = true;
+			change->type = msg.type;
+			change->streamed = msg.streamed;
+			change->xid = msg.xid;
+			change->subxid = msg.subxid;
+			if (msg.type != MSGKIND_UNKNOWN && msg.type != MSGKIND_RELATION && msg.type != MSGKIND_TYPE)
+				out_put_tuple_to_sql(hander, &msg, change->sql);
+		}
+		else
+		{
+			if (!pipe->failed && !pipe->stopping)
+				fprintf(stderr, "decode change %lu failed\n", (unsigned long) change->seq);
+			change->failed = true;
+			pipe->failed = true;
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		change->decoded = true;
+		pipe->pending--;
+		pthread_cond_broadcast(&pipe->decoded);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+
+	decode_message_reset(&msg, &arena);
+	if (arena.block != NULL)
+		pfree(arena.block);
+
+	ThreadExit(0);
+	return NULL;
+}
+
+/*
+ * Staging writer: stage the SQL of the changes in the order they came, one
+ * local transaction per source transaction.
+ */
+static void *
+decode_pipeline_write(void *arg)
+{
+	DecodePipeline *pipe = (DecodePipeline *) arg;
+	PGconn	   *local_conn = pipe->local_conn;
+	DecodeChange *change;
+	PGresult   *res = NULL;
+
+	while ((change = (DecodeChange *) queue_pop(&pipe->order)) != NULL)
+	{
+		const char *paramValues[1];
+		bool		staged = false;
+
+		pthread_mutex_lock(&pipe->lock);
+		while (!change->decoded)
+			pthread_cond_wait(&pipe->decoded, &pipe->lock);
+		pthread_mutex_unlock(&pipe->lock);
+
+		if (change->failed || pipe->failed || pipe->stopping)
+		{
+			queue_push(&pipe->free, change);
+			continue;
 		}
 
-		msg = exec_logical_decoder(hander, &time_to_abort);
-		if (msg != NULL)
+		if (change->streamed || change->type == MSGKIND_STREAM_START ||
+			change->type == MSGKIND_STREAM_STOP || change->type == MSGKIND_STREAM_COMMIT ||
+			change->type == MSGKIND_STREAM_ABORT)
+		{
+			if (!spool_stream_message(local_conn, change))
+				goto fail;
+
+			/* Only a commit is done with, the rest is sent again on reconnect */
+			staged = change->type == MSGKIND_STREAM_COMMIT;
+		}
+		else if (change->type != MSGKIND_UNKNOWN)
 		{
-			out_put_tuple_to_sql(hander, msg, buffer);
-			if(msg->type == MSGKIND_BEGIN)
+			if(change->type == MSGKIND_BEGIN)
 			{
 				res = PQexec(local_conn, "BEGIN");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK)
 				{
 					fprintf(stderr, "decoding receive thread begin a local trans failed: %s", PQerrorMessage(local_conn));
-					goto exit;
+					goto fail;
 				}
 				PQclear(res);
 			}
 
-			paramValues[0] = buffer->data;
-			res = PQexecPrepared(local_conn, stmtname, 1, paramValues, NULL, NULL, 1);
+			paramValues[0] = change->sql->data;
+			res = PQexecPrepared(local_conn, pipe->stmtname, 1, paramValues, NULL, NULL, 1);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK)
 			{
 				fprintf(stderr, "exec prepare INSERT INTO sync_sqls failed: %s", PQerrorMessage(local_conn));
-				time_to_abort = true;
-				goto exit;
+				goto fail;
 			}
 			PQclear(res);
 
-			hander->flushpos = hander->recvpos;
-			if(msg->type == MSGKIND_COMMIT)
+			if(change->type == MSGKIND_COMMIT)
 			{
 				res = PQexec(local_conn, "END");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK)
 				{
 					fprintf(stderr, "decoding receive thread commit a local trans failed: %s", PQerrorMessage(local_conn));
-					goto exit;
+					goto fail;
 				}
 				PQclear(res);
 			}
-
-			resetPQExpBuffer(buffer);
+			staged = true;
 		}
-		else
-		{
-			fprintf(stderr, "decoding receive no record, sleep and reconnect");
-			pg_sleep(RECONNECT_SLEEP_TIME * 1000000);
-			init = false;
-		}
-	}
 
+		pthread_mutex_lock(&pipe->lock);
+		if (staged)
+			pipe->flushpos = change->recvpos;
+		pthread_mutex_unlock(&pipe->lock);
+		queue_push(&pipe->free, change);
+		continue;
 
-exit:
-
-	destroyPQExpBuffer(buffer);
+fail:
+		PQclear(res);
+		res = NULL;
+		time_to_abort = true;
+		pipe->failed = true;
+		queue_push(&pipe->free, change);
+	}
 
 	ThreadExit(0);
 	return NULL;
 }
 
+static bool
+spool_stream_message(PGconn *local_conn, DecodeChange *change)
+{
+	PQExpBuffer query = createPQExpBuffer();
+	PGresult   *res = NULL;
+	bool		ok = true;
+
+	switch (change->type)
+	{
+		case MSGKIND_STREAM_START:
+			appendPQExpBuffer(query, "BEGIN");
+			break;
+		case MSGKIND_STREAM_STOP:
+			appendPQExpBuffer(query, "END");
+			break;
+		case MSGKIND_STREAM_COMMIT:
+			appendPQExpBuffer(query,
+							  "BEGIN;"
+							  "INSERT INTO sync_sqls (sql) VALUES ('begin;');"
+							  "INSERT INTO sync_sqls (sql) SELECT sql FROM sync_stream_sqls WHERE xid = %u ORDER BY id;"
+							  "INSERT INTO sync_sqls (sql) VALUES ('commit;');"
+							  "DELETE FROM sync_stream_sqls WHERE xid = %u;"
+							  "END",
+							  change->xid, change->xid);
+			break;
+		case MSGKIND_STREAM_ABORT:
+			if (change->subxid == change->xid)
+				appendPQExpBuffer(query, "DELETE FROM sync_stream_sqls WHERE xid = %u", change->xid);
+			else
+				appendPQExpBuffer(query, "DELETE FROM sync_stream_sqls WHERE xid = %u AND subxid = %u",
+								  change->xid, change->subxid);
+			break;
+		default:
+			{
+				/* A change of the streamed transaction */
+				const char *paramValues[3];
+				char		xid[16];
+				char		subxid[16];
+
+				if (change->sql->len == 0)
+					break;
+				sprintf(xid, "%u", change->xid);
+				sprintf(subxid, "%u", change->subxid);
+				paramValues[0] = xid;
+				paramValues[1] = subxid;
+				paramValues[2] = change->sql->data;
+				res = PQexecParams(local_conn, "INSERT INTO sync_stream_sqls (xid, subxid, sql) VALUES ($1, $2, $3)",
+								   3, NULL, paramValues, NULL, NULL, 0);
+			}
+			break;
+	}
+
+	if (res == NULL && query->len == 0)
+	{
+		destroyPQExpBuffer(query);
+		return true;
+	}
+	if (res == NULL)
+		res = PQexec(local_conn, query->data);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "spool streamed transaction %u failed: %s", change->xid, PQerrorMessage(local_conn));
+		ok = false;
+	}
+	PQclear(res);
+	destroyPQExpBuffer(query);
+
+	return ok;
+}
+
+/*
+ * The server sends again from the last confirmed position on a new stream.
+ * Roll back the local transaction that was cut, and with pgoutput streaming
+ * forget what was spooled of the transactions in progress, they are streamed
+ * again from their start.
+ */
+static bool
+reset_staging(PGconn *local_conn, bool streaming)
+{
+	PGresult   *res;
+
+	res = PQexec(local_conn, streaming ? "ROLLBACK; DELETE FROM sync_stream_sqls" : "ROLLBACK");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "reset staged changes failed: %s", PQerrorMessage(local_conn));
+		PQclear(res);
+		return false;
+	}
+	PQclear(res);
+
+	return true;
+}
+
 static void *
 logical_decoding_apply_thread(void *arg)
 {
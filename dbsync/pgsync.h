@@ -79,6 +79,7 @@ typedef struct mysql_conn_info
 	char	*encodingdir;
 	char	**tabnames;
 	char **queries;
+	int		*priorities;
 }mysql_conn_info;
 
 typedef struct Thread_hd
@@ -118,6 +119,16 @@ typedef struct Task_hd
 	char	   *schemaname;		/* the schema name, or NULL */
 	char	   *relname;		/* the relation/sequence name */
 	char    *query;
+	char	   *range_cond;		/* predicate selecting one chunk of the table, or NULL */
+	int			chunk_id;		/* chunk number within the table, from 0 */
+	int			nchunk;			/* number of chunks the table is split into */
+	bool		truncate;		/* fast load: truncate the table in the task's own
+								 * transaction, which lets its COPY FREEZE */
+	bool		unlogged;		/* fast load: load it unlogged instead of frozen,
+								 * and set it logged before commit */
+	int			priority;		/* higher priority tasks are started first */
+	int64		est_bytes;		/* estimated data size, -1 if unknown */
+	long		est_rows;		/* estimated number of rows, -1 if unknown */
 	long		count;
 	bool		complete;
 
@@ -130,6 +141,13 @@ typedef struct Task_hd
 extern int db_sync_main(char *src, char *desc, char *local, int nthread);
 
 
+extern void plan_fast_load(PGconn *conn, Task_hd *task, int ntask, bool unlogged);
+extern char *fast_load_start_sql(PGconn *conn, Task_hd *task);
+extern char *fast_load_end_sql(PGconn *conn, Task_hd *task);
+extern bool fast_load_freeze(Task_hd *task);
+extern int fast_load_prepare(PGconn *conn, Task_hd *task);
+extern int fast_load_finish(PGconn *conn, Task_hd *task);
+
 extern int mysql2pgsql_sync_main(char *desc, int nthread, mysql_conn_info *hd, char* target_schema, uint32 ignore_error_count);
 
 
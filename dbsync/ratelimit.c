@@ -0,0 +1,264 @@
+/*
+ * ratelimit.c
+ *
+ * Rate limit of the source reads, see ratelimit.h.  Each limit is a token
+ * bucket kept as the time at which everything let through so far is paid
+ * for (GCRA): a reader charges what it read and sleeps until that time,
+ * less one second of burst.  Readers of all threads charge the same
+ * buckets, so they share the rate, and each of them sleeps only for its
+ * own part.
+ */
+#include "postgres_fe.h"
+#include "common/fe_memutils.h"
+
+#include "ini.h"
+#include "misc.h"
+#include "ratelimit.h"
+
+#include <signal.h>
+#include <sys/time.h>
+
+/* traffic of this many seconds may pass at once */
+#define RATELIMIT_BURST_SEC		1.0
+/* a sleeping reader looks this often whether the limits were changed */
+#define RATELIMIT_SLEEP_SEC		0.5
+
+typedef struct RateMeter
+{
+	double		rate;			/* units per second, 0 for no limit */
+	double		paid;			/* time at which the traffic so far is paid for */
+} RateMeter;
+
+struct RateBucket
+{
+	char	   *name;			/* NULL for all tables */
+	RateMeter	bytes;
+	RateMeter	rows;
+	RateBucket *next;
+};
+
+struct RateLimit
+{
+	char	   *cfgpath;
+	ini_t	   *ini;			/* NULL if the file could not be read */
+	RateBucket	all;
+	RateBucket *tables;
+	uint32		generation;		/* bumped when the limits are read again */
+	pthread_mutex_t lock;
+};
+
+static volatile sig_atomic_t reload_pending = false;
+
+static void
+sighup_handler(int signum)
+{
+	reload_pending = true;
+}
+
+static double
+ratelimit_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+/* Parse a limit such as "500", "64K" or "20M", 0 if there is none */
+static double
+ratelimit_parse(const char *value)
+{
+	char	   *end;
+	double		n;
+
+	if (value == NULL)
+		return 0;
+
+	n = strtod(value, &end);
+	switch (*end)
+	{
+		case 'g':
+		case 'G':
+			n *= 1024;
+			/* fall through */
+		case 'm':
+		case 'M':
+			n *= 1024;
+			/* fall through */
+		case 'k':
+		case 'K':
+			n *= 1024;
+			break;
+	}
+
+	return n > 0 ? n : 0;
+}
+
+/* Read the limits of a bucket from its section, called with the lock held */
+static void
+ratelimit_read(RateLimit *rl, RateBucket *bucket)
+{
+	char	   *section;
+
+	if (bucket->name != NULL)
+		section = psprintf("%s.%s", RATELIMIT_SECTION, bucket->name);
+	else
+		section = pstrdup(RATELIMIT_SECTION);
+
+	bucket->bytes.rate = rl->ini ? ratelimit_parse(ini_get(rl->ini, section, "bytes_per_sec")) : 0;
+	bucket->rows.rate = rl->ini ? ratelimit_parse(ini_get(rl->ini, section, "rows_per_sec")) : 0;
+	bucket->bytes.paid = 0;
+	bucket->rows.paid = 0;
+
+	if (bucket->bytes.rate > 0 || bucket->rows.rate > 0)
+		fprintf(stderr, "rate limit of %s: %.0f bytes/s, %.0f rows/s (0 is no limit)\n",
+				bucket->name ? bucket->name : "all tables", bucket->bytes.rate, bucket->rows.rate);
+
+	pfree(section);
+}
+
+/* Read the file again after a SIGHUP, called with the lock held */
+static void
+ratelimit_reload(RateLimit *rl)
+{
+	ini_t	   *ini;
+	RateBucket *bucket;
+
+	reload_pending = false;
+	ini = ini_load(rl->cfgpath);
+	if (ini == NULL)
+	{
+		fprintf(stderr, "rate limit: read %s failed, keep the current limits\n", rl->cfgpath);
+		return;
+	}
+
+	if (rl->ini != NULL)
+		ini_free(rl->ini);
+	rl->ini = ini;
+
+	fprintf(stderr, "rate limit: read %s again\n", rl->cfgpath);
+	ratelimit_read(rl, &rl->all);
+	for (bucket = rl->tables; bucket != NULL; bucket = bucket->next)
+		ratelimit_read(rl, bucket);
+	rl->generation++;
+}
+
+RateLimit *
+ratelimit_start(const char *cfgpath)
+{
+	RateLimit  *rl = (RateLimit *) palloc0(sizeof(RateLimit));
+
+	rl->cfgpath = pstrdup(cfgpath);
+	rl->ini = ini_load(cfgpath);
+	pthread_mutex_init(&rl->lock, NULL);
+	ratelimit_read(rl, &rl->all);
+
+	signal(SIGHUP, sighup_handler);
+
+	return rl;
+}
+
+/* Bucket of a table, shared by all tasks of the table */
+RateBucket *
+ratelimit_table(RateLimit *rl, const char *name)
+{
+	RateBucket *bucket;
+
+	pthread_mutex_lock(&rl->lock);
+	if (reload_pending)
+		ratelimit_reload(rl);
+
+	for (bucket = rl->tables; bucket != NULL; bucket = bucket->next)
+	{
+		if (strcmp(bucket->name, name) == 0)
+			break;
+	}
+
+	if (bucket == NULL)
+	{
+		bucket = (RateBucket *) palloc0(sizeof(RateBucket));
+		bucket->name = pstrdup(name);
+		ratelimit_read(rl, bucket);
+		bucket->next = rl->tables;
+		rl->tables = bucket;
+	}
+	pthread_mutex_unlock(&rl->lock);
+
+	return bucket;
+}
+
+/* Charge n units to a meter, return the time they may pass */
+static double
+meter_charge(RateMeter *meter, double now, int64 n)
+{
+	if (meter->rate <= 0 || n <= 0)
+		return now;
+
+	meter->paid = Max(meter->paid, now) + n / meter->rate;
+
+	return meter->paid - RATELIMIT_BURST_SEC;
+}
+
+/*
+ * Charge what a reader read to all tables and to its table, and sleep until
+ * the limits allow it.  table may be NULL.
+ */
+void
+ratelimit_consume(RateLimit *rl, RateBucket *table, int64 rows, int64 bytes)
+{
+	double		now;
+	double		until;
+	uint32		generation;
+
+	pthread_mutex_lock(&rl->lock);
+	if (reload_pending)
+		ratelimit_reload(rl);
+
+	now = ratelimit_now();
+	until = meter_charge(&rl->all.bytes, now, bytes);
+	until = Max(until, meter_charge(&rl->all.rows, now, rows));
+	if (table != NULL)
+	{
+		until = Max(until, meter_charge(&table->bytes, now, bytes));
+		until = Max(until, meter_charge(&table->rows, now, rows));
+	}
+	generation = rl->generation;
+	pthread_mutex_unlock(&rl->lock);
+
+	while (now < until)
+	{
+		bool		changed;
+
+		pg_usleep((long) (Min(until - now, RATELIMIT_SLEEP_SEC) * 1000000));
+
+		/* New limits start from scratch, stop paying for the old ones */
+		pthread_mutex_lock(&rl->lock);
+		if (reload_pending)
+			ratelimit_reload(rl);
+		changed = rl->generation != generation;
+		pthread_mutex_unlock(&rl->lock);
+		if (changed)
+			break;
+
+		now = ratelimit_now();
+	}
+}
+
+/*
+ * Gather the rows of a row by row reader and charge them in batches, or
+ * now if flush is set.
+ */
+void
+ratelimit_charge(RateLimit *rl, RateCharge *charge, int64 rows, int64 bytes, bool flush)
+{
+	charge->rows += rows;
+	charge->bytes += bytes;
+
+	if (charge->bytes >= RATELIMIT_CHARGE_BYTES || charge->rows >= RATELIMIT_CHARGE_ROWS ||
+		(flush && charge->rows > 0))
+	{
+		ratelimit_consume(rl, charge->table, charge->rows, charge->bytes);
+		charge->rows = 0;
+		charge->bytes = 0;
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef PG_RATELIMIT_H
+#define PG_RATELIMIT_H
+
+#include "postgres_fe.h"
+
+/*
+ * Rate limit of the reads from the source db, shared by all copy workers.
+ * The limits are read from my.cfg:
+ *
+ *	[rate_limit]
+ *	bytes_per_sec = "20M"
+ *	rows_per_sec = "50000"
+ *	[rate_limit.<table>]
+ *	bytes_per_sec = "5M"
+ *
+ * The first section limits all tables together, a section of a table limits
+ * that table only.  pgsql2pgsql names a table <schema>.<table>, as on the
+ * source, mysql2pgsql by its bare mysql table name, without the database or
+ * the target schema; the name is matched as is, unquoted.  A limit missing
+ * or 0 means no limit, sizes take a K, M or G suffix.  SIGHUP reads
+ * the file again, so the limits can be changed while the copy runs.
+ */
+#define RATELIMIT_CONFIG	"my.cfg"
+#define RATELIMIT_SECTION	"rate_limit"
+
+/* bytes or rows a row by row reader gathers before it charges them */
+#define RATELIMIT_CHARGE_BYTES	65536
+#define RATELIMIT_CHARGE_ROWS	1024
+
+typedef struct RateLimit RateLimit;
+typedef struct RateBucket RateBucket;
+
+/* What a row by row reader read since it last charged the limits */
+typedef struct RateCharge
+{
+	RateBucket *table;
+	int64		rows;
+	int64		bytes;
+} RateCharge;
+
+extern RateLimit *ratelimit_start(const char *cfgpath);
+extern RateBucket *ratelimit_table(RateLimit *rl, const char *name);
+extern void ratelimit_consume(RateLimit *rl, RateBucket *table, int64 rows, int64 bytes);
+extern void ratelimit_charge(RateLimit *rl, RateCharge *charge, int64 rows, int64 bytes, bool flush);
+
+#endif
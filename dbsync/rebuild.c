@@ -0,0 +1,508 @@
+/*
+ * rebuild.c
+ *
+ * Deferred index and constraint build, see rebuild.h.  Copying into a table
+ * without indexes and building each index once afterwards, with a large
+ * maintenance_work_mem, is much cheaper than updating every index for
+ * every row copied.  Primary keys and unique constraints are built as
+ * plain unique indexes first, so the builds of one table run in parallel,
+ * and then attached with ADD CONSTRAINT USING INDEX, which only takes a
+ * short lock.
+ */
+#include "postgres_fe.h"
+#include "common/fe_memutils.h"
+
+#include "libpq-fe.h"
+#include "pqexpbuffer.h"
+
+#include "misc.h"
+#include "pgsync.h"
+#include "rebuild.h"
+
+#define REBUILD_PHASES		4
+/* parallel workers of a CREATE INDEX on 11 and later, within max_parallel_workers */
+#define REBUILD_PARALLEL_BUILD	4
+
+#define STMT_REBUILD_CREATE \
+	"CREATE TABLE IF NOT EXISTS " REBUILD_TABLE " (id serial PRIMARY KEY, phase int NOT NULL, " \
+	"relname text NOT NULL, ddl text NOT NULL)"
+
+#define STMT_REBUILD_SAVE \
+	"INSERT INTO " REBUILD_TABLE " (phase, relname, ddl) SELECT %d, %s, %s " \
+	"WHERE NOT EXISTS (SELECT 1 FROM " REBUILD_TABLE " WHERE ddl = %s)"
+
+#define STMT_REBUILD_LOAD \
+	"SELECT id, phase, ddl FROM " REBUILD_TABLE " ORDER BY phase, id"
+
+#define STMT_REBUILD_DONE \
+	"DELETE FROM " REBUILD_TABLE " WHERE id = %d"
+
+/* Oids of the target tables, (schema, relname) pairs are appended */
+#define STMT_TARGET_OIDS \
+	"SELECT DISTINCT c.oid FROM pg_catalog.pg_class c " \
+	"JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+	"JOIN (VALUES %s) AS t(nspname, relname) " \
+	"ON n.nspname = coalesce(t.nspname, pg_catalog.current_schema()) AND c.relname = t.relname " \
+	"WHERE c.relkind = 'r'%s"
+
+/* Foreign keys first, they depend on the unique indexes they reference */
+#define STMT_TARGET_CONSTRAINTS \
+	"SELECT con.conrelid::pg_catalog.regclass, pg_catalog.quote_ident(con.conname), con.contype, " \
+	"con.condeferrable, pg_catalog.pg_get_constraintdef(con.oid), " \
+	"pg_catalog.pg_get_indexdef(con.conindid), pg_catalog.quote_ident(ic.relname) " \
+	"FROM pg_catalog.pg_constraint con LEFT JOIN pg_catalog.pg_class ic ON ic.oid = con.conindid " \
+	"WHERE (con.contype IN ('p', 'u', 'x') AND con.conrelid IN (%s)) " \
+	"OR (con.contype = 'f' AND (con.conrelid IN (%s) OR con.confrelid IN (%s))) " \
+	"ORDER BY con.contype = 'f' DESC, con.oid"
+
+#define STMT_TARGET_INDEXES \
+	"SELECT i.indrelid::pg_catalog.regclass, i.indexrelid::pg_catalog.regclass, " \
+	"pg_catalog.pg_get_indexdef(i.indexrelid) " \
+	"FROM pg_catalog.pg_index i WHERE i.indrelid IN (%s) " \
+	"AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_constraint con " \
+	"WHERE con.conindid = i.indexrelid AND con.contype IN ('p', 'u', 'x')) " \
+	"ORDER BY i.indexrelid"
+
+#define STMT_TARGET_NAMES \
+	"SELECT c.oid::pg_catalog.regclass FROM pg_catalog.pg_class c WHERE c.oid IN (%s) ORDER BY c.oid"
+
+typedef struct RebuildJob
+{
+	int			id;
+	int			phase;
+	char	   *ddl;
+	bool		done;
+} RebuildJob;
+
+typedef struct RebuildPool
+{
+	const char *conninfo;
+	const char *work_mem;
+
+	RebuildJob *jobs;
+	int			next;			/* next job of the phase to run */
+	int			end;			/* end of the jobs of the phase */
+	pthread_mutex_t	lock;
+} RebuildPool;
+
+typedef struct RebuildWorker
+{
+	int			id;
+	RebuildPool *pool;
+} RebuildWorker;
+
+static void *rebuild_worker(void *arg);
+
+/* Save a statement to run after the copy, once */
+static bool
+rebuild_save(PGconn *conn, int phase, const char *relname, const char *ddl)
+{
+	char	   *rel_literal = PQescapeLiteral(conn, relname, strlen(relname));
+	char	   *ddl_literal = PQescapeLiteral(conn, ddl, strlen(ddl));
+	char	   *sql = psprintf(STMT_REBUILD_SAVE, phase, rel_literal, ddl_literal, ddl_literal);
+	bool		ok;
+
+	ok = ExecuteSqlStatement(conn, sql) == 0;
+
+	pfree(sql);
+	PQfreemem(rel_literal);
+	PQfreemem(ddl_literal);
+
+	return ok;
+}
+
+/*
+ * Look up the target tables of the tasks, as a list of oids.  Return NULL
+ * on error, an empty string if none of them exists.
+ */
+static char *
+rebuild_target_oids(PGconn *conn, Task_hd *task, int ntask)
+{
+	PQExpBuffer	values = createPQExpBuffer();
+	PQExpBuffer	oids = createPQExpBuffer();
+	PGresult   *res = NULL;
+	char	   *sql;
+	char	   *result = NULL;
+	int			i;
+
+	for (i = 0; i < ntask; i++)
+	{
+		char	   *rel_literal = PQescapeLiteral(conn, task[i].relname, strlen(task[i].relname));
+
+		if (i > 0)
+			appendPQExpBufferStr(values, ", ");
+		if (task[i].schemaname)
+		{
+			char	   *nsp_literal = PQescapeLiteral(conn, task[i].schemaname, strlen(task[i].schemaname));
+
+			appendPQExpBuffer(values, "(%s::text, %s::text)", nsp_literal, rel_literal);
+			PQfreemem(nsp_literal);
+		}
+		else
+			appendPQExpBuffer(values, "(NULL::text, %s::text)", rel_literal);
+		PQfreemem(rel_literal);
+	}
+
+	/* Partitions share the indexes of their parent, leave them alone */
+	sql = psprintf(STMT_TARGET_OIDS, values->data,
+				   PQserverVersion(conn) >= 100000 ? " AND NOT c.relispartition" : "");
+	res = PQexec(conn, sql);
+	pfree(sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "look up target tables failed: %s", PQerrorMessage(conn));
+		goto exit;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+		appendPQExpBuffer(oids, "%s%s", i > 0 ? ", " : "", PQgetvalue(res, i, 0));
+	result = pstrdup(oids->data);
+
+exit:
+	PQclear(res);
+	destroyPQExpBuffer(values);
+	destroyPQExpBuffer(oids);
+
+	return result;
+}
+
+/*
+ * Save the indexes and constraints of the target tables of the tasks and
+ * drop them, in one transaction.  Return false on error, nothing is
+ * dropped then.
+ */
+bool
+rebuild_defer(PGconn *conn, Task_hd *task, int ntask)
+{
+	PQExpBuffer	drops = createPQExpBuffer();
+	PGresult   *res = NULL;
+	char	   *oids = NULL;
+	char	   *sql;
+	int			nindex = 0;
+	int			nconstraint = 0;
+	bool		ok = false;
+	int			i;
+
+	if (ExecuteSqlStatement(conn, STMT_REBUILD_CREATE) != 0)
+		goto exit;
+
+	oids = rebuild_target_oids(conn, task, ntask);
+	if (oids == NULL)
+		goto exit;
+	if (oids[0] == '\0')
+	{
+		ok = true;
+		goto exit;
+	}
+
+	if (ExecuteSqlStatement(conn, "BEGIN") != 0)
+		goto exit;
+
+	sql = psprintf(STMT_TARGET_CONSTRAINTS, oids, oids, oids);
+	res = PQexec(conn, sql);
+	pfree(sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "look up constraints failed: %s", PQerrorMessage(conn));
+		goto rollback;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		char	   *relname = PQgetvalue(res, i, 0);
+		char	   *conname = PQgetvalue(res, i, 1);
+		char		contype = PQgetvalue(res, i, 2)[0];
+		bool		deferrable = strcmp(PQgetvalue(res, i, 3), "t") == 0;
+		char	   *condef = PQgetvalue(res, i, 4);
+		char	   *ddl;
+		bool		saved;
+
+		if ((contype == 'p' || contype == 'u') && !deferrable)
+		{
+			saved = rebuild_save(conn, 0, relname, PQgetvalue(res, i, 5));
+			if (saved)
+			{
+				ddl = psprintf("ALTER TABLE %s ADD CONSTRAINT %s %s USING INDEX %s", relname, conname,
+							   contype == 'p' ? "PRIMARY KEY" : "UNIQUE", PQgetvalue(res, i, 6));
+				saved = rebuild_save(conn, 1, relname, ddl);
+				pfree(ddl);
+			}
+		}
+		else
+		{
+			ddl = psprintf("ALTER TABLE %s ADD CONSTRAINT %s %s", relname, conname, condef);
+			saved = rebuild_save(conn, contype == 'f' ? 2 : 1, relname, ddl);
+			pfree(ddl);
+		}
+		if (!saved)
+			goto rollback;
+
+		appendPQExpBuffer(drops, "ALTER TABLE %s DROP CONSTRAINT %s;\n", relname, conname);
+		nconstraint++;
+	}
+	PQclear(res);
+
+	sql = psprintf(STMT_TARGET_INDEXES, oids);
+	res = PQexec(conn, sql);
+	pfree(sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "look up indexes failed: %s", PQerrorMessage(conn));
+		goto rollback;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		if (!rebuild_save(conn, 0, PQgetvalue(res, i, 0), PQgetvalue(res, i, 2)))
+			goto rollback;
+
+		appendPQExpBuffer(drops, "DROP INDEX %s;\n", PQgetvalue(res, i, 1));
+		nindex++;
+	}
+	PQclear(res);
+
+	sql = psprintf(STMT_TARGET_NAMES, oids);
+	res = PQexec(conn, sql);
+	pfree(sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "look up target tables failed: %s", PQerrorMessage(conn));
+		goto rollback;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		char	   *ddl = psprintf("ANALYZE %s", PQgetvalue(res, i, 0));
+		bool		saved = rebuild_save(conn, 3, PQgetvalue(res, i, 0), ddl);
+
+		pfree(ddl);
+		if (!saved)
+			goto rollback;
+	}
+	PQclear(res);
+	res = NULL;
+
+	if (drops->len > 0)
+	{
+		res = PQexec(conn, drops->data);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			fprintf(stderr, "drop indexes and constraints failed: %s", PQerrorMessage(conn));
+			goto rollback;
+		}
+		PQclear(res);
+		res = NULL;
+	}
+
+	if (finish_copy_target_tx(conn) != 0)
+		goto exit;
+
+	fprintf(stderr, "-- dropped %d indexes and %d constraints, they are built again after the copy\n",
+			nindex, nconstraint);
+	ok = true;
+	goto exit;
+
+rollback:
+	ExecuteSqlStatement(conn, "ROLLBACK");
+
+exit:
+	PQclear(res);
+	if (oids)
+		pfree(oids);
+	destroyPQExpBuffer(drops);
+
+	return ok;
+}
+
+/*
+ * Run the saved statements with nworkers connections, phase by phase.
+ * Return false if some of them failed, they are left in the table.
+ */
+bool
+rebuild_run(const char *conninfo, int nworkers, const char *work_mem)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+	RebuildPool pool;
+	RebuildWorker *workers;
+	Thread	   *thread;
+	TimevalStruct before,
+				after;
+	double		elapsed_msec = 0;
+	int			njob;
+	int			nfailed = 0;
+	int			phase;
+	int			i;
+
+	conn = pglogical_connect(conninfo, EXTENSION_NAME "_rebuild");
+	if (conn == NULL)
+	{
+		fprintf(stderr, "init desc conn failed, indexes are left in table %s\n", REBUILD_TABLE);
+		return false;
+	}
+
+	res = PQexec(conn, STMT_REBUILD_LOAD);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "load deferred statements failed: %s", PQerrorMessage(conn));
+		PQclear(res);
+		PQfinish(conn);
+		return false;
+	}
+
+	memset(&pool, 0, sizeof(RebuildPool));
+	pool.conninfo = conninfo;
+	pool.work_mem = work_mem;
+	njob = PQntuples(res);
+	pool.jobs = (RebuildJob *) palloc0(sizeof(RebuildJob) * Max(njob, 1));
+	for (i = 0; i < njob; i++)
+	{
+		pool.jobs[i].id = atoi(PQgetvalue(res, i, 0));
+		pool.jobs[i].phase = atoi(PQgetvalue(res, i, 1));
+		pool.jobs[i].ddl = pstrdup(PQgetvalue(res, i, 2));
+	}
+	PQclear(res);
+	PQfinish(conn);
+
+	if (njob == 0)
+	{
+		pfree(pool.jobs);
+		return true;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	workers = (RebuildWorker *) palloc0(sizeof(RebuildWorker) * nworkers);
+	thread = (Thread *) palloc0(sizeof(Thread) * nworkers);
+
+	fprintf(stderr, "Starting index rebuild with %d workers\n", nworkers);
+	GETTIMEOFDAY(&before);
+
+	/* A phase starts when the statements it depends on are all done */
+	for (phase = 0, i = 0; phase < REBUILD_PHASES; phase++)
+	{
+		int			nthread;
+		int			j;
+
+		pool.next = i;
+		while (i < njob && pool.jobs[i].phase <= phase)
+			i++;
+		pool.end = i;
+		if (pool.end == pool.next)
+			continue;
+
+		nthread = Min(nworkers, pool.end - pool.next);
+		for (j = 0; j < nthread; j++)
+		{
+			workers[j].id = j;
+			workers[j].pool = &pool;
+			ThreadCreate(&thread[j], rebuild_worker, &workers[j]);
+		}
+		WaitThreadEnd(nthread, thread);
+	}
+
+	GETTIMEOFDAY(&after);
+	DIFF_MSEC(&after, &before, elapsed_msec);
+
+	for (i = 0; i < njob; i++)
+	{
+		if (!pool.jobs[i].done)
+			nfailed++;
+	}
+
+	fprintf(stderr, "Index rebuild of %d statements time cost %.3f ms\n", njob, elapsed_msec);
+	if (nfailed > 0)
+		fprintf(stderr, "%d statements failed, they are kept in table %s and run again by the next run\n",
+				nfailed, REBUILD_TABLE);
+
+	pthread_mutex_destroy(&pool.lock);
+	for (i = 0; i < njob; i++)
+		pfree(pool.jobs[i].ddl);
+	pfree(pool.jobs);
+	pfree(workers);
+	pfree(thread);
+
+	return nfailed == 0;
+}
+
+/*
+ * Run statements of the current phase until there are none left.  Each one
+ * is deleted from the table in its own transaction.
+ */
+static void *
+rebuild_worker(void *arg)
+{
+	RebuildWorker *worker = (RebuildWorker *) arg;
+	RebuildPool *pool = worker->pool;
+	PGconn	   *conn;
+	TimevalStruct before,
+				after;
+	double		elapsed_msec = 0;
+
+	conn = pglogical_connect(pool->conninfo, EXTENSION_NAME "_rebuild");
+	if (conn == NULL)
+	{
+		fprintf(stderr, "rebuild worker %d init desc conn failed\n", worker->id);
+		ThreadExit(0);
+		return NULL;
+	}
+
+	if (pool->work_mem != NULL)
+	{
+		char	   *literal = PQescapeLiteral(conn, pool->work_mem, strlen(pool->work_mem));
+		char	   *sql = psprintf("SET maintenance_work_mem = %s", literal);
+
+		ExecuteSqlStatement(conn, sql);
+		pfree(sql);
+		PQfreemem(literal);
+	}
+
+	if (PQserverVersion(conn) >= 110000)
+	{
+		char	   *sql = psprintf("SET max_parallel_maintenance_workers = %d", REBUILD_PARALLEL_BUILD);
+
+		ExecuteSqlStatement(conn, sql);
+		pfree(sql);
+	}
+
+	while (1)
+	{
+		RebuildJob *job = NULL;
+		char	   *sql;
+		bool		ok;
+
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next < pool->end)
+			job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job == NULL)
+			break;
+
+		GETTIMEOFDAY(&before);
+		if (ExecuteSqlStatement(conn, "BEGIN") != 0)
+			break;
+
+		sql = psprintf(STMT_REBUILD_DONE, job->id);
+		ok = ExecuteSqlStatement(conn, job->ddl) == 0 &&
+			ExecuteSqlStatement(conn, sql) == 0;
+		pfree(sql);
+
+		if (!ok)
+		{
+			ExecuteSqlStatement(conn, "ROLLBACK");
+			continue;
+		}
+		if (finish_copy_target_tx(conn) != 0)
+			continue;
+
+		job->done = true;
+		GETTIMEOFDAY(&after);
+		DIFF_MSEC(&after, &before, elapsed_msec);
+		fprintf(stderr, "rebuild worker %d %s complete, time cost %.3f ms\n",
+				worker->id, job->ddl, elapsed_msec);
+	}
+
+	PQfinish(conn);
+	ThreadExit(0);
+	return NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef PG_REBUILD_H
+#define PG_REBUILD_H
+
+#include "postgres_fe.h"
+
+#include "libpq-fe.h"
+
+#include "pgsync.h"
+
+/*
+ * Deferred index and constraint build.  Before the data is copied, the
+ * indexes, primary key, unique, exclusion and foreign key constraints of
+ * the target tables are dropped, and the statements creating them again
+ * are saved in a table of the target db, in the same transaction.  After
+ * the copy, a pool of workers runs the saved statements in phases:
+ *
+ *	0: CREATE INDEX, also for the indexes of primary keys and unique constraints
+ *	1: ALTER TABLE ADD CONSTRAINT, on top of the indexes of phase 0 if possible
+ *	2: ALTER TABLE ADD CONSTRAINT FOREIGN KEY
+ *	3: ANALYZE
+ *
+ * A statement is deleted from the table when it succeeds, so what is left
+ * after an error is run again the next time.
+ */
+#define REBUILD_TABLE	"dbsync_deferred_ddl"
+
+extern bool rebuild_defer(PGconn *conn, Task_hd *task, int ntask);
+extern bool rebuild_run(const char *conninfo, int nworkers, const char *work_mem);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * sendrecv.c
+ *
+ * Binary column values of the decoding plugin, see sendrecv.h.  The send
+ * forms are those of the backend's *send functions: integers in network
+ * byte order, floats as IEEE bits, numeric as base 10000 digits, dates and
+ * times as days and microseconds since 2000-01-01 (integer datetimes).
+ */
+#include "postgres_fe.h"
+
+#include "pqexpbuffer.h"
+
+#include "misc.h"
+#include "sendrecv.h"
+
+#include <float.h>
+#include <math.h>
+
+typedef enum BinaryType
+{
+	BINARY_UNKNOWN,
+	BINARY_BOOL,
+	BINARY_INT2,
+	BINARY_INT4,
+	BINARY_INT8,
+	BINARY_OID,
+	BINARY_FLOAT4,
+	BINARY_FLOAT8,
+	BINARY_NUMERIC,
+	BINARY_TEXT,
+	BINARY_BYTEA,
+	BINARY_UUID,
+	BINARY_DATE,
+	BINARY_TIME,
+	BINARY_TIMESTAMP,
+	BINARY_TIMESTAMPTZ
+} BinaryType;
+
+/* the send form of numeric, see numeric_send() */
+#define NUMERIC_HEADER_LEN	8
+#define NUMERIC_NEG			0x4000
+#define NUMERIC_NAN			0xC000
+#define NUMERIC_PINF		0xD000
+#define NUMERIC_NINF		0xF000
+#define NUMERIC_DEC_DIGITS	4
+
+#define POSTGRES_EPOCH_JDATE	2451545		/* date2j(2000, 1, 1) */
+#define USECS_PER_DAY		INT64CONST(86400000000)
+#define USECS_PER_SEC		INT64CONST(1000000)
+
+static bool
+has_prefix(const char *s, const char *prefix)
+{
+	return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+static bool
+has_suffix(const char *s, const char *suffix)
+{
+	size_t		len = strlen(s);
+	size_t		slen = strlen(suffix);
+
+	return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+/* The type of a format_type name, typmods included */
+static BinaryType
+binary_type(const char *type)
+{
+	if (type == NULL)
+		return BINARY_UNKNOWN;
+
+	if (strcmp(type, "boolean") == 0)
+		return BINARY_BOOL;
+	if (strcmp(type, "smallint") == 0)
+		return BINARY_INT2;
+	if (strcmp(type, "integer") == 0)
+		return BINARY_INT4;
+	if (strcmp(type, "bigint") == 0)
+		return BINARY_INT8;
+	if (strcmp(type, "oid") == 0)
+		return BINARY_OID;
+	if (strcmp(type, "real") == 0)
+		return BINARY_FLOAT4;
+	if (strcmp(type, "double precision") == 0)
+		return BINARY_FLOAT8;
+	if (strcmp(type, "numeric") == 0 || has_prefix(type, "numeric("))
+		return BINARY_NUMERIC;
+	if (strcmp(type, "text") == 0 || strcmp(type, "name") == 0 || strcmp(type, "json") == 0 ||
+		has_prefix(type, "character"))
+		return BINARY_TEXT;
+	if (strcmp(type, "bytea") == 0)
+		return BINARY_BYTEA;
+	if (strcmp(type, "uuid") == 0)
+		return BINARY_UUID;
+	if (strcmp(type, "date") == 0)
+		return BINARY_DATE;
+	if (has_prefix(type, "timestamp"))
+	{
+		if (has_suffix(type, "without time zone"))
+			return BINARY_TIMESTAMP;
+		if (has_suffix(type, "with time zone"))
+			return BINARY_TIMESTAMPTZ;
+	}
+	else if (has_prefix(type, "time") && has_suffix(type, "without time zone"))
+		return BINARY_TIME;
+
+	return BINARY_UNKNOWN;
+}
+
+static uint16
+recv_uint16(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+
+	return (uint16) ((u[0] << 8) | u[1]);
+}
+
+static uint32
+recv_uint32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+
+	return ((uint32) u[0] << 24) | ((uint32) u[1] << 16) | ((uint32) u[2] << 8) | (uint32) u[3];
+}
+
+static uint64
+recv_uint64(const char *p)
+{
+	return ((uint64) recv_uint32(p) << 32) | recv_uint32(p + 4);
+}
+
+/* Whether send/recv values of a type can be read */
+bool
+binary_type_supported(const char *type)
+{
+	return binary_type(type) != BINARY_UNKNOWN;
+}
+
+/* Whether a value can be read, so that applying it cannot fail later */
+bool
+binary_value_valid(const char *type, char kind, const char *data, int len)
+{
+	BinaryType	btype = binary_type(type);
+
+	/* The internal form differs from the send form but for these */
+	if (kind == 'b')
+		return btype == BINARY_TEXT || btype == BINARY_BYTEA;
+
+	switch (btype)
+	{
+		case BINARY_BOOL:
+			return len == 1;
+		case BINARY_INT2:
+			return len == 2;
+		case BINARY_INT4:
+		case BINARY_OID:
+		case BINARY_FLOAT4:
+		case BINARY_DATE:
+			return len == 4;
+		case BINARY_INT8:
+		case BINARY_FLOAT8:
+		case BINARY_TIME:
+		case BINARY_TIMESTAMP:
+		case BINARY_TIMESTAMPTZ:
+			return len == 8;
+		case BINARY_UUID:
+			return len == 16;
+		case BINARY_NUMERIC:
+			return len >= NUMERIC_HEADER_LEN &&
+				len == NUMERIC_HEADER_LEN + 2 * (int16) recv_uint16(data);
+		case BINARY_TEXT:
+		case BINARY_BYTEA:
+			return true;
+		case BINARY_UNKNOWN:
+			break;
+	}
+
+	return false;
+}
+
+static void
+append_float_literal(PQExpBuffer buffer, double value, int digits)
+{
+	if (isnan(value))
+		appendPQExpBufferStr(buffer, "'NaN'");
+	else if (isinf(value))
+		appendPQExpBufferStr(buffer, value > 0 ? "'Infinity'" : "'-Infinity'");
+	else
+		appendPQExpBuffer(buffer, "%.*g", digits, value);
+}
+
+/* Decimal text of a numeric, as get_str_from_var() of the backend */
+static void
+append_numeric_literal(PQExpBuffer buffer, const char *data)
+{
+	int			ndigits = (int16) recv_uint16(data);
+	int			weight = (int16) recv_uint16(data + 2);
+	uint16		sign = recv_uint16(data + 4);
+	int			dscale = (int16) recv_uint16(data + 6);
+	const char *digits = data + NUMERIC_HEADER_LEN;
+	int			d;
+
+	if (sign == NUMERIC_NAN)
+	{
+		appendPQExpBufferStr(buffer, "'NaN'");
+		return;
+	}
+	if (sign == NUMERIC_PINF || sign == NUMERIC_NINF)
+	{
+		appendPQExpBufferStr(buffer, sign == NUMERIC_PINF ? "'Infinity'" : "'-Infinity'");
+		return;
+	}
+
+	if (sign == NUMERIC_NEG)
+		appendPQExpBufferChar(buffer, '-');
+
+	/* Integer part, a digit of 4 decimal digits at a time */
+	if (weight < 0)
+		appendPQExpBufferChar(buffer, '0');
+	for (d = 0; d <= weight; d++)
+	{
+		int			dig = d < ndigits ? (int16) recv_uint16(digits + 2 * d) : 0;
+
+		appendPQExpBuffer(buffer, d == 0 ? "%d" : "%04d", dig);
+	}
+
+	/* Fraction, cut to dscale decimal digits */
+	if (dscale > 0)
+	{
+		int			start;
+
+		appendPQExpBufferChar(buffer, '.');
+		start = buffer->len;
+		for (d = weight + 1; buffer->len - start < dscale; d++)
+		{
+			int			dig = (d >= 0 && d < ndigits) ? (int16) recv_uint16(digits + 2 * d) : 0;
+
+			appendPQExpBuffer(buffer, "%04d", dig);
+		}
+		buffer->len = start + dscale;
+		buffer->data[buffer->len] = '\0';
+	}
+}
+
+/* Julian day to calendar date, j2date() of the backend */
+static void
+j2date(int jd, int *year, int *month, int *day)
+{
+	unsigned int julian;
+	unsigned int quad;
+	unsigned int extra;
+	int			y;
+
+	julian = jd;
+	julian += 32044;
+	quad = julian / 146097;
+	extra = (julian - quad * 146097) * 4 + 3;
+	julian += 60 + quad * 3 + extra / 146097;
+	quad = julian / 1461;
+	julian -= quad * 1461;
+	y = julian * 4 / 1461;
+	julian = ((y != 0) ? ((julian + 305) % 365) : ((julian + 306) % 366)) + 123;
+	y += quad * 4;
+	*year = y - 4800;
+	quad = julian * 2141 / 65536;
+	*day = julian - 7834 * quad / 256;
+	*month = (quad + 10) % 12 + 1;
+}
+
+static void
+append_date(PQExpBuffer buffer, int days)
+{
+	int			year;
+	int			month;
+	int			day;
+
+	j2date(days + POSTGRES_EPOCH_JDATE, &year, &month, &day);
+	appendPQExpBuffer(buffer, "%04d-%02d-%02d", year > 0 ? year : -(year - 1), month, day);
+}
+
+static void
+append_time(PQExpBuffer buffer, int64 usecs)
+{
+	appendPQExpBuffer(buffer, "%02d:%02d:%02d.%06d",
+					  (int) (usecs / (3600 * USECS_PER_SEC)),
+					  (int) (usecs / (60 * USECS_PER_SEC) % 60),
+					  (int) (usecs / USECS_PER_SEC % 60),
+					  (int) (usecs % USECS_PER_SEC));
+}
+
+static void
+append_timestamp_literal(PQExpBuffer buffer, int64 value, bool with_zone)
+{
+	int64		days;
+	int64		usecs;
+	int			year;
+	int			month;
+	int			day;
+
+	if (value == PG_INT64_MIN || value == PG_INT64_MAX)
+	{
+		appendPQExpBufferStr(buffer, value == PG_INT64_MIN ? "'-infinity'" : "'infinity'");
+		return;
+	}
+
+	days = value / USECS_PER_DAY;
+	usecs = value % USECS_PER_DAY;
+	if (usecs < 0)
+	{
+		usecs += USECS_PER_DAY;
+		days--;
+	}
+
+	appendPQExpBufferChar(buffer, '\'');
+	append_date(buffer, (int) days);
+	appendPQExpBufferChar(buffer, ' ');
+	append_time(buffer, usecs);
+	if (with_zone)
+		appendPQExpBufferStr(buffer, "+00");
+	j2date((int) days + POSTGRES_EPOCH_JDATE, &year, &month, &day);
+	if (year <= 0)
+		appendPQExpBufferStr(buffer, " BC");
+	appendPQExpBufferChar(buffer, '\'');
+}
+
+/* Append a value checked by binary_value_valid() as a SQL literal */
+void
+append_binary_literal(PQExpBuffer buffer, const char *type, const char *data, int len)
+{
+	switch (binary_type(type))
+	{
+		case BINARY_BOOL:
+			appendPQExpBufferStr(buffer, data[0] ? "true" : "false");
+			break;
+		case BINARY_INT2:
+			appendPQExpBuffer(buffer, "%d", (int) (int16) recv_uint16(data));
+			break;
+		case BINARY_INT4:
+			appendPQExpBuffer(buffer, "%d", (int32) recv_uint32(data));
+			break;
+		case BINARY_INT8:
+			appendPQExpBuffer(buffer, INT64_FORMAT, (int64) recv_uint64(data));
+			break;
+		case BINARY_OID:
+			appendPQExpBuffer(buffer, "%u", recv_uint32(data));
+			break;
+		case BINARY_FLOAT4:
+			{
+				uint32		bits = recv_uint32(data);
+				float4		value;
+
+				memcpy(&value, &bits, sizeof(value));
+				append_float_literal(buffer, value, FLT_DIG + 3);
+			}
+			break;
+		case BINARY_FLOAT8:
+			{
+				uint64		bits = recv_uint64(data);
+				float8		value;
+
+				memcpy(&value, &bits, sizeof(value));
+				append_float_literal(buffer, value, DBL_DIG + 3);
+			}
+			break;
+		case BINARY_NUMERIC:
+			append_numeric_literal(buffer, data);
+			break;
+		case BINARY_TEXT:
+			append_quoted_literal(buffer, data, len);
+			break;
+		case BINARY_BYTEA:
+			{
+				PQExpBuffer hex = createPQExpBuffer();
+				int			i;
+
+				appendPQExpBufferStr(hex, "\\x");
+				for (i = 0; i < len; i++)
+					appendPQExpBuffer(hex, "%02x", (unsigned char) data[i]);
+				append_quoted_literal(buffer, hex->data, hex->len);
+				destroyPQExpBuffer(hex);
+			}
+			break;
+		case BINARY_UUID:
+			{
+				int			i;
+
+				appendPQExpBufferChar(buffer, '\'');
+				for (i = 0; i < 16; i++)
+				{
+					if (i == 4 || i == 6 || i == 8 || i == 10)
+						appendPQExpBufferChar(buffer, '-');
+					appendPQExpBuffer(buffer, "%02x", (unsigned char) data[i]);
+				}
+				appendPQExpBufferChar(buffer, '\'');
+			}
+			break;
+		case BINARY_DATE:
+			{
+				int32		days = (int32) recv_uint32(data);
+				int			year;
+				int			month;
+				int			day;
+
+				if (days == PG_INT32_MIN || days == PG_INT32_MAX)
+				{
+					appendPQExpBufferStr(buffer, days == PG_INT32_MIN ? "'-infinity'" : "'infinity'");
+					break;
+				}
+				appendPQExpBufferChar(buffer, '\'');
+				append_date(buffer, days);
+				j2date(days + POSTGRES_EPOCH_JDATE, &year, &month, &day);
+				if (year <= 0)
+					appendPQExpBufferStr(buffer, " BC");
+				appendPQExpBufferChar(buffer, '\'');
+			}
+			break;
+		case BINARY_TIME:
+			appendPQExpBufferChar(buffer, '\'');
+			append_time(buffer, (int64) recv_uint64(data));
+			appendPQExpBufferChar(buffer, '\'');
+			break;
+		case BINARY_TIMESTAMP:
+		case BINARY_TIMESTAMPTZ:
+			append_timestamp_literal(buffer, (int64) recv_uint64(data),
+									 binary_type(type) == BINARY_TIMESTAMPTZ);
+			break;
+		case BINARY_UNKNOWN:
+			/* Rejected by binary_value_valid() */
+			appendPQExpBufferStr(buffer, "null");
+			break;
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef PG_SENDRECV_H
+#define PG_SENDRECV_H
+
+#include "postgres_fe.h"
+
+#include "pqexpbuffer.h"
+
+/*
+ * Column values the decoding plugin sends in binary.  With 's' a value is in
+ * the send/recv form of its type, as in binary COPY, with 'b' it is the
+ * internal form, which the client can read only for the types whose internal
+ * form is their send form, the text types and bytea.  A value is checked as
+ * it is decoded and rendered as a SQL literal when the change is applied.
+ * The type is the format_type name the plugin sends in the column info.
+ */
+extern bool binary_type_supported(const char *type);
+extern bool binary_value_valid(const char *type, char kind, const char *data, int len);
+extern void append_binary_literal(PQExpBuffer buffer, const char *type, const char *data, int len);
+
+#endif
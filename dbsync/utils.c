@@ -27,6 +27,7 @@
 
 #include "utils.h"
 #include "misc.h"
+#include "sendrecv.h"
 
 #ifndef WIN32
 #include <unistd.h>
@@ -36,6 +37,8 @@
 static int checktuple(ALI_PG_DECODE_MESSAGE *msg, int kind, Decode_TupleData *new_tuple, Decode_TupleData *old_tuple);
 static void append_insert_colname(ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_TupleData *tuple);
 static void quote_literal_local(Decoder_handler *hander, const char *rawstr, char *type, PQExpBuffer buffer);
+static void append_column_value(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, Decode_TupleData *tuple, int i, PQExpBuffer buffer);
+static bool column_value_equal(Decode_TupleData *a, Decode_TupleData *b, int i);
 static void append_insert_values(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_TupleData *tuple);
 static void append_delete_where_statement(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_TupleData *tuple);
 static void append_update_statement(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer);
@@ -84,12 +87,13 @@ out_put_tuple(ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_TupleData *
 	for (i = 0; i < natt; i++)
 	{
 		char	*value;
+		PQExpBuffer	literal = NULL;
 
-		if (tuple->isnull[i] && tuple->changed[i] && tuple->svalues[i] == NULL)
+		if (DECODE_ISNULL(tuple, i) && DECODE_CHANGED(tuple, i) && tuple->svalues[i] == NULL)
 		{
 			value = "{null}";
 		}
-		else if (tuple->isnull[i] && tuple->changed[i] == false && tuple->svalues[i] == NULL)
+		else if (DECODE_ISNULL(tuple, i) && !DECODE_CHANGED(tuple, i) && tuple->svalues[i] == NULL)
 		{
 			value = "{unchanged toast column}";
 		}
@@ -98,20 +102,32 @@ out_put_tuple(ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_TupleData *
 			if (tuple->svalues[i] == NULL)
 			{
 				fprintf(stderr, "%s.%s column %s value is null unnormal",  msg->schemaname, msg->relname,
-														msg->attname[i]);
+														DECODE_ATTNAME(msg, i));
 				return;
 			}
 			value = tuple->svalues[i];
+			if (tuple->formats[i] != 't' && DECODE_ATTNAME(msg, i))
+			{
+				literal = createPQExpBuffer();
+				append_binary_literal(literal, DECODE_ATTTYPE(msg, i), tuple->svalues[i], tuple->lengths[i]);
+			}
 		}
 
-        if (msg->attname[i])
+        if (DECODE_ATTNAME(msg, i) && literal != NULL)
+        {
+            appendPQExpBuffer(buffer, "%d %s[%s]%s\n", i, DECODE_ATTNAME(msg, i), DECODE_ATTTYPE(msg, i), literal->data);
+        }
+        else if (DECODE_ATTNAME(msg, i))
         {
-            appendPQExpBuffer(buffer, "%d %s[%s]'%s'\n", i, msg->attname[i], msg->atttype[i], value);
+            appendPQExpBuffer(buffer, "%d %s[%s]'%s'\n", i, DECODE_ATTNAME(msg, i), DECODE_ATTTYPE(msg, i), value);
         }
         else
         {
             appendPQExpBuffer(buffer, "%d dropped\n", i);
         }
+
+		if (literal != NULL)
+			destroyPQExpBuffer(literal);
 	}
 }
 
@@ -153,12 +169,12 @@ append_insert_colname(ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer buffer, Decode_Tup
 	appendPQExpBuffer(buffer, "(");
 	for (i = 0; i < tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			continue;
 		}
 
-		appendPQExpBuffer(buffer, "%s", msg->attname[i]);
+		appendPQExpBuffer(buffer, "%s", DECODE_ATTNAME(msg, i));
 		if(i != tuple->natt - 1)
 		{
 			appendPQExpBuffer(buffer, ",");
@@ -176,7 +192,7 @@ append_insert_values(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpB
 	appendPQExpBuffer(buffer, "VALUES(");
 	for (i = 0; i < tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			continue;
 		}
@@ -190,17 +206,17 @@ append_insert_values(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpB
 			appendPQExpBuffer(buffer, ", ");
 		}
 		
-		if (tuple->isnull[i] && tuple->changed[i] && tuple->svalues[i] == NULL)
+		if (DECODE_ISNULL(tuple, i) && DECODE_CHANGED(tuple, i) && tuple->svalues[i] == NULL)
 		{
 			appendPQExpBuffer(buffer, "null");
 		}
-		else if (tuple->isnull[i] && tuple->changed[i] == false && tuple->svalues[i] == NULL)
+		else if (DECODE_ISNULL(tuple, i) && !DECODE_CHANGED(tuple, i) && tuple->svalues[i] == NULL)
 		{
 			appendPQExpBuffer(buffer, "null");
 		}
 		else
 		{
-			quote_literal_local(hander, tuple->svalues[i], msg->atttype[i], buffer);
+			append_column_value(hander, msg, tuple, i, buffer);
 		}
 	}
 	appendPQExpBuffer(buffer, ");");
@@ -216,7 +232,7 @@ append_delete_where_statement(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *ms
 	appendPQExpBuffer(buffer, "WHERE ");
 	for (i = 0; i < tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			continue;
 		}
@@ -226,7 +242,7 @@ append_delete_where_statement(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *ms
 
 			if (msg->k_natt > 0)
 			{
-				is_key = is_key_column(msg, msg->attname[i]);
+				is_key = is_key_column(msg, DECODE_ATTNAME(msg, i));
 				if (is_key == false)
 					continue;
 			}
@@ -318,7 +334,7 @@ append_update_statement_key_change(Decoder_handler *hander, ALI_PG_DECODE_MESSAG
 	appendPQExpBuffer(where, " WHERE ");
 	for (i = 0; i < old_tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			continue;
 		}
@@ -328,7 +344,7 @@ append_update_statement_key_change(Decoder_handler *hander, ALI_PG_DECODE_MESSAG
 
 			if (msg->k_natt > 0)
 			{
-				is_key = is_key_column(msg, msg->attname[i]);
+				is_key = is_key_column(msg, DECODE_ATTNAME(msg, i));
 				if (is_key == false)
 					continue;
 			}
@@ -351,7 +367,8 @@ append_update_statement_key_change(Decoder_handler *hander, ALI_PG_DECODE_MESSAG
 	appendPQExpBuffer(set, " SET ");
 	for (i = 0; i < new_tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		/* An unchanged toasted value is not sent, keep it */
+		if (DECODE_ATTNAME(msg, i) == NULL || !DECODE_CHANGED(new_tuple, i))
 		{
 			continue;
 		}
@@ -402,7 +419,7 @@ append_update_statement_full_row(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE
 	appendPQExpBuffer(where, " WHERE ");
 	for (i = 0; i < old_tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			droped[i] = true;
 			continue;
@@ -418,7 +435,7 @@ append_update_statement_full_row(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE
 		}
 
 		old_isnull[i] = append_values(hander, msg, where, old_tuple, i);
-		if (old_tuple->isnull[i] && old_tuple->changed[i] == false && old_tuple->svalues[i] == NULL)
+		if (DECODE_ISNULL(old_tuple, i) && !DECODE_CHANGED(old_tuple, i) && old_tuple->svalues[i] == NULL)
 		{
 			uchange_toast[i] = true;
 		}
@@ -432,7 +449,7 @@ append_update_statement_full_row(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE
 			continue;
 		}
 		
-		if (new_tuple->isnull[i] && new_tuple->changed[i] && new_tuple->svalues[i] == NULL)
+		if (DECODE_ISNULL(new_tuple, i) && DECODE_CHANGED(new_tuple, i) && new_tuple->svalues[i] == NULL)
 		{
 			if (old_isnull[i])
 			{
@@ -447,7 +464,7 @@ append_update_statement_full_row(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE
 				change[i] = true;
 			}
 		}
-		else if (new_tuple->isnull[i] && new_tuple->changed[i] == false && new_tuple->svalues[i] == NULL)
+		else if (DECODE_ISNULL(new_tuple, i) && !DECODE_CHANGED(new_tuple, i) && new_tuple->svalues[i] == NULL)
 		{
 			if (old_isnull[i])
 			{
@@ -479,7 +496,7 @@ append_update_statement_full_row(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE
 					fprintf(stderr, "invalid old or new tuple data");
 					change[i] = false;
 				}
-				else if (strcmp(new_tuple->svalues[i], old_tuple->svalues[i]) == 0)
+				else if (column_value_equal(new_tuple, old_tuple, i))
 				{
 					change[i] = false;
 				}
@@ -539,7 +556,7 @@ append_update_statement_key_not_change(Decoder_handler *hander, ALI_PG_DECODE_ME
 	appendPQExpBuffer(where, " WHERE ");
 	for (i = 0; i < new_tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL)
 		{
 			continue;
 		}
@@ -549,7 +566,7 @@ append_update_statement_key_not_change(Decoder_handler *hander, ALI_PG_DECODE_ME
 
 			if (msg->k_natt > 0)
 			{
-				is_key = is_key_column(msg, msg->attname[i]);
+				is_key = is_key_column(msg, DECODE_ATTNAME(msg, i));
 				if (is_key == false)
 					continue;
 			}
@@ -572,7 +589,7 @@ append_update_statement_key_not_change(Decoder_handler *hander, ALI_PG_DECODE_ME
 	appendPQExpBuffer(set, " SET ");
 	for (i = 0; i < new_tuple->natt; i++)
 	{
-		if (msg->attname[i] == NULL)
+		if (DECODE_ATTNAME(msg, i) == NULL || !DECODE_CHANGED(new_tuple, i))
 		{
 			continue;
 		}
@@ -581,7 +598,7 @@ append_update_statement_key_not_change(Decoder_handler *hander, ALI_PG_DECODE_ME
 			bool is_key = false;
 			if (msg->k_natt > 0)
 			{
-				is_key = is_key_column(msg, msg->attname[i]);
+				is_key = is_key_column(msg, DECODE_ATTNAME(msg, i));
 				if (is_key == true)
 					continue;
 			}
@@ -658,6 +675,29 @@ out_put_tuple_to_sql(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpB
 			}
 			break;
 
+		case MSGKIND_TRUNCATE:
+			{
+				int		i;
+
+				appendPQExpBuffer(buffer, "TRUNCATE TABLE ");
+				for (i = 0; i < msg->nrels; i++)
+					appendPQExpBuffer(buffer, "%s%s.%s", i > 0 ? ", " : "",
+									  msg->rels[i]->schemaname, msg->rels[i]->relname);
+				if (msg->truncate_flags & DECODE_TRUNCATE_RESTART_SEQS)
+					appendPQExpBuffer(buffer, " RESTART IDENTITY");
+				if (msg->truncate_flags & DECODE_TRUNCATE_CASCADE)
+					appendPQExpBuffer(buffer, " CASCADE");
+				appendPQExpBuffer(buffer, ";");
+			}
+			break;
+
+		/* Bounds of a streamed transaction, the receiver spools it */
+		case MSGKIND_STREAM_START:
+		case MSGKIND_STREAM_STOP:
+		case MSGKIND_STREAM_COMMIT:
+		case MSGKIND_STREAM_ABORT:
+			break;
+
 		default:
 			{
 				fprintf(stderr, "unknown action of type %c", kind);
@@ -745,6 +785,21 @@ out_put_decode_message(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, int
 					}
 				}
 				break;
+			case MSGKIND_TRUNCATE:
+				{
+					int		i;
+
+					appendPQExpBuffer(buffer, "TRUNCATE TABLE");
+					for (i = 0; i < msg->nrels; i++)
+						appendPQExpBuffer(buffer, " %s.%s", msg->rels[i]->schemaname, msg->rels[i]->relname);
+					appendPQExpBuffer(buffer, "\n");
+				}
+				break;
+			case MSGKIND_STREAM_START:
+			case MSGKIND_STREAM_STOP:
+			case MSGKIND_STREAM_COMMIT:
+			case MSGKIND_STREAM_ABORT:
+				break;
 
 			default:
 				fprintf(stderr, "unknown action of type %c", msgkind);
@@ -1059,6 +1114,9 @@ sendFeedback(Decoder_handler *hander, int64 now, bool force, bool replyRequested
 		hander->last_recvpos == hander->recvpos)
 		return true;
 
+	if (hander->get_flushpos != NULL)
+		hander->flushpos = Max(hander->flushpos, hander->get_flushpos(hander->flushpos_arg));
+
 	fprintf(stderr,"%s: confirming recv up to %X/%X, flush to %X/%X (slot %s)\n",
 				hander->progname,
 				(uint32) (hander->recvpos >> 32), (uint32) hander->recvpos,
@@ -1268,8 +1326,8 @@ create_replication_slot(Decoder_handler *hander,XLogRecPtr *lsn, char *replicati
 					_("%s: creating replication slot \"%s\"\n"),
 					hander->progname, replication_slot);
 
-		snprintf(query, sizeof(query), "CREATE_REPLICATION_SLOT \"%s\" LOGICAL \"ali_decoding\"",
-				 replication_slot);
+		snprintf(query, sizeof(query), "CREATE_REPLICATION_SLOT \"%s\" LOGICAL \"%s\"",
+				 replication_slot, hander->pgoutput ? "pgoutput" : "ali_decoding");
 
 		res = PQexec(hander->conn, query);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
@@ -1345,6 +1403,55 @@ init_logfile(Decoder_handler *hander)
 	return 0;
 }
 
+/* Column types of the published tables, pgoutput sends all of them in binary */
+#define PGOUTPUT_PUBLISHED_TYPES \
+	"SELECT DISTINCT pg_catalog.format_type(a.atttypid, a.atttypmod) " \
+	"FROM pg_catalog.pg_publication_tables p JOIN pg_catalog.pg_attribute a " \
+	"ON a.attrelid = (pg_catalog.quote_ident(p.schemaname) || '.' || pg_catalog.quote_ident(p.tablename))::pg_catalog.regclass " \
+	"WHERE p.pubname = ANY (pg_catalog.regexp_split_to_array(%s, '\\s*,\\s*')) " \
+	"AND a.attnum > 0 AND NOT a.attisdropped"
+
+/*
+ * Whether the client reads the binary values of every column published to
+ * the stream.  Checked before the stream starts, since pgoutput cannot be
+ * asked for text per column and a value the client cannot read would stop
+ * the stream.
+ */
+static bool
+pgoutput_binary_supported(Decoder_handler *hander)
+{
+	char	   *names = PQescapeLiteral(hander->conn, hander->publication_names,
+										strlen(hander->publication_names));
+	PQExpBuffer query = createPQExpBuffer();
+	PGresult   *res;
+	bool		supported = true;
+	int			i;
+
+	appendPQExpBuffer(query, PGOUTPUT_PUBLISHED_TYPES, names);
+	PQfreemem(names);
+
+	res = PQexec(hander->conn, query->data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "%s: get column types of publications %s failed: %s",
+				hander->progname, hander->publication_names, PQerrorMessage(hander->conn));
+		supported = false;
+	}
+	for (i = 0; supported && i < PQntuples(res); i++)
+	{
+		if (!binary_type_supported(PQgetvalue(res, i, 0)))
+		{
+			fprintf(stderr, "%s: published column type %s has no binary form the client reads\n",
+					hander->progname, PQgetvalue(res, i, 0));
+			supported = false;
+		}
+	}
+	PQclear(res);
+	destroyPQExpBuffer(query);
+
+	return supported;
+}
+
 int
 init_streaming(Decoder_handler *hander)
 {
@@ -1370,8 +1477,45 @@ init_streaming(Decoder_handler *hander)
 	appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (",
 			 hander->replication_slot, (uint32) (hander->startpos >> 32), (uint32) hander->startpos);
 
-	appendPQExpBuffer(query, "version '%u'", PG_VERSION_NUM);
-	appendPQExpBuffer(query, ", encoding '%s'", "UTF8");
+	/* The new stream describes every relation again */
+	if (hander->relation_cache || hander->pgoutput)
+	{
+		if (hander->relcache == NULL)
+			hander->relcache = (DecodeRelCache *) palloc0(sizeof(DecodeRelCache));
+		else
+			decode_relcache_reset(hander->relcache);
+	}
+
+	if (hander->pgoutput)
+	{
+		/* Protocol 2, which streams large transactions, and binary need 14 */
+		int			server_version = PQserverVersion(hander->conn);
+
+		hander->streaming = server_version >= 140000;
+		hander->stream.active = false;
+		appendPQExpBuffer(query, "proto_version '%d'", hander->streaming ? 2 : 1);
+		/* The replication grammar knows no E'' strings, only doubled quotes */
+		appendPQExpBufferStr(query, ", publication_names ");
+		append_quoted_csv(query, hander->publication_names, strlen(hander->publication_names));
+		if (hander->streaming)
+			appendPQExpBuffer(query, ", streaming 'on'");
+		if (hander->binary_values && server_version < 140000)
+			fprintf(stderr, "%s: pgoutput sends binary values from 14 on, values come as text\n",
+					hander->progname);
+		else if (hander->binary_values && !pgoutput_binary_supported(hander))
+			fprintf(stderr, "%s: values come as text\n", hander->progname);
+		else if (hander->binary_values)
+			appendPQExpBuffer(query, ", binary 'true'");
+	}
+	else
+	{
+		appendPQExpBuffer(query, "version '%u'", PG_VERSION_NUM);
+		appendPQExpBuffer(query, ", encoding '%s'", "UTF8");
+		if (hander->relation_cache)
+			appendPQExpBuffer(query, ", relation_cache 'on'");
+		if (hander->binary_values)
+			appendPQExpBuffer(query, ", binary_values 'on'");
+	}
 	appendPQExpBufferChar(query, ')');
 
 	res = PQexec(hander->conn, query->data);
@@ -1396,17 +1540,63 @@ init_streaming(Decoder_handler *hander)
 }
 
 /*
- * Start the log streaming
+ * Start the log streaming, and decode the next message that carries a
+ * change or a transaction boundary.
  */
 ALI_PG_DECODE_MESSAGE *
 exec_logical_decoder(Decoder_handler *hander, volatile bool *time_to_stop)
+{
+	StringInfoData s;
+	bool		rc;
+
+	while (exec_logical_receive(hander, time_to_stop, &s))
+	{
+		decode_message_reset(&hander->msg, &hander->arena);
+		hander->msg.relcache = hander->relcache;
+		if (hander->pgoutput)
+		{
+			hander->msg.stream = &hander->stream;
+			rc = pgoutput_process_action(&s, &hander->msg);
+		}
+		else
+			rc = bdr_process_remote_action(&s, &hander->msg);
+		if (rc == false)
+		{
+			if (hander->copybuf != NULL)
+			{
+				PQfreemem(hander->copybuf);
+				hander->copybuf = NULL;
+			}
+			PQfinish(hander->conn);
+			hander->conn = NULL;
+			return NULL;
+		}
+
+		/* Only fills the relation cache, or nothing to apply */
+		if (hander->msg.type == MSGKIND_RELATION || hander->msg.type == MSGKIND_TYPE ||
+			hander->msg.type == MSGKIND_UNKNOWN)
+			continue;
+
+		return &hander->msg;
+	}
+
+	return NULL;
+}
+
+/*
+ * Receive the next message of the stream, answering keepalives on the way.
+ * s is set to the message after the XLogData header, it lives in
+ * hander->copybuf until the next call.  Returns false at the end of the
+ * stream or on error, which closes the connection.
+ */
+bool
+exec_logical_receive(Decoder_handler *hander, volatile bool *time_to_stop, StringInfo s)
 {
 	PGresult   *res = NULL;
 	int 		r;
 	int64		now;
 	int 		hdr_len;
 	bool		in_redo = false;
-	bool		rc = false;
 
 redo:
 
@@ -1418,7 +1608,7 @@ redo:
 
     if (*time_to_stop == true)
     {
-        return NULL;
+        return false;
     }
 
 	/*
@@ -1524,7 +1714,7 @@ redo:
 			goto error;
 		}
 		PQclear(res);
-		return NULL;
+		return false;
 	}
 	else if (r == -2)
 	{
@@ -1534,15 +1724,14 @@ redo:
 	}
 	else
 	{
-		StringInfoData s;
 		char c;
 		
-		initStringInfo(&s);
-		s.data = hander->copybuf;
-		s.len = r;
-		s.maxlen = -1;
+		s->data = hander->copybuf;
+		s->len = r;
+		s->maxlen = -1;
+		s->cursor = 0;
 
-		c = pq_getmsgbyte(&s);
+		c = pq_getmsgbyte(s);
 	
 		/* Check the message type. */
 		if (c == 'k')
@@ -1607,9 +1796,9 @@ redo:
 				goto error;
 			}
 		
-			start_lsn = pq_getmsgint64(&s);
-			end_lsn = pq_getmsgint64(&s);
-			pq_getmsgint64(&s);
+			start_lsn = pq_getmsgint64(s);
+			end_lsn = pq_getmsgint64(s);
+			pq_getmsgint64(s);
 		
 			if (last_received < start_lsn)
 				last_received = start_lsn;
@@ -1618,12 +1807,6 @@ redo:
 				last_received = end_lsn;
 
 			hander->recvpos = last_received;
-			memset(&hander->msg, 0, sizeof(ALI_PG_DECODE_MESSAGE));
-			rc = bdr_process_remote_action(&s, &hander->msg);
-			if (rc == false)
-			{
-				goto error;
-			}
 		}
 		else
 		{
@@ -1645,7 +1828,7 @@ redo:
 		hander->last_status = now;
 	}
 	
-	return &hander->msg;
+	return true;
 
 error:
 
@@ -1657,7 +1840,7 @@ error:
 	PQfinish(hander->conn);
 	hander->conn = NULL;
 
-	return NULL;
+	return false;
 }
 
 void
@@ -1684,10 +1867,6 @@ pg_sleep(long microsec)
 static void
 quote_literal_local(Decoder_handler *hander, const char *rawstr, char *type, PQExpBuffer buffer)
 {
-	char	   *result;
-	int			len;
-	int			newlen;
-	StringInfo	s = hander->buffer;
 	bool need_process = true;
 
 	if (strcmp(type, "smallint") == 0)
@@ -1734,16 +1913,7 @@ quote_literal_local(Decoder_handler *hander, const char *rawstr, char *type, PQE
 		return;
 	}
 
-	len = strlen(rawstr);
-	resetStringInfo(s);
-	appendStringInfoSpaces(s, len * 2 + 3);
-
-	result = s->data;
-
-	newlen = quote_literal_internal(result, rawstr, len);
-	result[newlen] = '\0';
-
-	appendPQExpBuffer(buffer, "%s", result);
+	append_quoted_literal(buffer, rawstr, strlen(rawstr));
 
 	return;
 }
@@ -1806,23 +1976,50 @@ append_values(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, PQExpBuffer b
 {
 	bool isnull = false;
 
-	if (tuple->isnull[i] && tuple->changed[i] && tuple->svalues[i] == NULL)
+	if (DECODE_ISNULL(tuple, i) && DECODE_CHANGED(tuple, i) && tuple->svalues[i] == NULL)
 	{
-		appendPQExpBuffer(buffer, "%s", msg->attname[i]);
+		appendPQExpBuffer(buffer, "%s", DECODE_ATTNAME(msg, i));
 		appendPQExpBuffer(buffer, "=");
 		appendPQExpBuffer(buffer, "null");	
 		isnull = true;
 	}
 	else
 	{
-		appendPQExpBuffer(buffer, "%s", msg->attname[i]);
+		appendPQExpBuffer(buffer, "%s", DECODE_ATTNAME(msg, i));
 		appendPQExpBuffer(buffer, "=");
-		quote_literal_local(hander, tuple->svalues[i], msg->atttype[i], buffer);
+		append_column_value(hander, msg, tuple, i, buffer);
 	}
 
 	return isnull;
 }
 
+/*
+ * Append a column value as a SQL literal, a text value as the plugin sent
+ * it, a binary one rendered from its type.
+ */
+static void
+append_column_value(Decoder_handler *hander, ALI_PG_DECODE_MESSAGE *msg, Decode_TupleData *tuple, int i, PQExpBuffer buffer)
+{
+	if (tuple->formats[i] == 't')
+		quote_literal_local(hander, tuple->svalues[i], DECODE_ATTTYPE(msg, i), buffer);
+	else
+		append_binary_literal(buffer, DECODE_ATTTYPE(msg, i), tuple->svalues[i], tuple->lengths[i]);
+}
+
+/* Whether a column has the same value in both tuples */
+static bool
+column_value_equal(Decode_TupleData *a, Decode_TupleData *b, int i)
+{
+	if (a->formats[i] != b->formats[i])
+		return false;
+
+	if (a->formats[i] == 't')
+		return strcmp(a->svalues[i], b->svalues[i]) == 0;
+
+	return a->lengths[i] == b->lengths[i] &&
+		memcmp(a->svalues[i], b->svalues[i], a->lengths[i]) == 0;
+}
+
 /*----------------------------------------------------------
  * Formatting and conversion routines.
  *---------------------------------------------------------*/